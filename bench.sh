@@ -0,0 +1,32 @@
+#!/bin/bash
+# build hwwm-bench against a scratch tree and run it; arguments go to hwwm-bench,
+# the JSON result goes to stdout. The tree is made anew each run in hwwm-bench.d under
+# BENCH_ROOT - only that is ever removed; keep it on a tmpfs:
+#   BENCH_ROOT=/dev/shm ./bench.sh -n 200 -d 750 > bench.json
+case "${BENCH_ROOT:-/dev/shm}" in
+    /*) ;;
+    *) echo "$(tput setaf 7)$(tput setab 1)ERROR: BENCH_ROOT must be an absolute path, like /dev/shm$(tput sgr0)" >&2
+       exit 2 ;;
+esac
+bench_root="${BENCH_ROOT:-/dev/shm}"
+bench_root="${bench_root%/}/hwwm-bench.d"
+
+git describe --tag 1>/dev/null 2>&1
+if (( $? > 0 ))
+then
+    bench_ver="STANDALONE-`date '+%F--%T'`"
+else
+    bench_ver=`git describe --tag`
+fi
+
+gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$bench_ver\" -DFILES_ROOT=\"$bench_root\" -DSYSFS_ROOT=\"$bench_root/sys\" \
+    -Wall -Wno-unused-result -O3 -pthread -o hwwm-bench hwwm-bench.c -lm -lz 1>&2
+if (( $? > 0 ))
+then
+    echo "$(tput setaf 7)$(tput setab 1)ERROR: hwwm-bench compilation failed!$(tput sgr0)" >&2
+    exit 255
+fi
+
+rm -rf "$bench_root"
+./hwwm-bench "$@"
+#EOF
@@ -26,7 +26,7 @@ then
 #    echo "$(tput setaf 3)Previous compile result: renamed for now.$(tput sgr0)"
 fi
 
-gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -o $daemon_name $daemon_name.c
+gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -pthread -o $daemon_name $daemon_name.c -lm -lz
 if (( $? > 0 ))
 then
     mv $daemon_name.prev $daemon_name
@@ -40,4 +40,29 @@ else
 #  on success, update the permissions of the update-executable script
     chmod +x scripts/update-hwwm-executable.sh
 fi
+
+echo "$(tput setaf 3)Starting $(tput setaf 6)$daemon_name-query$(tput setaf 3) compilation...$(tput sgr0)"
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -o $daemon_name-query $daemon_name-query.c ${daemon_name}_history.c -lz
+if (( $? > 0 ))
+then
+    echo "$(tput setaf 7)$(tput setab 1)ERROR: $daemon_name-query compilation failed!$(tput sgr0)"
+    exit 254
+else
+    echo "$(tput setaf 2)$(tput smso)$daemon_name-query compilation SUCCESS!$(tput rmso)$(tput sgr0)"
+fi
+
+echo "$(tput setaf 3)Starting $(tput setaf 6)lib$daemon_name.a$(tput setaf 3) compilation...$(tput sgr0)"
+# only the hwwm_* API stays global - the rest of the daemon must not clash with the user's code
+gcc -D_FORTIFY_SOURCE=2 -DHWWM_LIB -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -pthread -fPIC -c -o lib$daemon_name.o $daemon_name.c && \
+objcopy --keep-global-symbol=hwwm_new --keep-global-symbol=hwwm_step --keep-global-symbol=hwwm_free lib$daemon_name.o && \
+rm -f lib$daemon_name.a && ar rcs lib$daemon_name.a lib$daemon_name.o
+if (( $? > 0 ))
+then
+    rm -f lib$daemon_name.o
+    echo "$(tput setaf 7)$(tput setab 1)ERROR: lib$daemon_name.a compilation failed!$(tput sgr0)"
+    exit 253
+else
+    rm -f lib$daemon_name.o
+    echo "$(tput setaf 2)$(tput smso)lib$daemon_name.a compilation SUCCESS!$(tput rmso)$(tput sgr0)"
+fi
 #EOF
\ No newline at end of file
@@ -0,0 +1,358 @@
+/*
+* hwwm-bench.c
+*
+* Benchmark of the hwwm control cycle against a fake sysfs and 1-wire tree.
+* Plamen Petrov
+*
+* Built and run by bench.sh: all of hwwm.c is compiled in (but its main()), with
+* FILES_ROOT and SYSFS_ROOT pointing to a scratch tree - best on a tmpfs. The tree gets
+* gpio value/direction files and the w1_slave files of 5 fake DS18B20s. With -d every
+* w1_slave is a FIFO instead, served that many ms after it is opened - like a real
+* conversion on the bus (a DS18B20 takes 750 ms at 12 bits).
+* The result is one JSON object on stdout: wall time of a cycle, read and write
+* syscalls per cycle (from /proc/self/io, sensor reader threads included), and ns per
+* call of the hot functions (LogFormat: LogData() but the file writes). The outputs get
+* written on the control thread, unless -w starts the sink threads as the daemon does.
+* With -r there is no timing: a state with the heater ON is saved and restored as on a
+* restart, and the heater must then keep OFF for its min_off cycles (exit status 4 if not).
+*   BENCH_ROOT=/dev/shm ./bench.sh -n 200 -d 750 > bench.json
+*/
+
+#define HWWM_BENCH
+#include "hwwm.c"
+
+#define BENCH_SENSORS       TOTALSENSORS
+#define BENCH_WARMUP        5
+#define BENCH_MAXCYCLES     100000
+
+/* the settings of scripts/etc/hwwm.cfg; the sensors get added */
+const char *bench_cfg = "mode=1\nwanted_T=40\nuse_electric_heater_night=1\nuse_electric_heater_day=1\n"
+    "use_pump1=1\nuse_pump2=1\nnight_boost_planner=1\nabs_max=63\nmax_big_consumers=1\nuse_acs=1\n"
+    "commspin1_pin=17\ncommspin2_pin=18\ncommspin3_pin=27\ncommspin4_pin=22\nbat_powered_pin=7\n"
+    "invert_output=1\npump1_pin=5\npump2_pin=6\nvalve1_pin=13\nel_heater_pin=16\n";
+
+/* fake temps of the sensors, as in tkotel_sensor..tenv_sensor */
+const float bench_temps[BENCH_SENSORS+1] = { 0, 45.5, 61.25, 48.0, 40.125, 12.5 };
+
+char bench_w1[BENCH_SENSORS+1][120];
+char bench_paths[BENCH_SENSORS+1][MAXLEN];
+long bench_delay_ms = 0;
+/* writes of the FIFO servers - not hwwm's, so taken off the syscall counts */
+unsigned long bench_served = 0;
+
+volatile long bench_sink;
+
+long long
+bench_ns() {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec*1000000000LL + t.tv_nsec;
+}
+
+/* w1_slave text of a DS18B20 reading t C - scratchpad, CRC and all */
+void
+bench_w1_text(char *buf, float t) {
+    unsigned char sp[9];
+    short raw = (short)lroundf(t * 16);
+    char *p = buf;
+
+    sp[0] = raw & 0xff; sp[1] = (raw >> 8) & 0xff;
+    sp[2] = 0x4b; sp[3] = 0x46; sp[4] = 0x7f; sp[5] = 0xff; sp[6] = 0x0c; sp[7] = 0x10;
+    sp[8] = crc8_1wire(sp, 8);
+    for (short i=0;i<9;i++) p += sprintf(p, "%02x ", sp[i]);
+    p += sprintf(p, ": crc=%02x YES\n", sp[8]);
+    for (short i=0;i<9;i++) p += sprintf(p, "%02x ", sp[i]);
+    sprintf(p, "t=%ld\n", (long)raw * 1000 / 16);
+}
+
+short
+bench_mkdirs(const char *path) {
+    char tmp[300];
+
+    snprintf(tmp, sizeof tmp, "%s", path);
+    for (char *p=tmp+1;*p;p++) {
+        if (*p != '/') continue;
+        *p = 0;
+        if (mkdir(tmp, 0755) && (errno != EEXIST)) return 0;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) && (errno != EEXIST)) return 0;
+    return 1;
+}
+
+short
+bench_file(const char *path, const char *content) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 0;
+    fputs(content, fp);
+    return fclose(fp) == 0;
+}
+
+/* serves a w1_slave FIFO: once per round of reads, the reader that opens it gets the
+   text after the delay (an open in the same round would find the last reader still
+   there - and not wait for a new one) */
+void *
+bench_serve(void *arg) {
+    long i = (long)arg;
+    struct timespec d = { bench_delay_ms / 1000, (bench_delay_ms % 1000) * 1000000L };
+    unsigned long round = 0;
+    int fd;
+
+    while (1) {
+        pthread_mutex_lock( &acq_lock );
+        while (acq_round == round) pthread_cond_wait( &acq_start, &acq_lock );
+        round = acq_round;
+        pthread_mutex_unlock( &acq_lock );
+        fd = open(bench_paths[i], O_WRONLY);
+        if (fd < 0) continue;
+        nanosleep(&d, NULL);
+        write(fd, bench_w1[i], strlen(bench_w1[i]));
+        close(fd);
+        __atomic_add_fetch(&bench_served, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* the scratch tree and a config using it; return 0 on error */
+short
+bench_tree() {
+    char path[300], cfgtext[1200];
+    const char *keys[BENCH_SENSORS+1] = { "", "tkotel_sensor", "tkolektor_sensor", "tboilerh_sensor",
+                                          "tboilerl_sensor", "tenv_sensor" };
+    pthread_t th;
+
+    if (!bench_mkdirs(FILES_ROOT "/var/log") || !bench_mkdirs(FILES_ROOT "/run/shm") ||
+        !bench_mkdirs(FILES_ROOT "/etc") || !bench_mkdirs(SYSFS_ROOT "/class/gpio")) return 0;
+    if (!bench_file(SYSFS_ROOT "/class/gpio/export", "") || !bench_file(SYSFS_ROOT "/class/gpio/unexport", "")) return 0;
+    for (short pin=0;pin<=40;pin++) {
+        snprintf(path, sizeof path, SYSFS_ROOT "/class/gpio/gpio%d", pin);
+        if (!bench_mkdirs(path)) return 0;
+        snprintf(path, sizeof path, SYSFS_ROOT "/class/gpio/gpio%d/direction", pin);
+        if (!bench_file(path, "in\n")) return 0;
+        snprintf(path, sizeof path, SYSFS_ROOT "/class/gpio/gpio%d/value", pin);
+        if (!bench_file(path, "0\n")) return 0;
+    }
+
+    strcpy(cfgtext, bench_cfg);
+    for (long i=1;i<=BENCH_SENSORS;i++) {
+        bench_w1_text(bench_w1[i], bench_temps[i]);
+        snprintf(path, sizeof path, SYSFS_ROOT "/bus/w1/devices/28-00000000000%ld", i);
+        if (!bench_mkdirs(path)) return 0;
+        snprintf(bench_paths[i], MAXLEN, SYSFS_ROOT "/bus/w1/devices/28-00000000000%ld/w1_slave", i);
+        unlink(bench_paths[i]);
+        if (bench_delay_ms) {
+            if (mkfifo(bench_paths[i], 0644)) return 0;
+            if (pthread_create(&th, NULL, bench_serve, (void *)i)) return 0;
+        }
+        else if (!bench_file(bench_paths[i], bench_w1[i])) return 0;
+        sprintf(cfgtext + strlen(cfgtext), "%s=%s\n", keys[i], bench_paths[i]);
+    }
+    /* a plain one for timing sensorRead() itself */
+    if (!bench_mkdirs(SYSFS_ROOT "/bus/w1/devices/28-00000000000f")) return 0;
+    if (!bench_file(SYSFS_ROOT "/bus/w1/devices/28-00000000000f/w1_slave", bench_w1[1])) return 0;
+    return bench_file(CONFIG_FILE, cfgtext);
+}
+
+/* read and write syscalls of the whole process so far */
+void
+bench_syscalls(unsigned long long *r, unsigned long long *w) {
+    char line[80];
+    FILE *fp = fopen("/proc/self/io", "r");
+
+    *r = *w = 0;
+    if (fp == NULL) return;
+    while (fgets(line, sizeof line, fp)) {
+        sscanf(line, "syscr: %llu", r);
+        sscanf(line, "syscw: %llu", w);
+    }
+    fclose(fp);
+}
+
+int
+bench_cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* a control cycle as the daemon runs it */
+void
+bench_cycle() {
+    cycle_time = time(NULL);
+    if ( just_started ) just_started--;
+    RunCycle();
+    StartSensorsAcquisition();
+    ProgramRunCycles++;
+}
+
+/* restart check: the state is saved with the heater ON and restored as a restarted (not
+   handed over) hwwm would - its relays dropped with the old process, so the heater must
+   stay OFF for min_off cycles though forced ON, and then go ON; return 0 if not */
+short
+bench_restart() {
+    const struct device *h = NULL;
+    long n;
+
+    for (short i=0;i<devices_count;i++) if (devices[i].bit == DEV_HEATER) h = &devices[i];
+    if ((h == NULL) || (state_map == NULL)) return 0;
+    /* the tree is new - this just puts the header into the state file */
+    RestoreState();
+    for (n=0;n<BENCH_WARMUP;n++) bench_cycle();
+    CHeater = 1;
+    SCHeater = h->min_on;
+    SaveState();
+    CHeater = 0;
+    state_seq = 0;
+    if (!RestoreState() || CHeater) return 0;
+    forced_on |= DEV_HEATER;
+    forced_until[h - devices] = time(NULL) + 3600;
+    for (n=0;(n<h->min_off+10)&&!CHeater;n++) bench_cycle();
+    printf("{\"version\":\"%s\",\"restart_check\":{\"min_off\":%lu,\"heater_off_cycles\":%ld}}\n", PGMVER,
+           h->min_off, n);
+    return CHeater && (n >= h->min_off);
+}
+
+/* ns per call of the hot spots, with the controller as the cycles left it */
+void
+bench_ops(long n) {
+    const char *ops[6] = { "sensorParse", "sensorRead", "log_message", "LogData", "LogFormat", "ComputeWantedState" };
+    static struct snapshot snap;
+    static char buf[1600];
+    struct text t;
+    long long t0, ns[6];
+    long m;
+    short err;
+
+    t0 = bench_ns();
+    for (long k=0;k<n*10;k++) { sensorParse(bench_w1[1], &m); bench_sink += m; }
+    ns[0] = (bench_ns() - t0) / (n*10);
+    t0 = bench_ns();
+    for (long k=0;k<n;k++) bench_sink += sensorRead(SYSFS_ROOT "/bus/w1/devices/28-00000000000f/w1_slave", &err);
+    ns[1] = (bench_ns() - t0) / n;
+    t0 = bench_ns();
+    for (long k=0;k<n;k++) log_message(FILES_ROOT "/var/log/hwwm_bench.log", "INFO: hwwm-bench log_message() timing line.");
+    ns[2] = (bench_ns() - t0) / n;
+    t0 = bench_ns();
+    for (long k=0;k<n;k++) LogData(DevicesState());
+    ns[3] = (bench_ns() - t0) / n;
+    /* LogData() without the files: the snapshot and its three formats */
+    t0 = bench_ns();
+    for (long k=0;k<n;k++) {
+        SnapshotTake( &snap, DevicesState() );
+        SnapshotLine( &snap, TextStart( &t, buf, sizeof buf ) );
+        SnapshotTable( &snap, TextStart( &t, buf, sizeof buf ) );
+        SnapshotJSON( &snap, TextStart( &t, buf, sizeof buf ) );
+        bench_sink += t.len;
+    }
+    ns[4] = (bench_ns() - t0) / n;
+    t0 = bench_ns();
+    for (long k=0;k<n*10;k++) bench_sink += ComputeWantedState();
+    ns[5] = (bench_ns() - t0) / (n*10);
+
+    printf(",\"ns_per_op\":{");
+    for (short i=0;i<6;i++) printf("%s\"%s\":%lld", i ? "," : "", ops[i], ns[i]);
+    printf("}");
+}
+
+void
+usage() {
+    printf("Usage: hwwm-bench [-n cycles] [-d sensor_delay_ms] [-s sleep_ms] [-o ops] [-w]\n");
+    printf("  cycles: control cycles timed, default 100 (after %d warm-up ones)\n", BENCH_WARMUP);
+    printf("  sensor_delay_ms: w1_slave reads take this long, default 0\n");
+    printf("  sleep_ms: idle time between cycles, when sensor reads run; default 0\n");
+    printf("  ops: calls per function in the ns/op part, default 20000\n");
+    printf("  -w: write the outputs from the sink threads, as the daemon does\n");
+    printf("  -r: no timing - check a restart keeps the heater OFF for its min_off, exit 4 if not\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    long cycles = 100, sleep_ms = 0, ops = 20000, n;
+    short threaded = 0, restart = 0;
+    long long *wall, t0, t1, sum = 0;
+    unsigned long long r0, w0, r1, w1, rs = 0, ws = 0, ovr = 0, ovw = 0;
+    unsigned long served0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:s:o:wrh")) != -1) {
+        switch (opt) {
+            case 'n': cycles = atol(optarg); break;
+            case 'd': bench_delay_ms = atol(optarg); break;
+            case 's': sleep_ms = atol(optarg); break;
+            case 'o': ops = atol(optarg); break;
+            case 'w': threaded = 1; break;
+            case 'r': restart = 1; break;
+            default: usage(); return 1;
+        }
+    }
+    if ((cycles < 1) || (cycles > BENCH_MAXCYCLES) || (bench_delay_ms < 0) ||
+        (bench_delay_ms >= SENSOR_DEADLINE_MS) || (sleep_ms < 0) || (ops < 1)) {
+        usage();
+        return 1;
+    }
+    wall = malloc(cycles * sizeof *wall);
+    if (wall == NULL) return 3;
+    if (!bench_tree()) {
+        fprintf(stderr, "hwwm-bench: cannot make the scratch tree under "FILES_ROOT"\n");
+        return 2;
+    }
+
+    /* start up as the daemon does */
+    SetDefaultCfg();
+    just_started = 4;
+    parse_config();
+    StateOpen();
+    cycle_time = time(NULL);
+    JournalOpen( 0 );
+    if ( !EnableGPIOpins() || !SetGPIODirection() || !StartSensorReaders() || (threaded && !SinksStart()) ) {
+        fprintf(stderr, "hwwm-bench: cannot start up on the scratch tree\n");
+        return 2;
+    }
+    StartSensorsAcquisition();
+    ControlStateToGPIO();
+    GetCurrentTime();
+    if (restart) {
+        n = bench_restart();
+        fflush(stdout);
+        if (!n) fprintf(stderr, "hwwm-bench: the heater did not keep its min_off over a restart\n");
+        _exit(n ? 0 : 4);
+    }
+
+    /* what looking at /proc/self/io costs by itself */
+    bench_syscalls(&r0, &w0);
+    bench_syscalls(&ovr, &ovw);
+    ovr -= r0;
+    ovw -= w0;
+
+    for (n=-BENCH_WARMUP;n<cycles;n++) {
+        served0 = __atomic_load_n(&bench_served, __ATOMIC_RELAXED);
+        bench_syscalls(&r0, &w0);
+        t0 = bench_ns();
+        bench_cycle();
+        t1 = bench_ns();
+        /* the reads started above run now - their syscalls are still this cycle's */
+        if (sleep_ms) CycleSleep(sleep_ms * 1000);
+        if (n < 0) continue;
+        wall[n] = t1 - t0;
+        bench_syscalls(&r1, &w1);
+        sum += wall[n];
+        rs += r1 - r0 - ovr;
+        ws += w1 - w0 - ovw - (__atomic_load_n(&bench_served, __ATOMIC_RELAXED) - served0);
+    }
+    qsort(wall, cycles, sizeof *wall, bench_cmp);
+
+    printf("{\"version\":\"%s\",\"cycles\":%ld,\"sensor_delay_ms\":%ld,\"sleep_ms\":%ld,\"sink_threads\":%d", PGMVER,
+           cycles, bench_delay_ms, sleep_ms, threaded);
+    printf(",\"cycle_us\":{\"min\":%.1f,\"avg\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"max\":%.1f}",
+           wall[0] / 1000.0, sum / 1000.0 / cycles, wall[cycles/2] / 1000.0,
+           wall[(cycles*99)/100] / 1000.0, wall[cycles-1] / 1000.0);
+    printf(",\"syscalls_per_cycle\":{\"read\":%.1f,\"write\":%.1f}", (double)rs / cycles, (double)ws / cycles);
+    bench_ops(ops);
+    printf("}\n");
+    free(wall);
+    fflush(stdout);
+    /* the sensor readers and FIFO servers may be blocked - do not wait for them */
+    _exit(0);
+}
+
+/* EOF */
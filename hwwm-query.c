@@ -0,0 +1,186 @@
+/*
+* hwwm-query.c
+*
+* Command line companion of hwwm: answers time range queries over hwwm data logs.
+* Plamen Petrov
+*
+* Example - furnace temp for a day, 288 points (one per 5 minutes):
+*   hwwm-query -c Tkotel -f "2020-11-02 00:00" -t "2020-11-03 00:00" -n 288 /var/log/hwwm_data.log
+* Output is CSV (time,count,min,max,avg) or JSON with -j. Empty buckets are skipped.
+* Several history files (e.g. rotated logs) can be given - their buckets are merged;
+* the gzipped segments hwwm rotates its data log into are read as they are.
+*
+* With -J the files are device transition journals instead, and every transition
+* in the time range is listed (time,device,from,to,reason,ran_s):
+*   hwwm-query -J -f "2020-11-02" /var/log/hwwm_journal.1 /var/log/hwwm_journal
+*/
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hwwm_history.h"
+#include "hwwm_journal.h"
+
+#define MAXPOINTS 100000
+
+void
+usage() {
+    printf("Usage: hwwm-query -c column [-f from] [-t to] [-n points] [-j] file...\n");
+    printf("       hwwm-query -J [-f from] [-t to] [-j] journal...\n");
+    printf("  columns: ");
+    for (int i=0;i<HH_TOTALCOLS;i++) printf("%s ", hh_column_name(i));
+    printf("\n  from/to: \"YYYY-MM-DD HH:MM[:SS]\" or seconds since epoch; default: last 24 hours\n");
+    printf("  points: number of min/max/avg buckets, default 100\n");
+    printf("  -J: list the device transitions in journal files\n");
+}
+
+time_t
+parse_arg_time(const char *s)
+{
+    struct tm tm;
+    char *e;
+    long l;
+
+    memset(&tm, 0, sizeof tm);
+    if (strptime(s, "%Y-%m-%d %H:%M:%S", &tm) || strptime(s, "%Y-%m-%d %H:%M", &tm) ||
+        strptime(s, "%Y-%m-%d", &tm)) {
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+    l = strtol(s, &e, 10);
+    if ((e != s) && (*e == '\0')) return (time_t)l;
+    return -1;
+}
+
+/* list the transitions of a journal in [from, to); return number listed or -1 */
+long
+list_journal(const char *path, time_t from, time_t to, int json, int *first)
+{
+    static const char *reasons[HJ_REASONS] = HJ_REASON_NAMES;
+    struct hj_header h;
+    struct hj_rec r;
+    char ts[30], dev[HJ_NAMELEN+1];
+    const char *reason;
+    long lo, hi, n, listed = 0;
+    time_t t;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    if ((fread(&h, sizeof h, 1, fp) != 1) || memcmp(h.magic, HJ_MAGIC, 8) ||
+        (h.rec_size != sizeof r) || (h.devices > HJ_MAXDEVICES) || fseeko(fp, 0, SEEK_END)) {
+        fclose(fp);
+        return -1;
+    }
+    n = (ftello(fp) - (off_t)sizeof h) / sizeof r;
+
+    /* records are in time order - binary search for the first one at or after 'from' */
+    lo = 0;
+    hi = n;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (fseeko(fp, sizeof h + (off_t)mid * sizeof r, SEEK_SET) || (fread(&r, sizeof r, 1, fp) != 1)) break;
+        if ((time_t)r.t < from) lo = mid + 1;
+        else hi = mid;
+    }
+    if (fseeko(fp, sizeof h + (off_t)lo * sizeof r, SEEK_SET)) { fclose(fp); return -1; }
+    while (fread(&r, sizeof r, 1, fp) == 1) {
+        t = r.t;
+        if (t >= to) break;
+        if (r.dev == HJ_NODEV) strcpy(dev, "-");
+        else if (r.dev < h.devices) snprintf(dev, sizeof dev, "%.*s", HJ_NAMELEN, h.names[r.dev]);
+        else snprintf(dev, sizeof dev, "#%d", r.dev);
+        reason = (r.reason < HJ_REASONS) ? reasons[r.reason] : "?";
+        strftime(ts, sizeof ts, "%F %T", localtime(&t));
+        if (json) {
+            printf("%s{\"t\":%ld,\"device\":\"%s\",\"from\":%d,\"to\":%d,\"reason\":\"%s\",\"ran\":%lu}",
+                   *first ? "" : ",", (long)t, dev, r.from, r.to, reason, (unsigned long)r.ran);
+            *first = 0;
+        }
+        else printf("%s,%s,%d,%d,%s,%lu\n", ts, dev, r.from, r.to, reason, (unsigned long)r.ran);
+        listed++;
+    }
+    fclose(fp);
+    return listed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct hh_file hf;
+    struct hh_bucket *b;
+    char ts[30];
+    time_t to = time(NULL);
+    time_t from = to - 24*60*60;
+    int col = -1, n = 100, json = 0, journal = 0, first = 1, opt;
+    long total = 0, r;
+
+    while ((opt = getopt(argc, argv, "c:f:t:n:jJh")) != -1) {
+        switch (opt) {
+            case 'c': col = hh_column_by_name(optarg); break;
+            case 'f': from = parse_arg_time(optarg); break;
+            case 't': to = parse_arg_time(optarg); break;
+            case 'n': n = atoi(optarg); break;
+            case 'j': json = 1; break;
+            case 'J': journal = 1; break;
+            default: usage(); return 1;
+        }
+    }
+    if (((col < 0) && !journal) || (optind >= argc)) { usage(); return 1; }
+    if ((from == -1) || (to == -1) || (to <= from)) {
+        fprintf(stderr, "hwwm-query: bad time range\n");
+        return 2;
+    }
+    if (journal) {
+        if (json) printf("{\"transitions\":[");
+        else printf("time,device,from,to,reason,ran_s\n");
+        for (int i=optind;i<argc;i++) {
+            if (list_journal(argv[i], from, to, json, &first) < 0)
+                fprintf(stderr, "hwwm-query: cannot read journal %s\n", argv[i]);
+        }
+        if (json) printf("]}\n");
+        return 0;
+    }
+    if ((n < 1) || (n > MAXPOINTS)) {
+        fprintf(stderr, "hwwm-query: number of points must be 1..%d\n", MAXPOINTS);
+        return 2;
+    }
+
+    b = malloc(n * sizeof(struct hh_bucket));
+    if (b == NULL) return 3;
+    hh_buckets_init(b, n, from, to);
+    for (int i=optind;i<argc;i++) {
+        if (hh_open(&hf, argv[i])) {
+            fprintf(stderr, "hwwm-query: cannot open %s\n", argv[i]);
+            continue;
+        }
+        r = hh_query(&hf, col, from, to, n, b);
+        if (r > 0) total += r;
+        hh_close(&hf);
+    }
+    hh_buckets_finish(b, n);
+
+    if (json) printf("{\"column\":\"%s\",\"samples\":%ld,\"points\":[", hh_column_name(col), total);
+    else printf("time,count,min,max,avg\n");
+    for (int i=0;i<n;i++) {
+        if (!b[i].count) continue;
+        strftime(ts, sizeof ts, "%F %T", localtime(&b[i].start));
+        if (json) {
+            printf("%s{\"t\":%ld,\"n\":%lu,\"min\":%.3f,\"max\":%.3f,\"avg\":%.3f}", first ? "" : ",",
+                   (long)b[i].start, b[i].count, b[i].min, b[i].max, b[i].avg);
+            first = 0;
+        }
+        else printf("%s,%lu,%.3f,%.3f,%.3f\n", ts, b[i].count, b[i].min, b[i].max, b[i].avg);
+    }
+    if (json) printf("]}\n");
+    free(b);
+    return 0;
+}
+
+/* EOF */
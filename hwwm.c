@@ -6,15 +6,22 @@
 *
 * hwwm is Plamen's custom home warm water controller, based on the Raspberry Pi (2,3,4).
 * Data is gathered and logged every 10 seconds from 5 DS18B20 waterproof sensors,
-* 4 relays are controlled via GPIO, and a GPIO pin is read to note current
+* 4 relays are controlled via GPIO (up to 4 more sensors and relays can be added
+* in the config), and a GPIO pin is read to note current
 * power source: grid or battery backed UPS. Commands for a counterpart system are
-* sent via setting 4 designated GPIO ports output, acting as a guaranteed comms channel.
+* sent via setting 4 designated GPIO ports output, acting as a guaranteed comms channel,
+* or as checksummed and acknowledged messages over a serial line or socket.
 * Log data is in CSV format, to be picked up by some sort of data collection/graphing
 * tool, like collectd or similar. There is also JSON file more suitable for sending data
-* to data collection software like mqqt/emoncms.
+* to data collection software like emoncms; with a broker set, the same goes to MQTT
+* for Home Assistant, which sets the ACs target and what is allowed back over it.
 * The daemon is controlled via its configuration file, which hwwm can be told to
 * re-read and parse while running to change config in flight. This is done by
 * sending SIGUSR1 signal to the daemon process. The event is noted in the log file.
+* Single settings can be changed, devices forced and the current state read over a
+* local control socket, /run/hwwm.sock, without re-reading the whole config.
+* A new hwwm binary is taken into use without stopping the relays by sending SIGUSR2:
+* the daemon re-executes /usr/sbin/hwwm and the new one resumes from the saved state.
 * The logfile itself can be "grep"-ed for "ALARM" and "INFO" to catch and notify
 * of notable events, recorded by the daemon.
 */
@@ -23,9 +30,26 @@
 #error Need to define PGMVER in order to compile me!
 #endif
 
+/* for the peer credentials of control socket clients */
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <poll.h>
+#include <termios.h>
+#include <linux/watchdog.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,21 +59,55 @@
 #include <signal.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "hwwm_journal.h"
+#include "hwwm_history.h"
+
+/* a libhwwm build (-DHWWM_LIB) gives every thread its own copy of all the globals,
+   so controllers can run in parallel threads - see libhwwm.h */
+#ifdef HWWM_LIB
+#define HWWM_TLS        __thread
+#else
+#define HWWM_TLS
+#endif
+
+/* where the files and the sysfs tree hwwm uses are - a benchmark build (see bench.sh)
+   points them into a scratch tree */
+#ifndef FILES_ROOT
+#define FILES_ROOT      ""
+#endif
+#ifndef SYSFS_ROOT
+#define SYSFS_ROOT      "/sys"
+#endif
 
 #define RUNNING_DIR     "/tmp"
-#define LOCK_FILE       "/run/hwwm.pid"
-#define LOG_FILE        "/var/log/hwwm.log"
-#define DATA_FILE       "/run/shm/hwwm_data.log"
-#define TABLE_FILE      "/run/shm/hwwm_current"
-#define JSON_FILE	"/run/shm/hwwm_current_json"
-#define CFG_TABLE_FILE  "/run/shm/hwwm_cur_cfg"
-#define HA_SETTINGS_FILE  "/run/shm/hwwm_ha_int_file"
-#define CONFIG_FILE     "/etc/hwwm.cfg"
-#define PERSISTENCE_FILE      "/var/log/hwwm_persistent"
+#define LOCK_FILE       FILES_ROOT "/run/hwwm.pid"
+#define LOG_FILE        FILES_ROOT "/var/log/hwwm.log"
+#define DATA_FILE       FILES_ROOT "/run/shm/hwwm_data.log"
+#define DATA_ARCHIVE    FILES_ROOT "/var/log/hwwm_data.log"
+#define TABLE_FILE      FILES_ROOT "/run/shm/hwwm_current"
+#define JSON_FILE	FILES_ROOT "/run/shm/hwwm_current_json"
+#define CFG_TABLE_FILE  FILES_ROOT "/run/shm/hwwm_cur_cfg"
+#define HA_SETTINGS_FILE  FILES_ROOT "/run/shm/hwwm_ha_int_file"
+#define CONFIG_FILE     FILES_ROOT "/etc/hwwm.cfg"
+#define PERSISTENCE_FILE      FILES_ROOT "/var/log/hwwm_persistent"
+#define MODEL_FILE      FILES_ROOT "/var/log/hwwm_model"
+#define WATCHDOG_DEVICE "/dev/watchdog"
+#define STATE_FILE      FILES_ROOT "/run/shm/hwwm_state"
+#define JOURNAL_FILE    FILES_ROOT "/var/log/hwwm_journal"
+#define STATS_FILE      FILES_ROOT "/run/shm/hwwm_device_stats"
+#define CONTROL_SOCKET  FILES_ROOT "/run/hwwm.sock"
+#define HWWM_BINARY     "/usr/sbin/hwwm"
+/* set for a re-executed hwwm to the number of the lock file descriptor it inherits */
+#define HANDOFF_ENV     "HWWM_HANDOFF"
 
 #define BUFFER_MAX 3
-#define DIRECTION_MAX 35
-#define VALUE_MAX 50
+#define DIRECTION_MAX (sizeof(SYSFS_ROOT)+40)
+#define VALUE_MAX (sizeof(SYSFS_ROOT)+40)
 #define MAXLEN 80
 
 #define IN  0
@@ -60,29 +118,107 @@
 
 /* Number of all sensors to be used by the system */
 #define TOTALSENSORS         5
+/* ...plus up to this many extra ones from the config (extra_sensor_N) - numbered
+   TOTALSENSORS+N, logged and usable by the rules of extra devices */
+#define MAXEXTRASENSORS      4
+#define MAXSENSORS           (TOTALSENSORS+MAXEXTRASENSORS)
 
 /* Array of char* holding the paths to temperature DS18B20 sensors */
-char* sensor_paths[TOTALSENSORS+1];
+HWWM_TLS char* sensor_paths[MAXSENSORS+1];
 
 /*  var to keep track of read errors, so if a threshold is reached - the
     program can safely shut down everything, send notification and bail out;
     initialised with borderline value to trigger immediately on errors during
     start-up; the program logic tolerates 1 minute of missing sensor data
 */
-unsigned short sensor_read_errors[TOTALSENSORS+1] = { 3, 3, 3, 3, 3, 3 };
+HWWM_TLS unsigned short sensor_read_errors[MAXSENSORS+1] = { 3, 3, 3, 3, 3, 3, 3, 3, 3, 3 };
+
+/* per sensor count of reads rejected for a bad CRC, and count of all in-cycle retries done */
+HWWM_TLS unsigned long sensor_crc_errors[MAXSENSORS+1];
+HWWM_TLS unsigned long sensor_retries = 0;
+
+/* bad reads get this many immediate retries, as long as the read deadline allows */
+#define SENSOR_RETRIES          2
+
+/* SENSORS ACQUISITION: every sensor is read by its own thread, so a hung 1-wire device can
+   never stall the control cycle. Reads are started at the end of a cycle and collected at
+   the start of the next one; a read not done by then - or not within SENSOR_DEADLINE_MS of
+   being started - is a miss, and the last good value is used, with its age kept. */
+#define SENSOR_DEADLINE_MS      8000
+
+/* REDUNDANT SENSORS: a measurement point can have up to MAXPROBES DS18B20s. The config
+   takes them comma separated, each with an optional weight - path[@weight], default 1.
+   Every probe gets its own reader; the good reads of a point are fused each cycle by
+   FuseProbes(), so only a point with no good read at all counts as a read error, and
+   a probe that disagrees with the rest is left out before the mtd[] clamp ever sees it.
+   Probes are swapped by editing the config and sending SIGUSR1. */
+#define MAXPROBES               3
+#define SENSORSLEN              250
+
+/* a read further than this from the fused value of its point is left out of it */
+#define FUSE_MAX_SPREAD         1.5
+
+struct probe
+{
+    char    path[MAXLEN];
+    float   weight;
+};
+
+HWWM_TLS struct probe probes[MAXSENSORS+1][MAXPROBES];
+HWWM_TLS short probes_count[MAXSENSORS+1];
+/* per point: spread (max - min) of last cycle's good reads; per probe: reads left out of
+   the fused value so far, and whether the last one was */
+HWWM_TLS float fuse_spread[MAXSENSORS+1];
+HWWM_TLS unsigned long probe_rejects[MAXSENSORS+1][MAXPROBES];
+HWWM_TLS short probe_rejected[MAXSENSORS+1][MAXPROBES];
+
+struct sensor_slot
+{
+    pthread_t thread;
+    short   running;
+    /* measurement point and probe number this slot reads, and its name for the log */
+    short   sensor;
+    short   probe;
+    char    label[40];
+    char    path[MAXLEN];
+    float   weight;
+    /* acquisition round requested, and the last one this slot completed */
+    unsigned long want_round;
+    unsigned long done_round;
+    /* reading before the round - to judge an 85 C read; and just_started at that time */
+    float   prev;
+    short   starting;
+    /* result of the last completed round */
+    float   value;
+    short   err;
+    /* CLOCK_MONOTONIC time of last good read */
+    struct timespec good_at;
+    unsigned long misses;
+};
+
+HWWM_TLS struct sensor_slot acq[MAXSENSORS+1][MAXPROBES];
+HWWM_TLS pthread_mutex_t acq_lock = PTHREAD_MUTEX_INITIALIZER;
+HWWM_TLS pthread_cond_t acq_start = PTHREAD_COND_INITIALIZER;
+/* initialised in StartSensorReaders() - its timed waits are on CLOCK_MONOTONIC */
+HWWM_TLS pthread_cond_t acq_done;
+HWWM_TLS unsigned long acq_round = 0;
+HWWM_TLS struct timespec acq_started_at;
+/* seconds since last good read of every sensor - 0 when this cycle's value is fresh */
+HWWM_TLS unsigned long sensor_age[MAXSENSORS+1];
 
 /* current sensors temperatures - e.g. values from last read */
-float sensors[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200 };
+HWWM_TLS float sensors[MAXSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200, -200, -200 };
 
 /* previous sensors temperatures - e.g. values from previous to last read */
-float sensors_prv[TOTALSENSORS+1] = { 0, -200, -200, -200, -200, -200 };
+HWWM_TLS float sensors_prv[MAXSENSORS+1] = { 0, -200, -200, -200, -200, -200, -200, -200, -200, -200 };
 
 /* per sensor maximum allowed temp difference from last read */
-const float mtd[TOTALSENSORS+1] = { 0, 0.5, 1, 0.5, 0.5, 0.3 };
+const float mtd[MAXSENSORS+1] = { 0, 0.5, 1, 0.5, 0.5, 0.3, 1, 1, 1, 1 };
 
-/* sensor names array */
-const char *sensor_names[TOTALSENSORS+1] = { "zero", "furnace", "solar collector",
-                                             "boiler top", "boiler bottom", "outside" };
+/* sensor names array - names of the extra sensors come from the config */
+HWWM_TLS const char *sensor_names[MAXSENSORS+1] = { "zero", "furnace", "solar collector",
+                                           "boiler top", "boiler bottom", "outside" };
+HWWM_TLS char extra_sensor_names[MAXEXTRASENSORS][16];
 
 /* and sensor name mappings */
 #define   Tkotel                sensors[1]
@@ -97,16 +233,76 @@ const char *sensor_names[TOTALSENSORS+1] = { "zero", "furnace", "solar collector
 #define   TboilerLowPrev        sensors_prv[4]
 #define   TenvPrev                sensors_prv[5]
 
+/* DEGRADED OPERATION: a non-critical sensor that keeps failing is replaced by an estimate
+   and the controller keeps running; only losing a safety-critical sensor stops hwwm.
+   Sensors are referred to in masks by bit (1 << sensor number) */
+#define   S_KOTEL               2
+#define   S_KOLEKTOR            4
+#define   S_BOILERH             8
+#define   S_BOILERL             16
+#define   S_ENV                 32
+
+/* what a failed sensor gets replaced with */
+#define   FALLBACK_NONE         0
+#define   FALLBACK_LAST_GOOD    1
+#define   FALLBACK_MODEL        2
+#define   FALLBACK_TENV_AVG     3
+
+/* furnace and boiler top guard the critical temps - without them there is no running safely */
+const short sensor_fallback[MAXSENSORS+1] = { FALLBACK_NONE, FALLBACK_NONE, FALLBACK_LAST_GOOD,
+                                              FALLBACK_NONE, FALLBACK_MODEL, FALLBACK_TENV_AVG,
+                                              FALLBACK_LAST_GOOD, FALLBACK_LAST_GOOD,
+                                              FALLBACK_LAST_GOOD, FALLBACK_LAST_GOOD };
+const char *fallback_names[4] = { "none", "last known good value", "thermal model prediction",
+                                  "outdoor average" };
+
+/* bits of sensors currently failed and running on their fallback */
+HWWM_TLS unsigned short sensors_failed = 0;
+
+/* decision rules of ComputeWantedState() and the sensors each one depends on; when a
+   sensor has failed, a rule runs on its estimate only if listed in estimates_ok, and is
+   skipped otherwise */
+struct rule_dep
+{
+    const char *tag;
+    unsigned short needs;
+    unsigned short estimates_ok;
+};
+
+#define   R_COLL_FREEZE         0
+#define   R_COLL_BOIL           1
+#define   R_FURNACE_PUMP        2
+#define   R_SOLAR_GAIN          3
+#define   R_FURNACE_GAIN        4
+#define   R_NIGHT_BOOST         5
+#define   R_HEATER              6
+#define   R_HEAT_PUMP           7
+#define   R_TOTALRULES          8
+
+const struct rule_dep rules[R_TOTALRULES] = {
+    { "CF", S_KOLEKTOR|S_ENV, S_ENV },
+    { "CB", S_KOLEKTOR, 0 },
+    { "FP", S_KOTEL|S_ENV, S_ENV },
+    { "SG", S_KOLEKTOR|S_BOILERH|S_BOILERL, S_BOILERL },
+    { "FG", S_KOTEL|S_BOILERH|S_BOILERL, S_BOILERL },
+    { "NB", S_BOILERL, S_BOILERL },
+    { "BH", S_KOTEL|S_BOILERH|S_BOILERL|S_ENV, S_BOILERL|S_ENV },
+    { "HP", S_KOTEL|S_ENV, S_ENV }
+};
+
 /* TenvArr == Array of last minute or so environment temp readings, used
 to calculate an average, which gets used to decide to heat, cool or stay idle */
-float TenvArr[12] = { 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20 };
+HWWM_TLS float TenvArr[12] = { 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20 };
 /* TenvArr_lu holds the index of the last updated TenvArr element */
-unsigned short TenvArr_lu = 0;
+HWWM_TLS unsigned short TenvArr_lu = 0;
+/* running sum of TenvArr elements - so the average does not need a full re-sum */
+HWWM_TLS double TenvSum = 240;
 /* and the average environment temp var itself */
-float TenvAvrg = 20;
+HWWM_TLS float TenvAvrg = 20;
 
 /* HTTB == Hourly Target Temp Base for furnace water; NB 24:00 = 0;
- *  hwwm will get to the target temp from the values defined here */
+ *  hwwm will get to the target temp from the values defined here, unless the config
+ *  gives heat_hours/cool_hours of its own */
 /* HTTBh - HTTB heat */
 /*                              0    1    2    3    4    5    6    7    8    9   10  11  12  13  14  15  16  17  18  19  20  21  22  23*/
 short HTTBh[24] = { 26, 26, 26, 26, 26, 26, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 26 };
@@ -115,15 +311,145 @@ short HTTBh[24] = { 26, 26, 26, 26, 26, 26, 32, 32, 32, 32, 32, 32, 32, 32, 32,
 /*                              0    1    2    3    4    5    6    7    8    9   10  11  12  13  14  15  16  17  18  19  20  21  22  23*/
 short HTTBc[24] = { 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15 };
 
-float furnace_water_target = 22.33;
+HWWM_TLS float furnace_water_target = 22.33;
+/* furnace water target set over the HA interface; 0 - none, the heating curve decides */
+HWWM_TLS float ha_water_target = 0;
+/* HA pushes its settings over MQTT - HA_SETTINGS_FILE is not read then */
+HWWM_TLS short ha_pushed = 0;
+
+/* SENSORS HISTORY: fixed memory ring of the last 24 hours of readings (one sample
+   per 10 second cycle) for every sensor, plus 1 minute and 1 hour roll-ups of it.
+   Running sum, EWMA and least-squares trend slopes are updated in O(1) per cycle. */
+#define HIST_RAW_LEN        (6*60*24)
+#define HIST_MIN_LEN        (60*24)
+#define HIST_HOUR_LEN       (24*7)
+/* samples in the short (1 minute) and long (10 minutes) trend windows */
+#define HIST_SHORT          6
+#define HIST_LONG           60
+/* EWMA smoothing factor: ~5 minutes time constant at 10 second samples */
+#define HIST_EWMA_ALPHA     0.0328
+
+/* min/max/avg of a rolled-up period */
+struct hist_agg
+{
+    float   min;
+    float   max;
+    float   avg;
+};
+
+/* sliding window least-squares fit over the last 'len' samples */
+struct hist_window
+{
+    unsigned short len;
+    double  sy;
+    double  sxy;
+};
+
+struct sensor_history
+{
+    float   raw[HIST_RAW_LEN];
+    struct hist_agg minute[HIST_MIN_LEN];
+    struct hist_agg hour[HIST_HOUR_LEN];
+    /* running sum over raw[] - the 24 hours mean */
+    double  sum;
+    float   ewma;
+    struct hist_window wshort;
+    struct hist_window wlong;
+    /* roll-ups of the minute and hour currently being filled */
+    struct hist_agg cur_min;
+    struct hist_agg cur_hour;
+};
+
+#ifndef HWWM_LIB
+struct sensor_history hist_store[TOTALSENSORS+1];
+struct sensor_history *hist = hist_store;
+#else
+/* a libhwwm controller points it into its context - the history is most of its state */
+HWWM_TLS struct sensor_history *hist = NULL;
+#endif
+/* total samples pushed, position of the newest raw sample, minute and hour roll-ups done */
+HWWM_TLS unsigned long hist_count = 0;
+HWWM_TLS unsigned short hist_pos = HIST_RAW_LEN-1;
+HWWM_TLS unsigned long hist_minutes = 0;
+HWWM_TLS unsigned long hist_hours = 0;
+
+/* THERMAL MODEL: online recursive least squares identification of how fast the boiler
+   and the furnace loop gain and lose heat, from the sensors history and controls[] state.
+   Boiler:  dTb/dt = -loss*(Tb - BOILER_ROOM_T) + heater*dH + valve*dV + solar*dS
+   Furnace: dTk/dt = -loss*(Tk - TenvAvrg) + hp_low*dHPL + hp_high*dHPH + valve*dV
+   Tb is the boiler average temp, rates are in C/hour, dX are the devices duty (0..1)
+   over the last 10 minutes. */
+#define MODEL_PARAMS        4
+/* forgetting factor per update (once a minute) - about 16 hours of memory */
+#define MODEL_LAMBDA        0.999
+/* starting covariance and the cap against wind-up for unexcited parameters */
+#define MODEL_P0            1000.0
+#define MODEL_PMAX          10000.0
+/* minutes of excitation a parameter needs before it is trusted at all */
+#define MODEL_MIN_EXCITED   30
+/* the tank sits indoors - standing losses are towards a room, not towards Tenv */
+#define BOILER_ROOM_T       18.0
+
+struct rls_model
+{
+    const char *name;
+    const char *param_names[MODEL_PARAMS];
+    double  theta[MODEL_PARAMS];
+    double  P[MODEL_PARAMS][MODEL_PARAMS];
+    /* running residual variance */
+    double  var;
+    unsigned long updates;
+    unsigned long excited[MODEL_PARAMS];
+};
+
+HWWM_TLS struct rls_model boiler_model = { "boiler", { "loss", "heater", "valve", "solar" } };
+HWWM_TLS struct rls_model furnace_model = { "furnace", { "loss", "hp_low", "hp_high", "valve" } };
+
+/* last 10 minutes of controls state, one byte per cycle, with running per device counts */
+HWWM_TLS unsigned char model_ctrl_ring[HIST_LONG];
+HWWM_TLS unsigned short model_ctrl_pos = 0;
+HWWM_TLS unsigned short model_ctrl_count[8];
 
 #define HEAT 0
 #define COOL 1
 
-unsigned short HPmode = HEAT;
+HWWM_TLS unsigned short HPmode = HEAT;
+
+/* HEATING CURVE: furnace water target by time of day and outdoor temp, for each HPmode - the
+   hourly setpoints slide linearly from one hour to the next, and a piecewise linear curve in the
+   average outdoor temp gets added to them. Both are worked out into tables at config load, so
+   a cycle only looks them up */
+#define CURVE_POINTS        8
+/* outdoor temps the curve table covers, 0.1 C apart */
+#define CURVE_T_MIN         (-40)
+#define CURVE_T_MAX         50
+#define CURVE_STEPS         ((CURVE_T_MAX-CURVE_T_MIN)*10+1)
+/* limits of a furnace water target off the curve */
+#define CURVE_TARGET_MIN    10
+#define CURVE_TARGET_MAX    55
+
+struct heat_curve
+{
+    float   base[2][24*60];         /* [HPmode][minute of the day] */
+    float   offset[2][CURVE_STEPS]; /* [HPmode][outdoor temp step] */
+};
+
+#ifndef HWWM_LIB
+struct heat_curve curve_store;
+struct heat_curve *curve = &curve_store;
+#else
+/* a libhwwm controller points it at the curve of its context */
+HWWM_TLS struct heat_curve *curve = NULL;
+#endif
+
+/* extra devices (relays) that can be declared in the config on top of the built-in ones */
+#define MAXEXTRADEVICES      4
+/* controls[] slots: built-in ones are 1..8, the extra devices take 9 and up */
+#define EXTRACONTROLS        9
+#define TOTALCONTROLS        (EXTRACONTROLS+MAXEXTRADEVICES)
 
 /* current controls state - e.g. set on last decision making */
-short controls[11] = { -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+HWWM_TLS short controls[TOTALCONTROLS] = { -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
 /* and control name mappings */
 #define   CPump1                controls[1]
@@ -135,24 +461,112 @@ short controls[11] = { -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 #define   CHP_low          controls[7]
 #define   CHP_high          controls[8]
 
-/* controls state cycles - zeroed on change to state */
-unsigned long ctrlstatecycles[10] = { 1234567890, 150000, 150000, 2200, 2200, 32, 32, 19, 0, 1234567890 };
+/* controls state cycles - zeroed on change to state; same index as in controls[] */
+HWWM_TLS unsigned long ctrlstatecycles[TOTALCONTROLS] = { 1234567890, 150000, 150000, 2200, 2200, 19, 0, 32, 32,
+                                                 150000, 150000, 150000, 150000 };
 
 #define   SCPump1               ctrlstatecycles[1]
 #define   SCPump2               ctrlstatecycles[2]
 #define   SCValve               ctrlstatecycles[3]
 #define   SCHeater              ctrlstatecycles[4]
-#define   SCHP_low              ctrlstatecycles[5]
-#define   SCHP_high              ctrlstatecycles[6]
-#define   SCPowerByBattery     ctrlstatecycles[7]
-
-float TotalPowerUsed;
-float NightlyPowerUsed;
-
-float nightEnergyTemp;
+#define   SCPowerByBattery     ctrlstatecycles[5]
+#define   SCHP_low              ctrlstatecycles[7]
+#define   SCHP_high              ctrlstatecycles[8]
+
+/* DEVICE TABLE: every relay-like output is a descriptor, and the state computing,
+   activation, power accounting, GPIO handling and logging all loop over the table.
+   The wanted state has one bit per device (DEV_*); the heater has a second one to force
+   it ON. A device can change state after min_off cycles OFF or min_on cycles ON, and only
+   if its may_turn_on()/may_turn_off() hook agrees - the built-in devices keep their
+   interlocks there. Extra devices come from the config and run as plain thermostats on
+   one of the sensors */
+#define   DEV_PUMP1             1
+#define   DEV_PUMP2             2
+#define   DEV_VALVE             4
+#define   DEV_HEATER            8
+#define   DEV_HEATER_FORCED     16
+#define   DEV_HP_LOW            32
+#define   DEV_HP_HIGH           64
+#define   DEV_EXTRA(k)          (128<<(k))
+
+/* positions of the built-in devices in the table */
+#define   D_PUMP1               0
+#define   D_PUMP2               1
+#define   D_VALVE               2
+#define   D_HEATER              3
+#define   D_HP_LOW              4
+#define   D_HP_HIGH             5
+#define   BUILTINDEVICES        6
+#define   MAXDEVICES            (BUILTINDEVICES+MAXEXTRADEVICES)
+
+struct device
+{
+    char    name[16];           /* short name used in the logs */
+    short   ctrl;               /* index in controls[] and ctrlstatecycles[] */
+    unsigned short bit;
+    unsigned short force_bit;
+    int     pin;                /* output GPIO pin; -1 for none (heat pumps go over comms) */
+    int     invert;
+    float   power;              /* W */
+    unsigned long min_on;       /* cycles */
+    unsigned long min_off;
+    unsigned short (*may_turn_on)();
+    unsigned short (*may_turn_off)();
+    short   prio;               /* big consumers: higher gets the power budget first */
+    unsigned short requires;    /* bit of a device that must run for this one to */
+    short   sensor;             /* extra devices: thermostat sensor and temps */
+    float   on_at;
+    float   off_at;
+};
+
+/* SITE POWER BUDGET: several hwwm nodes on one grid connection share site_budget_kw for
+   their big consumers (heater, heat pump stages). Every cycle each node multicasts what its
+   big consumers use, how much more it wants (the next one to turn ON) and the grant it
+   holds. From the same view every node works out the same allocation: free power after
+   all uses and grants held goes to the waiting requests by priority, then node id. A grant
+   is a lease - it counts while announced and fresh (SITE_LEASE_S), and a node only uses it
+   after holding it for a cycle, so peers have seen it. With fewer than site_nodes-1 peers
+   heard each node falls back to its local power budget */
+#define MAXSITEPEERS        8
+#define SITE_LEASE_S        30
+/* W taken by a big consumer without a power of its own - a heat pump stage */
+#define BIG_CONSUMER_W      3000
+/* share of the power budget for each of max_big_consumers - a heater or heat pump stage fits */
+#define BIG_CONSUMER_SLOT_W 3100
+#define BIG_CONSUMERS       (DEV_HEATER|DEV_HP_LOW|DEV_HP_HIGH)
+
+struct site_peer
+{
+    int     id;
+    int     prio;
+    int     use;            /* W */
+    int     want;
+    int     grant;
+    struct timespec heard;  /* CLOCK_MONOTONIC */
+};
+
+HWWM_TLS struct site_peer site_peers[MAXSITEPEERS];
+HWWM_TLS short site_peers_count = 0;
+HWWM_TLS int site_sock = -1;
+HWWM_TLS struct sockaddr_in site_addr;
+/* this node: W wanted (and by which device), grant announced last, shared or local mode */
+HWWM_TLS int site_want = 0;
+HWWM_TLS short site_want_dev = -1;
+HWWM_TLS int site_grant = 0;
+HWWM_TLS unsigned long site_seq = 0;
+HWWM_TLS short site_shared = 0;
+/* CLOCK_MONOTONIC time the group was joined - peers get a lease time to be heard */
+HWWM_TLS struct timespec site_joined;
+
+HWWM_TLS float TotalPowerUsed;
+HWWM_TLS float NightlyPowerUsed;
+
+HWWM_TLS float nightEnergyTemp;
+/* the night boost planner had the heater ON last cycle */
+HWWM_TLS short boost_was_on = 0;
 
 /* hwwm keeps track of total and night tariff watt-hours electrical power used */
-/* night tariff is between 23:00 and 06:00 */
+/* night tariff hours are the cheap ones of the tariff calendar */
 /* constants of Watt-hours of electricity used per 10 secs */
 #define   HEATERPPC         8.340
 #define   PUMP1PPC          0.135
@@ -163,16 +577,60 @@ float nightEnergyTemp;
 /* this in Wh per 10 seconds is 8.34 W */
 /* pump 1 (furnace) runs at 48 W setting, pump 2 (solar) - 7 W */
 
-/* NightEnergy (NE) start and end hours variables - get recalculated every day */
-unsigned short NEstart = 20;
-unsigned short NEstop  = 11;
+/* tariff calendar: named rates (the first is the default one) and rules saying when
+   which rate applies; it gets compiled into a per-minute table of the next 48 hours */
+#define MAXTARIFFRATES      4
+#define MAXTARIFFRULES      8
+#define MAXHOLIDAYS         32
+#define TARIFF_LUT_MIN      (2*24*60)
+/* day bit of the holidays - next to the week days, Sunday is bit 0 */
+#define TARIFF_HOLIDAY      128
+
+struct tariff_rule
+{
+    unsigned char days;             /* week day bits and TARIFF_HOLIDAY */
+    unsigned short months;          /* bit N is month N */
+    short   start, stop;            /* minutes after midnight; stop <= start goes past midnight */
+    unsigned char rate;
+};
+
+struct tariff_calendar
+{
+    char    names[MAXTARIFFRATES][16];
+    float   rates[MAXTARIFFRATES];  /* price of a kWh */
+    short   rates_count;
+    struct tariff_rule rules[MAXTARIFFRULES];
+    short   rules_count;
+    unsigned short holidays[MAXHOLIDAYS]; /* month*100 + day */
+    short   holidays_count;
+    time_t  base;                   /* the minute the table starts at; 0 - build it anew */
+    unsigned char rate[TARIFF_LUT_MIN];
+    unsigned short left[TARIFF_LUT_MIN]; /* minutes until the rate gets cheap or dear */
+};
+
+#ifndef HWWM_LIB
+struct tariff_calendar tariff_store;
+struct tariff_calendar *tariff = &tariff_store;
+#else
+/* a libhwwm controller points it at the calendar of its context */
+HWWM_TLS struct tariff_calendar *tariff = NULL;
+#endif
+
+/* money spent on electricity, at the rates of the tariff calendar */
+HWWM_TLS float PowerCost;
 
 /* Nubmer of cycles (circa 10 seconds each) that the program has run */
-unsigned long ProgramRunCycles  = 0;
+HWWM_TLS unsigned long ProgramRunCycles  = 0;
+
+/* emergency cooling is on */
+HWWM_TLS unsigned short AlarmRaised = 0;
+
+/* wall clock time of the cycle being run */
+HWWM_TLS time_t cycle_time = 0;
 
 /* timers - current hour and month vars - used in keeping things up to date */
-unsigned short current_timer_hour = 0;
-unsigned short current_month = 0;
+HWWM_TLS unsigned short current_timer_hour = 0;
+HWWM_TLS unsigned short current_month = 0;
 
 /* array storing the hour at wich to make the solar pump daily run for each month */
 unsigned short pump_start_hour_for[13] = { 11, 14, 13, 12, 11, 10, 9, 9, 10, 11, 12, 13, 14 };
@@ -183,7 +641,7 @@ unsigned short pump_start_hour_for[13] = { 11, 14, 13, 12, 11, 10, 9, 9, 10, 11,
     1 == busy; can ADD an AC
     2 == busy; can REMOVE an AC
     3 == done/request is fullfilled; can change state as desired */
-unsigned short COMMS = 0;
+HWWM_TLS unsigned short COMMS = 0;
 
 /* Send bits 
     States:
@@ -191,19 +649,21 @@ unsigned short COMMS = 0;
     1 == 1 AC ON a.k.a. Heat Pump Low mode
     2 == 2 ACs ON a.k.a. Heat Pump HIGH mode
     3 == 3 all is OFF, because we are powered by BATTERY  */
-unsigned short sendBits = 0;
+HWWM_TLS unsigned short sendBits = 0;
 
 /* vars to keep original hwwm config values for onces replaced by HA interfacer */
-unsigned short acs_allowed_original = 0;
-unsigned short boiler_allowed_original = 0;
+HWWM_TLS unsigned short acs_allowed_original = 0;
+HWWM_TLS unsigned short boiler_allowed_original = 0;
 
 struct cfg_struct
 {
-    char    tkotel_sensor[MAXLEN];
-    char    tkolektor_sensor[MAXLEN];
-    char    tboilerh_sensor[MAXLEN];
-    char    tboilerl_sensor[MAXLEN];
-    char    tenv_sensor[MAXLEN];
+    char    tkotel_sensor[SENSORSLEN];
+    char    tkolektor_sensor[SENSORSLEN];
+    char    tboilerh_sensor[SENSORSLEN];
+    char    tboilerl_sensor[SENSORSLEN];
+    char    tenv_sensor[SENSORSLEN];
+    char    extra_sensor[MAXEXTRASENSORS][SENSORSLEN];
+    char    extra_device[MAXEXTRADEVICES][MAXLEN];
     char    bat_powered_pin_str[MAXLEN];
     int     bat_powered_pin;
     char    pump1_pin_str[MAXLEN];
@@ -248,20 +708,174 @@ struct cfg_struct
     int     max_big_consumers;
     char    use_acs_str[MAXLEN];
     int     use_acs;
+    char    night_boost_planner_str[MAXLEN];
+    int     night_boost_planner;
+    char    watchdog_systemd_str[MAXLEN];
+    int     watchdog_systemd;
+    char    watchdog_device_str[MAXLEN];
+    int     watchdog_device;
+    char    watchdog_tolerance_str[MAXLEN];
+    int     watchdog_tolerance;
+    char    power_budget_kw_str[MAXLEN];
+    float   power_budget_kw;
+    char    heater_priority_str[MAXLEN];
+    int     heater_priority;
+    char    hp_low_priority_str[MAXLEN];
+    int     hp_low_priority;
+    char    hp_high_priority_str[MAXLEN];
+    int     hp_high_priority;
+    char    site_budget_kw_str[MAXLEN];
+    float   site_budget_kw;
+    char    site_nodes_str[MAXLEN];
+    int     site_nodes;
+    char    site_node_id_str[MAXLEN];
+    int     site_node_id;
+    char    site_priority_str[MAXLEN];
+    int     site_priority;
+    char    site_group[MAXLEN];
+    char    site_interface[MAXLEN];
+    char    hp_link[MAXLEN];
+    char    data_every_str[MAXLEN];
+    int     data_every;
+    char    table_every_str[MAXLEN];
+    int     table_every;
+    char    json_every_str[MAXLEN];
+    int     json_every;
+    char    emoncms_every_str[MAXLEN];
+    int     emoncms_every;
+    char    emoncms_url[MAXLEN];
+    char    emoncms_node[MAXLEN];
+    char    emoncms_apikey[MAXLEN];
+    char    data_log_rotate_kb_str[MAXLEN];
+    int     data_log_rotate_kb;
+    char    data_log_rotate_min_str[MAXLEN];
+    int     data_log_rotate_min;
+    char    log_rotate_kb_str[MAXLEN];
+    int     log_rotate_kb;
+    char    log_keep_days_str[MAXLEN];
+    int     log_keep_days;
+    char    tariff_rates[MAXLEN];
+    char    tariff_rule[MAXTARIFFRULES][MAXLEN];
+    char    tariff_holidays[MAXLEN];
+    char    heat_hours[SENSORSLEN];
+    char    cool_hours[SENSORSLEN];
+    char    heat_curve[SENSORSLEN];
+    char    cool_curve[SENSORSLEN];
+    char    mode_switch_t_str[MAXLEN];
+    float   mode_switch_t;
+    char    mode_hysteresis_str[MAXLEN];
+    float   mode_hysteresis;
+    char    mqtt_broker[MAXLEN];
+    char    mqtt_user[MAXLEN];
+    char    mqtt_password[MAXLEN];
+    char    mqtt_prefix[MAXLEN];
+    char    mqtt_discovery[MAXLEN];
+    char    mqtt_every_str[MAXLEN];
+    int     mqtt_every;
 }
 cfg_struct;
 
-struct cfg_struct cfg;
+HWWM_TLS struct cfg_struct cfg;
+/* libhwwm reads the config of each controller from a file of its own */
+HWWM_TLS const char *config_file = CONFIG_FILE;
+
+HWWM_TLS short need_to_read_cfg = 0;
 
-short need_to_read_cfg = 0;
+/* set by SIGUSR2: hand over to a new HWWM_BINARY at the end of the cycle */
+HWWM_TLS short need_to_hand_over = 0;
+HWWM_TLS short need_to_stop = 0;
+/* this process was re-executed by a running hwwm: pins are set up and the lock is held */
+HWWM_TLS short handed_over = 0;
+HWWM_TLS int lock_fd = -1;
 
-short just_started = 0;
+HWWM_TLS short just_started = 0;
 
 /* FORWARD DECLARATIONS so functions can be used in preceding ones */
 short
 DisableGPIOpins();
+void
+WriteModelData();
+float
+SensorEstimate(short i);
+short
+SensorsUpdate(const float *vals);
+unsigned short
+Pump1MayTurnOn();
+unsigned short
+Pump1MayTurnOff();
+unsigned short
+Pump2MayTurnOn();
+unsigned short
+HeaterMayTurnOn();
+unsigned short
+HeatPumpLowMayTurnOn();
+unsigned short
+HeatPumpLowMayTurnOff();
+unsigned short
+HeatPumpHighMayTurnOn();
+unsigned short
+HeatPumpHighMayTurnOff();
+void
+SetupDevices();
+unsigned short
+DevicesState();
+void
+SinksConfigure();
+void
+SinksFlush();
+void
+LogsConfigure();
+void
+TariffCompile();
+void
+HeatCurveCompile();
 /* end of forward-declared functions */
 
+/* the built-in devices, in the order they get activated; their pins come from the config */
+HWWM_TLS struct device devices[MAXDEVICES] = {
+    { "P1", 1, DEV_PUMP1, 0, -1, 1, PUMP1PPC*(6*60), 6, 3, Pump1MayTurnOn, Pump1MayTurnOff, 0, 0, 0, 0, 0 },
+    { "P2", 2, DEV_PUMP2, 0, -1, 1, PUMP2PPC*(6*60), 6, 3, Pump2MayTurnOn, NULL, 0, 0, 0, 0, 0 },
+    { "V", 3, DEV_VALVE, 0, -1, 1, VALVEPPC*(6*60), 18, 6, NULL, NULL, 0, 0, 0, 0, 0 },
+    /* to turn electrical heater OFF - it must have been ON for at least 20 minutes */
+    { "H", 4, DEV_HEATER, DEV_HEATER_FORCED, -1, 1, HEATERPPC*(6*60), 20*6+1, 29, HeaterMayTurnOn, NULL,
+      3, 0, 0, 0, 0 },
+    { "HP1", 7, DEV_HP_LOW, 0, -1, 0, 0, 0, 0, HeatPumpLowMayTurnOn, HeatPumpLowMayTurnOff, 2, 0, 0, 0, 0 },
+    { "HP2", 8, DEV_HP_HIGH, 0, -1, 0, 0, 0, 0, HeatPumpHighMayTurnOn, HeatPumpHighMayTurnOff, 1, DEV_HP_LOW, 0, 0, 0 }
+};
+HWWM_TLS short devices_count = 0;
+
+/* DEVICE JOURNAL: every device switched ON or OFF gets a record in JOURNAL_FILE (layout in
+   hwwm_journal.h, read with hwwm-query -J), and counters for relay wear and short cycling:
+   ON switchings and ON cycles per 10 minute slot over the last day, plus lifetime ON
+   switchings, ON time and the longest and shortest ON runs. The slots survive restarts in
+   STATE_FILE, the lifetime counters in PERSISTENCE_FILE; STATS_FILE shows them all */
+#define STATS_SLOT_S        600
+#define STATS_SLOTS         144
+
+struct device_stats
+{
+    unsigned long switches;     /* ON switchings */
+    unsigned long on_s;
+    unsigned long longest_on;   /* s */
+    unsigned long shortest_on;  /* s, 0 until a run has ended */
+    unsigned short starts[STATS_SLOTS];
+    unsigned short on_cycles[STATS_SLOTS];
+};
+
+HWWM_TLS struct device_stats dev_stats[MAXDEVICES];
+HWWM_TLS unsigned short stats_cycles[STATS_SLOTS];
+HWWM_TLS unsigned long stats_slot = 0;   /* time/STATS_SLOT_S of the newest slot */
+HWWM_TLS int journal_fd = -1;
+HWWM_TLS short journal_err_logged = 0;
+/* why devices change this cycle, unless forced or preempted - set in main */
+HWWM_TLS unsigned char wanted_reason = HJ_CONTROL;
+/* big consumers the power allocator left out this cycle */
+HWWM_TLS unsigned short power_denied = 0;
+/* devices forced ON or OFF over the control socket, and until when */
+HWWM_TLS unsigned short forced_on = 0;
+HWWM_TLS unsigned short forced_off = 0;
+HWWM_TLS time_t forced_until[MAXDEVICES];
+
 void
 rangecheck_GPIO_pin( int p )
 {
@@ -344,6 +958,14 @@ rangecheck_max_big_consumers( int t )
     if (t > 3) t = 3;
 }
 
+/* W the big consumers of this node may take together; without power_budget_kw
+   every one of max_big_consumers counts for BIG_CONSUMER_SLOT_W */
+long
+PowerBudgetW() {
+    if (cfg.power_budget_kw > 0) return (long)(cfg.power_budget_kw * 1000);
+    return ((cfg.max_big_consumers < 1) ? 1 : cfg.max_big_consumers) * BIG_CONSUMER_SLOT_W;
+}
+
 void
 rangecheck_day_of_month( int d )
 {
@@ -364,6 +986,14 @@ SetDefaultPINs() {
     cfg.commspin4_pin = 22;
 }
 
+/* calculate maximum possible temp for use in night_boost case; consider this: getting too hot causes calcium
+   build-up in the tank; keeping in too low (30 to 45) makes for a perfect bacteria environment */
+void
+SetNightEnergyTemp() {
+    nightEnergyTemp = ((float)cfg.wanted_T + 10);
+    if (nightEnergyTemp > (float)cfg.abs_max) { nightEnergyTemp = (float)cfg.abs_max; }
+}
+
 /* FIXME: a config setting not found in the cfg file is wrongly set to 0 */
 void
 SetDefaultCfg() {
@@ -386,6 +1016,50 @@ SetDefaultCfg() {
     cfg.abs_max = 63;
     cfg.max_big_consumers = 1;
     cfg.use_acs = 1;
+    cfg.night_boost_planner = 1;
+    cfg.watchdog_systemd = 0;
+    cfg.watchdog_device = 0;
+    cfg.watchdog_tolerance = 3;
+    cfg.power_budget_kw = 0;
+    cfg.heater_priority = 3;
+    cfg.hp_low_priority = 2;
+    cfg.hp_high_priority = 1;
+    cfg.site_budget_kw = 0;
+    cfg.site_nodes = 2;
+    cfg.site_node_id = 0;
+    cfg.site_priority = 5;
+    strcpy( cfg.site_group, "239.255.72.77:4777" );
+    strcpy( cfg.site_interface, "0.0.0.0" );
+    strcpy( cfg.hp_link, "gpio" );
+    cfg.data_every = 1;
+    cfg.table_every = 1;
+    cfg.json_every = 1;
+    cfg.emoncms_every = 1;
+    cfg.emoncms_url[0] = 0;
+    strcpy( cfg.emoncms_node, "4" );
+    cfg.emoncms_apikey[0] = 0;
+    cfg.data_log_rotate_kb = 1024;
+    cfg.data_log_rotate_min = 60;
+    cfg.log_rotate_kb = 1024;
+    cfg.log_keep_days = 365;
+    /* the night tariff of old: 23:00 till 6:59 April through October, 22:00 till 5:59 otherwise */
+    strcpy( cfg.tariff_rates, "day:0.26,night:0.15" );
+    memset( cfg.tariff_rule, 0, sizeof cfg.tariff_rule );
+    strcpy( cfg.tariff_rule[0], "all 23:00-07:00 night 4-10" );
+    strcpy( cfg.tariff_rule[1], "all 22:00-06:00 night 11-3" );
+    cfg.tariff_holidays[0] = 0;
+    cfg.heat_hours[0] = 0;
+    cfg.cool_hours[0] = 0;
+    cfg.heat_curve[0] = 0;
+    cfg.cool_curve[0] = 0;
+    cfg.mode_switch_t = 23;
+    cfg.mode_hysteresis = 1;
+    cfg.mqtt_broker[0] = 0;
+    cfg.mqtt_user[0] = 0;
+    cfg.mqtt_password[0] = 0;
+    strcpy( cfg.mqtt_prefix, "hwwm" );
+    strcpy( cfg.mqtt_discovery, "homeassistant" );
+    cfg.mqtt_every = 1;
 
     nightEnergyTemp = 0;
     sensor_paths[0] = (char *) &cfg.tkotel_sensor;
@@ -399,18 +1073,22 @@ SetDefaultCfg() {
 short
 log_message(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
     char timestamp[30];
     time_t t;
-    struct tm *t_struct;
+    struct tm t_struct;
+
+#ifdef HWWM_LIB
+    /* controllers of a library write no files */
+    return 0;
+#endif
 
+    /* sensor reader threads log too - so use the re-entrant localtime */
     t = time(NULL);
-    t_struct = localtime( &t );
-    strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s %s", timestamp, message );
+    localtime_r( &t, &t_struct );
+    strftime( timestamp, sizeof timestamp, "%F %T", &t_struct );
     logfile = fopen( filename, "a" );
     if ( !logfile ) return -1;
-    fprintf( logfile, "%s\n", file_string );
+    fprintf( logfile, "%s %s\n", timestamp, message );
     fclose( logfile );
     return 0;
 }
@@ -419,18 +1097,21 @@ log_message(char *filename, char *message) {
 void
 log_msg_ovr(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
     char timestamp[30];
     time_t t;
     struct tm *t_struct;
 
+#ifdef HWWM_LIB
+    /* controllers of a library write no files */
+    return;
+#endif
+
     t = time(NULL);
     t_struct = localtime( &t );
     strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s%s", timestamp, message );
     logfile = fopen( filename, "w" );
     if ( !logfile ) return;
-    fprintf( logfile, "%s\n", file_string );
+    fprintf( logfile, "%s%s\n", timestamp, message );
     fclose( logfile );
 }
 
@@ -438,15 +1119,137 @@ log_msg_ovr(char *filename, char *message) {
 void
 log_msg_cln(char *filename, char *message) {
     FILE *logfile;
-    char file_string[300];
 
-    sprintf( file_string, "%s", message );
+#ifdef HWWM_LIB
+    return;
+#endif
+
     logfile = fopen( filename, "w" );
     if ( !logfile ) return;
-    fprintf( logfile, "%s", file_string );
+    fprintf( logfile, "%s", message );
     fclose( logfile );
 }
 
+/* lines for DATA_FILE that come up during a cycle wait here, and go out together with the
+   snapshot the cycle ends with - the data sink writes them just before its data line */
+#define DATA_NOTES_LEN      1024
+
+HWWM_TLS char data_notes[DATA_NOTES_LEN];
+HWWM_TLS size_t data_notes_len = 0;
+
+void
+DataNote(const char *line) {
+    size_t n = strlen( line );
+
+#ifdef HWWM_LIB
+    return;
+#endif
+
+    /* a line that does not fit is left out, not cut */
+    if (data_notes_len + n + 1 >= sizeof data_notes) return;
+    memcpy( data_notes + data_notes_len, line, n );
+    data_notes_len += n;
+    data_notes[data_notes_len++] = '\n';
+    data_notes[data_notes_len] = 0;
+}
+
+/* TEXT: lines for the log and data files are built by appending to a struct text; it keeps
+   the length, so no append rescans what is there already, and what does not fit the
+   buffer is cut off - the text is always terminated */
+struct text
+{
+    char    *buf;
+    size_t  size;
+    size_t  len;
+};
+
+struct text *
+TextStart(struct text *t, char *buf, size_t size) {
+    t->buf = buf;
+    t->size = size;
+    t->len = 0;
+    buf[0] = 0;
+    return t;
+}
+
+void
+TextAddN(struct text *t, const char *s, size_t n) {
+    if (n > t->size - 1 - t->len) n = t->size - 1 - t->len;
+    memcpy( t->buf + t->len, s, n );
+    t->len += n;
+    t->buf[t->len] = 0;
+}
+
+void
+TextAdd(struct text *t, const char *s) {
+    TextAddN( t, s, strlen(s) );
+}
+
+/* s as a form value: all but letters, digits and -._~ as %XX; a character is not cut */
+void
+TextUrl(struct text *t, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    char e[3] = { '%' };
+
+    for (;*s;s++) {
+        if (isalnum( (unsigned char)*s ) || strchr( "-._~", *s )) TextAddN( t, s, 1 );
+        else {
+            if (t->len + 3 > t->size - 1) break;
+            e[1] = hex[(unsigned char)*s >> 4];
+            e[2] = hex[(unsigned char)*s & 15];
+            TextAddN( t, e, 3 );
+        }
+    }
+}
+
+/* digits of u ending at d+n, with a '-' if neg, padded to width; return where they start */
+char *
+TextDigits(char *d, short n, unsigned long long u, short neg, short width) {
+    char *p = d + n, *stop = (width < n) ? d + n - width : d;
+    do { *--p = '0' + u % 10; u /= 10; } while (u);
+    if (neg) *--p = '-';
+    while (p > stop) *--p = ' ';
+    return p;
+}
+
+/* like "%*ld" */
+void
+TextLong(struct text *t, long v, short width) {
+    char d[32];
+    char *p = TextDigits( d, sizeof d, (v < 0) ? -(unsigned long)v : (unsigned long)v, v < 0, width );
+    TextAddN( t, p, d + sizeof d - p );
+}
+
+/* like "%*lu" */
+void
+TextUlong(struct text *t, unsigned long v, short width) {
+    char d[32];
+    char *p = TextDigits( d, sizeof d, v, 0, width );
+    TextAddN( t, p, d + sizeof d - p );
+}
+
+/* like "%*.*f" with up to 6 decimals: the scaled value is rounded half to even, as printf
+   does it - and for a float, which scaled by 10^6 is still exact in a double, the digits
+   are exactly the printf ones */
+void
+TextFixed(struct text *t, double v, short width, short dec) {
+    static const double scale[7] = { 1, 10, 100, 1e3, 1e4, 1e5, 1e6 };
+    char d[48], *p;
+    unsigned long long u;
+    short n = sizeof d;
+
+    if (!isfinite(v) || (fabs(v) >= 1e12) || (dec < 0) || (dec > 6)) {
+        n = snprintf( d, sizeof d, "%*.*f", width, dec, v );
+        TextAddN( t, d, (n < (short)sizeof d) ? n : (short)sizeof d - 1 );
+        return;
+    }
+    u = (unsigned long long)rint( fabs(v) * scale[dec] );
+    for (short i=0;i<dec;i++) { d[--n] = '0' + u % 10; u /= 10; }
+    if (dec) d[--n] = '.';
+    p = TextDigits( d, n, u, signbit(v) != 0, width - (sizeof d - n) );
+    TextAddN( t, p, d + sizeof d - p );
+}
+
 /* trim: get rid of trailing and leading whitespace...
     ...including the annoying "\n" from fgets()
 */
@@ -454,10 +1257,14 @@ char *
 trim (char * s)
 {
     /* Initialize start, end pointers */
-    char *s1 = s, *s2 = &s[strlen (s) - 1];
+    char *s1 = s, *s2;
+
+    /* nothing to trim - and no last char to start from */
+    if (!*s) return s;
+    s2 = &s[strlen (s) - 1];
 
     /* Trim and delimit right side */
-    while ( (isspace (*s2)) && (s2 >= s1) )
+    while ( (s2 >= s1) && (isspace (*s2)) )
     s2--;
     *(s2+1) = '\0';
 
@@ -465,17 +1272,102 @@ trim (char * s)
     while ( (isspace (*s1)) && (s1 < s2) )
     s1++;
 
-    /* Copy finished string */
-    strcpy (s, s1);
+    /* Copy finished string - over itself, so no strcpy */
+    memmove (s, s1, strlen (s1) + 1);
     return s;
 }
 
+/* non-zero if sensor i is there: the built-in ones always are, extra ones when configured */
+short
+SensorInUse(short i) {
+    return (i <= TOTALSENSORS) || probes_count[i];
+}
+
+/* split the sensor config of every measurement point into its probes; extra sensors
+   come as name:probes */
+void
+ParseSensorProbes()
+{
+    char list[SENSORSLEN], msg[MAXLEN+100], *p, *w, *save;
+    short i, k, n;
+    float weight;
+
+    for (k=0;k<MAXEXTRASENSORS;k++) {
+        i = TOTALSENSORS+1+k;
+        p = strchr( cfg.extra_sensor[k], ':' );
+        if ((p == NULL) || (p - cfg.extra_sensor[k] >= (int)sizeof extra_sensor_names[k])) {
+            if (cfg.extra_sensor[k][0]) {
+                sprintf( msg, "WARNING: extra_sensor_%d should be name:path[,path...] with a name of up to 15 characters - ignoring it.", k+1 );
+                log_message(LOG_FILE, msg);
+            }
+            sensor_paths[i] = cfg.extra_sensor[k] + strlen(cfg.extra_sensor[k]);
+            continue;
+        }
+        memcpy( extra_sensor_names[k], cfg.extra_sensor[k], p - cfg.extra_sensor[k] );
+        extra_sensor_names[k][p - cfg.extra_sensor[k]] = 0;
+        sensor_names[i] = extra_sensor_names[k];
+        sensor_paths[i] = p + 1;
+    }
+
+    for (i=1;i<=MAXSENSORS;i++) {
+        strncpy( list, sensor_paths[i], SENSORSLEN-1 );
+        list[SENSORSLEN-1] = 0;
+        n = 0;
+        for (p = strtok_r(list, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save)) {
+            weight = 1;
+            if ((w = strchr(p, '@')) != NULL) {
+                *w = 0;
+                weight = atof(w+1);
+                if ((weight <= 0) || (weight > 100)) {
+                    sprintf( msg, "WARNING: Bad weight for sensor '%s' probe %d - using 1.", sensor_names[i], n+1 );
+                    log_message(LOG_FILE, msg);
+                    weight = 1;
+                }
+            }
+            trim(p);
+            if (!p[0]) continue;
+            if (n >= MAXPROBES) {
+                sprintf( msg, "WARNING: Sensor '%s' has more than %d probes - ignoring the rest.", sensor_names[i], MAXPROBES );
+                log_message(LOG_FILE, msg);
+                break;
+            }
+            if (strlen(p) >= MAXLEN) {
+                sprintf( msg, "WARNING: Path of sensor '%s' probe %d is too long - ignoring it.", sensor_names[i], n+1 );
+                log_message(LOG_FILE, msg);
+                continue;
+            }
+            if (strcmp(probes[i][n].path, p)) {
+                /* a replaced probe starts with a clean record */
+                if (probes[i][n].path[0]) {
+                    sprintf( msg, "INFO: Sensor '%s' probe %d is now %s", sensor_names[i], n+1, p );
+                    log_message(LOG_FILE, msg);
+                }
+                probe_rejects[i][n] = 0;
+                probe_rejected[i][n] = 0;
+                strcpy( probes[i][n].path, p );
+            }
+            probes[i][n].weight = weight;
+            n++;
+        }
+        /* an extra sensor taken out of the config starts over if it comes back */
+        if (!n && probes_count[i]) {
+            sensors_failed &= ~(1<<i);
+            sensor_read_errors[i] = 3;
+            sensors[i] = -200;
+            sensors_prv[i] = -200;
+        }
+        probes_count[i] = n;
+        for (short j=n;j<MAXPROBES;j++) probes[i][j].path[0] = 0;
+    }
+}
+
 void
 parse_config()
 {
     int i = 0;
-    char *s, buff[150];
-    FILE *fp = fopen(CONFIG_FILE, "r");
+    short tariff_rules_read = 0;
+    char *s, buff[SENSORSLEN+100];
+    FILE *fp = fopen(config_file, "r");
     if (fp == NULL) {
         log_message(LOG_FILE,"WARNING: Failed to open "CONFIG_FILE" file for reading!");
         } else {
@@ -487,26 +1379,32 @@ parse_config()
             continue;
 
             /* Parse name/value pair from line */
-            char name[MAXLEN], value[MAXLEN];
+            /* sensor settings can be longer - they can list several probes */
+            char name[MAXLEN], value[MAXLEN], paths[SENSORSLEN];
             s = strtok (buff, "=");
             if (s==NULL) continue;
             else strncpy (name, s, MAXLEN);
             s = strtok (NULL, "=");
             if (s==NULL) continue;
-            else strncpy (value, s, MAXLEN);
+            else { strncpy (value, s, MAXLEN); snprintf (paths, SENSORSLEN, "%s", s); }
             trim (value);
+            trim (paths);
 
             /* Copy into correct entry in parameters struct */
             if (strcmp(name, "tkotel_sensor")==0)
-            strncpy (cfg.tkotel_sensor, value, MAXLEN);
+            snprintf (cfg.tkotel_sensor, SENSORSLEN, "%s", paths);
             else if (strcmp(name, "tkolektor_sensor")==0)
-            strncpy (cfg.tkolektor_sensor, value, MAXLEN);
+            snprintf (cfg.tkolektor_sensor, SENSORSLEN, "%s", paths);
             else if (strcmp(name, "tboilerh_sensor")==0)
-            strncpy (cfg.tboilerh_sensor, value, MAXLEN);
+            snprintf (cfg.tboilerh_sensor, SENSORSLEN, "%s", paths);
             else if (strcmp(name, "tboilerl_sensor")==0)
-            strncpy (cfg.tboilerl_sensor, value, MAXLEN);
+            snprintf (cfg.tboilerl_sensor, SENSORSLEN, "%s", paths);
             else if (strcmp(name, "tenv_sensor")==0)
-            strncpy (cfg.tenv_sensor, value, MAXLEN);
+            snprintf (cfg.tenv_sensor, SENSORSLEN, "%s", paths);
+            else if ((strncmp(name, "extra_sensor_", 13)==0) && (atoi(name+13) >= 1) && (atoi(name+13) <= MAXEXTRASENSORS))
+            snprintf (cfg.extra_sensor[atoi(name+13)-1], SENSORSLEN, "%s", paths);
+            else if ((strncmp(name, "extra_device_", 13)==0) && (atoi(name+13) >= 1) && (atoi(name+13) <= MAXEXTRADEVICES))
+            strncpy (cfg.extra_device[atoi(name+13)-1], value, MAXLEN);
             else if (strcmp(name, "bat_powered_pin")==0)
             strncpy (cfg.bat_powered_pin_str, value, MAXLEN);
             else if (strcmp(name, "pump1_pin")==0)
@@ -551,6 +1449,92 @@ parse_config()
             strncpy (cfg.max_big_consumers_str, value, MAXLEN);
             else if (strcmp(name, "use_acs")==0)
             strncpy (cfg.use_acs_str, value, MAXLEN);
+            else if (strcmp(name, "night_boost_planner")==0)
+            strncpy (cfg.night_boost_planner_str, value, MAXLEN);
+            else if (strcmp(name, "watchdog_systemd")==0)
+            strncpy (cfg.watchdog_systemd_str, value, MAXLEN);
+            else if (strcmp(name, "watchdog_device")==0)
+            strncpy (cfg.watchdog_device_str, value, MAXLEN);
+            else if (strcmp(name, "watchdog_tolerance")==0)
+            strncpy (cfg.watchdog_tolerance_str, value, MAXLEN);
+            else if (strcmp(name, "power_budget_kw")==0)
+            strncpy (cfg.power_budget_kw_str, value, MAXLEN);
+            else if (strcmp(name, "heater_priority")==0)
+            strncpy (cfg.heater_priority_str, value, MAXLEN);
+            else if (strcmp(name, "hp_low_priority")==0)
+            strncpy (cfg.hp_low_priority_str, value, MAXLEN);
+            else if (strcmp(name, "hp_high_priority")==0)
+            strncpy (cfg.hp_high_priority_str, value, MAXLEN);
+            else if (strcmp(name, "site_budget_kw")==0)
+            strncpy (cfg.site_budget_kw_str, value, MAXLEN);
+            else if (strcmp(name, "site_nodes")==0)
+            strncpy (cfg.site_nodes_str, value, MAXLEN);
+            else if (strcmp(name, "site_node_id")==0)
+            strncpy (cfg.site_node_id_str, value, MAXLEN);
+            else if (strcmp(name, "site_priority")==0)
+            strncpy (cfg.site_priority_str, value, MAXLEN);
+            else if (strcmp(name, "site_group")==0)
+            strncpy (cfg.site_group, value, MAXLEN);
+            else if (strcmp(name, "site_interface")==0)
+            strncpy (cfg.site_interface, value, MAXLEN);
+            else if (strcmp(name, "hp_link")==0)
+            strncpy (cfg.hp_link, value, MAXLEN);
+            else if (strcmp(name, "data_every")==0)
+            strncpy (cfg.data_every_str, value, MAXLEN);
+            else if (strcmp(name, "table_every")==0)
+            strncpy (cfg.table_every_str, value, MAXLEN);
+            else if (strcmp(name, "json_every")==0)
+            strncpy (cfg.json_every_str, value, MAXLEN);
+            else if (strcmp(name, "emoncms_every")==0)
+            strncpy (cfg.emoncms_every_str, value, MAXLEN);
+            else if (strcmp(name, "emoncms_url")==0)
+            strncpy (cfg.emoncms_url, value, MAXLEN);
+            else if (strcmp(name, "emoncms_node")==0)
+            strncpy (cfg.emoncms_node, value, MAXLEN);
+            else if (strcmp(name, "emoncms_apikey")==0)
+            strncpy (cfg.emoncms_apikey, value, MAXLEN);
+            else if (strcmp(name, "data_log_rotate_kb")==0)
+            strncpy (cfg.data_log_rotate_kb_str, value, MAXLEN);
+            else if (strcmp(name, "data_log_rotate_min")==0)
+            strncpy (cfg.data_log_rotate_min_str, value, MAXLEN);
+            else if (strcmp(name, "log_rotate_kb")==0)
+            strncpy (cfg.log_rotate_kb_str, value, MAXLEN);
+            else if (strcmp(name, "log_keep_days")==0)
+            strncpy (cfg.log_keep_days_str, value, MAXLEN);
+            else if (strcmp(name, "tariff_rates")==0)
+            strncpy (cfg.tariff_rates, value, MAXLEN);
+            else if ((strncmp(name, "tariff_rule_", 12)==0) && (atoi(name+12) >= 1) && (atoi(name+12) <= MAXTARIFFRULES)) {
+                /* rules in the file replace all of the default ones */
+                if (!tariff_rules_read) memset( cfg.tariff_rule, 0, sizeof cfg.tariff_rule );
+                tariff_rules_read = 1;
+                strncpy (cfg.tariff_rule[atoi(name+12)-1], value, MAXLEN);
+            }
+            else if (strcmp(name, "tariff_holidays")==0)
+            strncpy (cfg.tariff_holidays, value, MAXLEN);
+            else if (strcmp(name, "heat_hours")==0)
+            snprintf (cfg.heat_hours, SENSORSLEN, "%s", paths);
+            else if (strcmp(name, "cool_hours")==0)
+            snprintf (cfg.cool_hours, SENSORSLEN, "%s", paths);
+            else if (strcmp(name, "heat_curve")==0)
+            snprintf (cfg.heat_curve, SENSORSLEN, "%s", paths);
+            else if (strcmp(name, "cool_curve")==0)
+            snprintf (cfg.cool_curve, SENSORSLEN, "%s", paths);
+            else if (strcmp(name, "mode_switch_t")==0)
+            strncpy (cfg.mode_switch_t_str, value, MAXLEN);
+            else if (strcmp(name, "mode_hysteresis")==0)
+            strncpy (cfg.mode_hysteresis_str, value, MAXLEN);
+            else if (strcmp(name, "mqtt_broker")==0)
+            strncpy (cfg.mqtt_broker, value, MAXLEN);
+            else if (strcmp(name, "mqtt_user")==0)
+            strncpy (cfg.mqtt_user, value, MAXLEN);
+            else if (strcmp(name, "mqtt_password")==0)
+            strncpy (cfg.mqtt_password, value, MAXLEN);
+            else if (strcmp(name, "mqtt_prefix")==0)
+            strncpy (cfg.mqtt_prefix, value, MAXLEN);
+            else if (strcmp(name, "mqtt_discovery")==0)
+            strncpy (cfg.mqtt_discovery, value, MAXLEN);
+            else if (strcmp(name, "mqtt_every")==0)
+            strncpy (cfg.mqtt_every_str, value, MAXLEN);
         }
         /* Close file */
         fclose (fp);
@@ -651,10 +1635,165 @@ parse_config()
     i = atoi( buff );
     cfg.use_acs = i;
     /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    /* settings below keep their default when missing from the config file */
+    if (cfg.night_boost_planner_str[0]) {
+        strcpy( buff, cfg.night_boost_planner_str );
+        i = atoi( buff );
+        cfg.night_boost_planner = i;
+        /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    }
+    if (cfg.watchdog_systemd_str[0]) {
+        strcpy( buff, cfg.watchdog_systemd_str );
+        i = atoi( buff );
+        cfg.watchdog_systemd = i;
+        /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    }
+    if (cfg.watchdog_device_str[0]) {
+        strcpy( buff, cfg.watchdog_device_str );
+        i = atoi( buff );
+        cfg.watchdog_device = i;
+        /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    }
+    if (cfg.watchdog_tolerance_str[0]) {
+        strcpy( buff, cfg.watchdog_tolerance_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 30) i = 30;
+        cfg.watchdog_tolerance = i;
+    }
+    if (cfg.mode_switch_t_str[0]) {
+        cfg.mode_switch_t = atof( cfg.mode_switch_t_str );
+        if (cfg.mode_switch_t < 10) cfg.mode_switch_t = 10;
+        if (cfg.mode_switch_t > 35) cfg.mode_switch_t = 35;
+    }
+    if (cfg.mode_hysteresis_str[0]) {
+        cfg.mode_hysteresis = atof( cfg.mode_hysteresis_str );
+        if (cfg.mode_hysteresis < 0) cfg.mode_hysteresis = 0;
+        if (cfg.mode_hysteresis > 10) cfg.mode_hysteresis = 10;
+    }
+    if (cfg.power_budget_kw_str[0]) {
+        cfg.power_budget_kw = atof( cfg.power_budget_kw_str );
+        if (cfg.power_budget_kw < 0) cfg.power_budget_kw = 0;
+        if (cfg.power_budget_kw > 100) cfg.power_budget_kw = 100;
+    }
+    if (cfg.heater_priority_str[0]) {
+        strcpy( buff, cfg.heater_priority_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 9) i = 9;
+        cfg.heater_priority = i;
+    }
+    if (cfg.hp_low_priority_str[0]) {
+        strcpy( buff, cfg.hp_low_priority_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 9) i = 9;
+        cfg.hp_low_priority = i;
+    }
+    if (cfg.hp_high_priority_str[0]) {
+        strcpy( buff, cfg.hp_high_priority_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 9) i = 9;
+        cfg.hp_high_priority = i;
+    }
+    if (cfg.site_budget_kw_str[0]) {
+        cfg.site_budget_kw = atof( cfg.site_budget_kw_str );
+        if (cfg.site_budget_kw < 0) cfg.site_budget_kw = 0;
+        if (cfg.site_budget_kw > 100) cfg.site_budget_kw = 100;
+    }
+    if (cfg.site_nodes_str[0]) {
+        strcpy( buff, cfg.site_nodes_str );
+        i = atoi( buff );
+        if (i < 2) i = 2;
+        if (i > MAXSITEPEERS+1) i = MAXSITEPEERS+1;
+        cfg.site_nodes = i;
+    }
+    if (cfg.site_node_id_str[0]) {
+        strcpy( buff, cfg.site_node_id_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 255) i = 255;
+        cfg.site_node_id = i;
+    }
+    if (cfg.site_priority_str[0]) {
+        strcpy( buff, cfg.site_priority_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 9) i = 9;
+        cfg.site_priority = i;
+    }
+    if (cfg.data_every_str[0]) {
+        strcpy( buff, cfg.data_every_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 8640) i = 8640;
+        cfg.data_every = i;
+    }
+    if (cfg.table_every_str[0]) {
+        strcpy( buff, cfg.table_every_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 8640) i = 8640;
+        cfg.table_every = i;
+    }
+    if (cfg.json_every_str[0]) {
+        strcpy( buff, cfg.json_every_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 8640) i = 8640;
+        cfg.json_every = i;
+    }
+    if (cfg.emoncms_every_str[0]) {
+        strcpy( buff, cfg.emoncms_every_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 8640) i = 8640;
+        cfg.emoncms_every = i;
+    }
+    if (cfg.mqtt_every_str[0]) {
+        strcpy( buff, cfg.mqtt_every_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 8640) i = 8640;
+        cfg.mqtt_every = i;
+    }
+    if (cfg.data_log_rotate_kb_str[0]) {
+        strcpy( buff, cfg.data_log_rotate_kb_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 1024*1024) i = 1024*1024;
+        cfg.data_log_rotate_kb = i;
+    }
+    if (cfg.data_log_rotate_min_str[0]) {
+        strcpy( buff, cfg.data_log_rotate_min_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 31*24*60) i = 31*24*60;
+        cfg.data_log_rotate_min = i;
+    }
+    if (cfg.log_rotate_kb_str[0]) {
+        strcpy( buff, cfg.log_rotate_kb_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 1024*1024) i = 1024*1024;
+        cfg.log_rotate_kb = i;
+    }
+    if (cfg.log_keep_days_str[0]) {
+        strcpy( buff, cfg.log_keep_days_str );
+        i = atoi( buff );
+        if (i < 0) i = 0;
+        if (i > 10*366) i = 10*366;
+        cfg.log_keep_days = i;
+    }
 
     /* transfer config originals in keeping vars for when HA interfacing fails */
     acs_allowed_original = cfg.use_acs;
     boiler_allowed_original = cfg.use_electric_heater_day;
+    /* what HA pushed over MQTT goes with the config it was set over - HA_SETTINGS_FILE, if
+       there, is read again, and the heating curve has the target until HA sets one */
+    ha_pushed = 0;
+    ha_water_target = 0;
 
     /* Prepare log messages with sensor paths and write them to log file */
     sprintf( buff, "Furnace temp sensor file: %s", cfg.tkotel_sensor );
@@ -667,12 +1806,17 @@ parse_config()
     log_message(LOG_FILE, buff);
     sprintf( buff, "Outdoor environment temp sensor file: %s", cfg.tenv_sensor );
     log_message(LOG_FILE, buff);
+    ParseSensorProbes();
     /* Prepare log messages with GPIO pins used and write them to log file */
     sprintf( buff, "Using INPUT GPIO pins (BCM mode) as follows: battery powered: %d", cfg.bat_powered_pin );
     log_message(LOG_FILE, buff);
     sprintf( buff, "Using COMMs GPIO pins (BCM mode) as follows: comms1: %d, comms2: %d, comms3: %d, "\
 	"comms4: %d ", cfg.commspin1_pin, cfg.commspin2_pin, cfg.commspin3_pin, cfg.commspin4_pin );
     log_message(LOG_FILE, buff);
+    if (strcmp( cfg.hp_link, "gpio" )) {
+        sprintf( buff, "INFO: Talking to the heat pump manager over %s instead of the COMMs pins", cfg.hp_link );
+        log_message(LOG_FILE, buff);
+    }
     sprintf( buff, "Using OUTPUT GPIO pins (BCM mode) as follows: P1: %d, P2: %d, V: %d, "\
 	"H: %d ", cfg.pump1_pin, cfg.pump2_pin, cfg.valve1_pin, cfg.el_heater_pin );
     log_message(LOG_FILE, buff);
@@ -697,15 +1841,35 @@ parse_config()
     sprintf( buff, "INFO: Furnace pump always on=%d, use furnace pump=%d, use solar pump=%d, reset P counters day=%d", 
                 cfg.pump1_always_on, cfg.use_pump1, cfg.use_pump2, cfg.day_to_reset_Pcounters);
     log_message(LOG_FILE, buff);
-    sprintf( buff, "INFO: Night boiler boost=%d, absMAX=%d, max big consumers=%d, use ACs=%d", 
-                cfg.night_boost, cfg.abs_max, cfg.max_big_consumers, cfg.use_acs );
+    sprintf( buff, "INFO: Night boiler boost=%d, planned=%d, absMAX=%d, max big consumers=%d, use ACs=%d", 
+                cfg.night_boost, cfg.night_boost_planner, cfg.abs_max, cfg.max_big_consumers, cfg.use_acs );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Watchdog: systemd=%d, device=%d, tolerance=%d cycles",
+                cfg.watchdog_systemd, cfg.watchdog_device, cfg.watchdog_tolerance );
+    log_message(LOG_FILE, buff);
+    /* HP high only runs on top of HP low - put before it, it would never get power */
+    if (cfg.hp_high_priority > cfg.hp_low_priority) {
+        sprintf( buff, "WARNING: hp_high_priority=%d is above hp_low_priority=%d, but HP high needs HP low "\
+                 "running - taking %d", cfg.hp_high_priority, cfg.hp_low_priority, cfg.hp_low_priority );
+        log_message(LOG_FILE, buff);
+        cfg.hp_high_priority = cfg.hp_low_priority;
+    }
+    sprintf( buff, "INFO: Power budget: %3.1f kW, priorities: heater=%d, HP low=%d, HP high=%d",
+                PowerBudgetW()/1000.0, cfg.heater_priority, cfg.hp_low_priority, cfg.hp_high_priority );
     log_message(LOG_FILE, buff);
+    if (cfg.site_budget_kw > 0) {
+        sprintf( buff, "INFO: Site power budget: %3.1f kW over %d nodes, this is node %d with priority %d, group %s",
+                    cfg.site_budget_kw, cfg.site_nodes, cfg.site_node_id, cfg.site_priority, cfg.site_group );
+        log_message(LOG_FILE, buff);
+    }
+    SetupDevices();
+    SinksConfigure();
+    LogsConfigure();
+    TariffCompile();
+    HeatCurveCompile();
 	
     /* stuff for after parsing config file: */
-    /* calculate maximum possible temp for use in night_boost case; consider this: getting too hot causes calcium
-       build-up in the tank; keeping in too low (30 to 45) makes for a perfect bacteria environment */
-    nightEnergyTemp = ((float)cfg.wanted_T + 10);
-    if (nightEnergyTemp > (float)cfg.abs_max) { nightEnergyTemp = (float)cfg.abs_max; }
+    SetNightEnergyTemp();
 }
 
 void
@@ -724,7 +1888,14 @@ WritePersistentData() {
     fprintf( logfile, "# hwwm persistent data file written @ %s\n", timestamp );
     fprintf( logfile, "total=%6.3f\n", TotalPowerUsed );
     fprintf( logfile, "nightly=%6.3f\n", NightlyPowerUsed );
+    fprintf( logfile, "cost=%6.3f\n", PowerCost );
+    /* lifetime ON switchings, ON seconds, longest and shortest ON run of each device */
+    for (short i=0;i<devices_count;i++) {
+        fprintf( logfile, "dev_%s=%lu,%lu,%lu,%lu\n", devices[i].name, dev_stats[i].switches,
+                    dev_stats[i].on_s, dev_stats[i].longest_on, dev_stats[i].shortest_on );
+    }
     fclose( logfile );
+    WriteModelData();
 }
 
 void
@@ -733,9 +1904,11 @@ ReadPersistentData() {
     char *s, buff[150];
     char totalP_str[MAXLEN];
     char nightlyP_str[MAXLEN];
+    char cost_str[MAXLEN];
     short should_write=0;
     strcpy( totalP_str, "0" );
     strcpy( nightlyP_str, "0" );
+    strcpy( cost_str, "0" );
     FILE *fp = fopen(PERSISTENCE_FILE, "r");
     if (fp == NULL) {
         log_message(LOG_FILE,"WARNING: Failed to open "PERSISTENCE_FILE" file for reading!");
@@ -763,6 +1936,15 @@ ReadPersistentData() {
             strncpy (totalP_str, value, MAXLEN);
             else if (strcmp(name, "nightly")==0)
             strncpy (nightlyP_str, value, MAXLEN);
+            else if (strcmp(name, "cost")==0)
+            strncpy (cost_str, value, MAXLEN);
+            else if (strncmp(name, "dev_", 4)==0) {
+                for (short i=0;i<devices_count;i++) {
+                    if (strcmp(name+4, devices[i].name)) continue;
+                    struct device_stats *ds = &dev_stats[i];
+                    sscanf( value, "%lu,%lu,%lu,%lu", &ds->switches, &ds->on_s, &ds->longest_on, &ds->shortest_on );
+                }
+            }
         }
         /* Close file */
         fclose (fp);
@@ -780,15 +1962,18 @@ ReadPersistentData() {
         strcpy( buff, nightlyP_str );
         f = atof( buff );
         NightlyPowerUsed = f;
+        strcpy( buff, cost_str );
+        f = atof( buff );
+        PowerCost = f;
     }
 
     /* Prepare log message and write it to log file */
     if (fp == NULL) {
-        sprintf( buff, "INFO: Using power counters start values: Total=%6.3f, Nightly=%6.3f",
-        TotalPowerUsed, NightlyPowerUsed );
+        sprintf( buff, "INFO: Using power counters start values: Total=%6.3f, Nightly=%6.3f, Cost=%6.3f",
+        TotalPowerUsed, NightlyPowerUsed, PowerCost );
         } else {
-        sprintf( buff, "INFO: Read power counters start values: Total=%6.3f, Nightly=%6.3f",
-        TotalPowerUsed, NightlyPowerUsed );
+        sprintf( buff, "INFO: Read power counters start values: Total=%6.3f, Nightly=%6.3f, Cost=%6.3f",
+        TotalPowerUsed, NightlyPowerUsed, PowerCost );
     }
     log_message(LOG_FILE, buff);
 }
@@ -801,12 +1986,18 @@ ReadHAsettings() {
     char TT_str[MAXLEN];
     char ACsA_str[MAXLEN];
     char BA_str[MAXLEN];
-    static char data[180];
+    static HWWM_TLS char data[180];
     strcpy( TT_str, "99" );
     strcpy( ACsA_str, "0" );
     strcpy( BA_str, "0" );
-    FILE *fp = fopen( HA_SETTINGS_FILE, "r" );
     sprintf( data, "-----> ReadHAsettings:" );
+    if (ha_pushed) {
+        sprintf( data + strlen(data), " pushed over MQTT: ACs target temp=%5.3f, use ACs=%d, el. heater allowed=%d",
+                    furnace_water_target, cfg.use_acs, cfg.use_electric_heater_day );
+        DataNote( data );
+        return;
+    }
+    FILE *fp = fopen( HA_SETTINGS_FILE, "r" );
     if (fp == NULL) {
         sprintf( data + strlen(data), " no HA settings file;" );
         } else {
@@ -841,7 +2032,8 @@ ReadHAsettings() {
 
     /* Check if we got file open */
     if (fp == NULL) {
-        /* transfer config originals back as hwwm config values */
+        /* transfer config originals back as hwwm config values; the heating curve sets the target */
+        ha_water_target = 0;
         cfg.use_acs = acs_allowed_original;
         cfg.use_electric_heater_day = boiler_allowed_original;
         sprintf( data + strlen(data), " using config file settings; ACs target temp=%5.3f, use ACs=%d, el. heater allowed=%d",
@@ -851,6 +2043,7 @@ ReadHAsettings() {
         strcpy( buff, TT_str );
         f = atof( buff );
         rangecheck_ACs_wanted_temp( f );
+        ha_water_target = f;
         furnace_water_target = f;
         strcpy( buff, ACsA_str );
         i = atoi( buff );
@@ -864,7 +2057,7 @@ ReadHAsettings() {
         sprintf( data + strlen(data), " read HA settings: ACs target temp=%5.3f, use ACs=%d, el. heater allowed=%d",
                     furnace_water_target, cfg.use_acs, cfg.use_electric_heater_day );
     }
-    log_message( DATA_FILE, data );
+    DataNote( data );
 }
 
 int
@@ -874,7 +2067,7 @@ GPIOExport(int pin)
     ssize_t bytes_written;
     int fd;
 
-    fd = open("/sys/class/gpio/export", O_WRONLY);
+    fd = open(SYSFS_ROOT "/class/gpio/export", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO export for writing!");
         return(-1);
@@ -893,7 +2086,7 @@ GPIOUnexport(int pin)
     ssize_t bytes_written;
     int fd;
 
-    fd = open("/sys/class/gpio/unexport", O_WRONLY);
+    fd = open(SYSFS_ROOT "/class/gpio/unexport", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO unexport for writing!");
         return(-1);
@@ -913,7 +2106,7 @@ GPIODirection(int pin, int dir)
     char path[DIRECTION_MAX];
     int fd;
 
-    snprintf(path, DIRECTION_MAX, "/sys/class/gpio/gpio%d/direction", pin);
+    snprintf(path, DIRECTION_MAX, SYSFS_ROOT "/class/gpio/gpio%d/direction", pin);
     fd = open(path, O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO direction for writing!");
@@ -936,7 +2129,7 @@ GPIORead(int pin)
     char value_str[3];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
+    snprintf(path, VALUE_MAX, SYSFS_ROOT "/class/gpio/gpio%d/value", pin);
     fd = open(path, O_RDONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO value for reading!");
@@ -961,7 +2154,7 @@ GPIOWrite(int pin, int value)
     char path[VALUE_MAX];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
+    snprintf(path, VALUE_MAX, SYSFS_ROOT "/class/gpio/gpio%d/value", pin);
     fd = open(path, O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO value for writing!");
@@ -989,46 +2182,112 @@ GPIOWrite(int pin, int value)
     sys     0m0.050s
 */
 
+/* sensor read results - anything but SENSOR_OK means sensorRead() returned -200 */
+#define SENSOR_OK           0
+#define SENSOR_ERR_IO       1
+#define SENSOR_ERR_FORMAT   2
+#define SENSOR_ERR_CRC      3
+#define SENSOR_ERR_POR      4
+#define SENSOR_ERR_RANGE    5
+
+const char *sensor_err_names[6] = { "OK", "I/O", "format", "CRC", "power-on reset value", "out of range" };
+
+/* Dallas/Maxim 1-wire CRC8, polynomial x^8 + x^5 + x^4 + 1 */
+unsigned char
+crc8_1wire(const unsigned char *data, short len) {
+    unsigned char crc = 0;
+    while (len--) {
+        unsigned char b = *data++;
+        for (short i=0;i<8;i++) {
+            unsigned char mix = (crc ^ b) & 1;
+            crc >>= 1;
+            if (mix) crc ^= 0x8C;
+            b >>= 1;
+        }
+    }
+    return crc;
+}
+
+short
+hexval(char c) {
+    if ((c >= '0') && (c <= '9')) return c - '0';
+    if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+/* read n hex bytes each followed by a space; return pointer past them or NULL */
+const char *
+parse_hex_bytes(const char *p, unsigned char *out, short n) {
+    for (short i=0;i<n;i++) {
+        if ((hexval(p[0]) < 0) || (hexval(p[1]) < 0) || (p[2] != ' ')) return NULL;
+        out[i] = (hexval(p[0]) << 4) | hexval(p[1]);
+        p += 3;
+    }
+    return p;
+}
+
+/* strictly parse both lines of w1_slave output into milli-degrees C:
+   line 1 must carry the 9 scratchpad bytes, their CRC8 and a YES from the kernel,
+   line 2 the same 9 bytes and t=; return one of the SENSOR_ codes */
+short
+sensorParse(const char *buf, long *millic) {
+    unsigned char sp[9], sp2[9];
+    const char *p, *nl;
+    char *e;
+    long t;
+
+    p = parse_hex_bytes(buf, sp, 9);
+    if ((p == NULL) || strncmp(p, ": crc=", 6) || (hexval(p[6]) < 0) || (hexval(p[7]) < 0)) return SENSOR_ERR_FORMAT;
+    if ((nl = strchr(p, '\n')) == NULL) return SENSOR_ERR_FORMAT;
+    if (strncmp(p+8, " YES", 4)) return SENSOR_ERR_CRC;
+    if ((crc8_1wire(sp, 8) != sp[8]) || (((hexval(p[6]) << 4) | hexval(p[7])) != sp[8])) return SENSOR_ERR_CRC;
+    p = parse_hex_bytes(nl+1, sp2, 9);
+    if ((p == NULL) || strncmp(p, "t=", 2)) return SENSOR_ERR_FORMAT;
+    /* both lines must come from the same conversion */
+    if (memcmp(sp, sp2, 9)) return SENSOR_ERR_CRC;
+    t = strtol(p+2, &e, 10);
+    if ((e == p+2) || ((*e != '\n') && (*e != '\0'))) return SENSOR_ERR_FORMAT;
+    *millic = t;
+    if (t == 85000) return SENSOR_ERR_POR;
+    /* DS18B20 range is -55..+125 C; -127 C is what a lost device reads as */
+    if ((t < -55000) || (t > 125000)) return SENSOR_ERR_RANGE;
+    return SENSOR_OK;
+}
+
+/* read sensor; return temp or -200 on trouble, with the reason in *err;
+   for SENSOR_ERR_POR 85 is returned, so the caller can accept it if it is plausible */
 float
-sensorRead(const char* sensor)
+sensorRead(const char* sensor, short *err)
 {
-    char path[VALUE_MAX];
-    char value_str[95];
+    char value_str[100];
     int fd;
-    char *str = "29 01 55 05 7f a5 a5 66 b3 : crc=b3 YES  84 01 55 00 3f ff 3f 10 d7 t=114250";
-    const char *result = str;
+    ssize_t n;
     long int_temp = 0;
-    float temp = -200;
-    /* if having trouble - return -200 */
 
     /* try to open sensor file */
-    snprintf(path, VALUE_MAX, "%s", sensor);
-    fd = open(path, O_RDONLY);
+    fd = open(sensor, O_RDONLY);
     if (-1 == fd) {
-        log_message(LOG_FILE,"Error opening sensor file. Continuing.");
-        return temp;
-    }
-
-    /* do the data read in one go - up to 88 characters */
-    if (-1 == read(fd, value_str, 88)) {
-        log_message(LOG_FILE,"Error reading from sensor file. Continuing.");
-        close(fd);
-        return temp;
+        *err = SENSOR_ERR_IO;
+        return -200;
     }
 
+    /* do the data read in one go - w1_slave output is 75 to 80 characters */
+    n = read(fd, value_str, sizeof(value_str)-1);
     /* close the file - we are done with it */
     close(fd);
-
-    /* transform sensor data to float by finding last "=" sign */
-    if ((result = strrchr((char *)&value_str, '=')) != NULL) {
-        /* increment result to avoid the '=' */
-        ++result;
-        int_temp = atol( result );
-        temp = ((float)int_temp) / 1000;
+    if (n <= 0) {
+        *err = SENSOR_ERR_IO;
+        return -200;
     }
+    value_str[n] = 0;
+
+    *err = sensorParse(value_str, &int_temp);
+    if (*err == SENSOR_ERR_POR) return 85;
+    if (*err != SENSOR_OK) return -200;
 
     /* return the read temperature */
-    return temp;
+    return ((float)int_temp) / 1000;
 }
 
 void
@@ -1040,21 +2299,16 @@ signal_handler(int sig)
         need_to_read_cfg = 1;
         break;
         case SIGUSR2:
-        log_message(LOG_FILE, "INFO: Signal SIGUSR2 caught. Not implemented. Continuing. *************************");
+        log_message(LOG_FILE, "INFO: Signal SIGUSR2 caught. Will hand over to "HWWM_BINARY" soon. *************************");
+        need_to_hand_over = 1;
         break;
         case SIGHUP:
         log_message(LOG_FILE, "INFO: Signal SIGHUP caught. Not implemented. Continuing. *************************");
         break;
         case SIGTERM:
         log_message(LOG_FILE, "INFO: Terminate signal caught. Stopping. *************************");
-        WritePersistentData();
-        if ( ! DisableGPIOpins() ) {
-            log_message(LOG_FILE, "WARNING: Errors disabling GPIO pins! Quitting anyway.");
-            exit(14);
-        }
-        // this run was ProgramRunCycles cycles ;) 
-        log_message(LOG_FILE,"Exiting normally. Bye, bye!");
-        exit(0);
+        /* the control loop stops - with the sink threads flushed, which cannot be done from here */
+        need_to_stop = 1;
         break;
     }
 }
@@ -1062,25 +2316,39 @@ signal_handler(int sig)
 void
 daemonize()
 {
-    int i, lfp;
+    int i;
     char str[10];
+    const char *ho = getenv(HANDOFF_ENV);
 
-    if(getppid()==1) return; /* already a daemon */
-    i=fork();
-    if (i<0) { printf("hwwm daemonize(): Fork error!\n"); exit(1); }/* fork error */
-    if (i>0) exit(0); /* parent exits */
-    /* child (daemon) continues */
-    setsid(); /* obtain a new process group */
-    for (i=getdtablesize();i>=0;--i) close(i); /* close all descriptors */
+    if (ho != NULL) {
+        /* re-executed by a running hwwm - already detached, and holding the lock */
+        handed_over = 1;
+        lock_fd = atoi(ho);
+        unsetenv(HANDOFF_ENV);
+    }
+
+    /* started by init or systemd - nothing to detach from, but the rest still applies;
+       a handed over binary stays the process it replaced: same pid, lock and supervisor */
+    if(!handed_over && (getppid()!=1)) {
+        i=fork();
+        if (i<0) { printf("hwwm daemonize(): Fork error!\n"); exit(1); }/* fork error */
+        if (i>0) exit(0); /* parent exits */
+        /* child (daemon) continues */
+        setsid(); /* obtain a new process group */
+    }
+    for (i=getdtablesize();i>=0;--i) if (i != lock_fd) close(i); /* close all descriptors */
     i=open("/dev/null",O_RDWR); dup(i); dup(i); /* handle standart I/O */
     umask(022); /* set newly created file permissions */
     chdir(RUNNING_DIR); /* change running directory */
-    lfp=open(LOCK_FILE,O_RDWR|O_CREAT,0644);
-    if (lfp<0) exit(2); /* can not open */
-    if (lockf(lfp,F_TLOCK,0)<0) exit(0); /* can not lock */
-    /* first instance continues */
-    sprintf(str,"%d\n",getpid());
-    write(lfp,str,strlen(str)); /* record pid to lockfile */
+    if (!handed_over) {
+        /* the lock descriptor is left open on exec - it goes over to a new binary on SIGUSR2 */
+        lock_fd=open(LOCK_FILE,O_RDWR|O_CREAT,0644);
+        if (lock_fd<0) exit(2); /* can not open */
+        if (lockf(lock_fd,F_TLOCK,0)<0) exit(0); /* can not lock */
+        /* first instance continues */
+        sprintf(str,"%d\n",getpid());
+        write(lock_fd,str,strlen(str)); /* record pid to lockfile */
+    }
     signal(SIGCHLD,SIG_IGN); /* ignore child */
     signal(SIGTSTP,SIG_IGN); /* ignore tty signals */
     signal(SIGTTOU,SIG_IGN);
@@ -1095,10 +2363,9 @@ daemonize()
 short
 EnableGPIOpins()
 {
-    if (-1 == GPIOExport(cfg.pump1_pin)) return 0;
-    if (-1 == GPIOExport(cfg.pump2_pin)) return 0;
-    if (-1 == GPIOExport(cfg.valve1_pin)) return 0;
-    if (-1 == GPIOExport(cfg.el_heater_pin))  return 0;
+    for (short i=0;i<devices_count;i++) {
+        if ((devices[i].pin >= 0) && (-1 == GPIOExport(devices[i].pin))) return 0;
+    }
     if (-1 == GPIOExport(cfg.bat_powered_pin)) return 0;
     if (-1 == GPIOExport(cfg.commspin1_pin)) return 0;
     if (-1 == GPIOExport(cfg.commspin2_pin)) return 0;
@@ -1115,10 +2382,9 @@ SetGPIODirection()
     if (-1 == GPIODirection(cfg.commspin3_pin, IN))  return 0;
     if (-1 == GPIODirection(cfg.commspin4_pin, IN))  return 0;
     /* output pins */
-    if (-1 == GPIODirection(cfg.pump1_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.pump2_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.valve1_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.el_heater_pin, OUT))  return 0;
+    for (short i=0;i<devices_count;i++) {
+        if ((devices[i].pin >= 0) && (-1 == GPIODirection(devices[i].pin, OUT))) return 0;
+    }
     if (-1 == GPIODirection(cfg.commspin1_pin, OUT))  return 0;
     if (-1 == GPIODirection(cfg.commspin2_pin, OUT))  return 0;
     return -1;
@@ -1127,10 +2393,9 @@ SetGPIODirection()
 short
 DisableGPIOpins()
 {
-    if (-1 == GPIOUnexport(cfg.pump1_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.pump2_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.valve1_pin)) return 0;
-    if (-1 == GPIOUnexport(cfg.el_heater_pin))  return 0;
+    for (short i=0;i<devices_count;i++) {
+        if ((devices[i].pin >= 0) && (-1 == GPIOUnexport(devices[i].pin))) return 0;
+    }
     if (-1 == GPIOUnexport(cfg.bat_powered_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.commspin1_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.commspin2_pin)) return 0;
@@ -1139,50 +2404,379 @@ DisableGPIOpins()
     return -1;
 }
 
+long
+ms_since(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - t->tv_sec)*1000L + (now.tv_nsec - t->tv_nsec)/1000000L;
+}
+
+/* FD REGISTRY: sockets hwwm serves between cycles; CycleSleep() waits on them in poll()
+   instead of sleeping, and calls the handler of each one that gets readable */
+#define MAXWATCHEDFDS       8
+
+struct fd_watch
+{
+    int     fd;
+    void    (*handler)(int fd);
+};
+
+HWWM_TLS struct fd_watch watched_fds[MAXWATCHEDFDS];
+HWWM_TLS short watched_fds_count = 0;
+
+short
+WatchFd(int fd, void (*handler)(int fd)) {
+    if (watched_fds_count >= MAXWATCHEDFDS) return 0;
+    watched_fds[watched_fds_count].fd = fd;
+    watched_fds[watched_fds_count].handler = handler;
+    watched_fds_count++;
+    return 1;
+}
+
 void
-ReadSensors() {
-    float new_val = 0;
-    short i, k;
-    char msg[100];
+UnwatchFd(int fd) {
+    for (short i=0;i<watched_fds_count;i++) {
+        if (watched_fds[i].fd != fd) continue;
+        watched_fds[i] = watched_fds[--watched_fds_count];
+        return;
+    }
+}
 
-    for (i=1;i<=TOTALSENSORS;i++) {
-        new_val = sensorRead(sensor_paths[i]);
-        if ( new_val != -200 ) {
-            if (sensor_read_errors[i]) sensor_read_errors[i]--;
-            if (just_started) { sensors_prv[i] = new_val; sensors[i] = new_val; }
-            if ((just_started > 2)&&(i == 5)) { for (k=0;k<12;k++) { TenvArr[k] = new_val; } }
-            if (new_val < (sensors[i]-mtd[i])) {
-                sprintf( msg, "WARNING: Correcting LOW %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]-mtd[i] );
-                log_message(LOG_FILE, msg);
-                new_val = sensors[i]-mtd[i];
-            }
-            if (new_val > (sensors[i]+mtd[i])) {
-                sprintf( msg, "WARNING: Correcting HIGH %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]+mtd[i] );
-                log_message(LOG_FILE, msg);
-                new_val = sensors[i]+mtd[i];
-            }
-            sensors_prv[i] = sensors[i];
-            sensors[i] = new_val;
+/* sleep for usec, serving the watched fds meanwhile */
+void
+CycleSleep(long usec) {
+    struct pollfd pfd[MAXWATCHEDFDS];
+    struct timespec start;
+    long left;
+    short i, n;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    while (!need_to_stop && ((left = usec/1000 - ms_since(&start)) > 0)) {
+        n = watched_fds_count;
+        for (i=0;i<n;i++) {
+            pfd[i].fd = watched_fds[i].fd;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
         }
-        else {
-            sensor_read_errors[i]++;
-            sprintf( msg, "WARNING: Sensor '%s' ReadSensors() errors++. Counter at %d.", sensor_names[i], sensor_read_errors[i] );
-            log_message(LOG_FILE, msg);
+        if (poll( pfd, n, left ) <= 0) continue;
+        /* a handler may unwatch its fd - look it up again before each call */
+        for (i=0;i<n;i++) {
+            if (!pfd[i].revents) continue;
+            for (short j=0;j<watched_fds_count;j++) {
+                if (watched_fds[j].fd == pfd[i].fd) { watched_fds[j].handler( pfd[i].fd ); break; }
+            }
+        }
+    }
+}
+
+/* sensor reader thread: waits for a round to be started, reads its sensor - retrying bad
+   reads while the deadline allows - and posts the result */
+void *
+SensorReader(void *arg) {
+    struct sensor_slot *sl = (struct sensor_slot *)arg;
+    short i = sl->sensor;
+    char path[MAXLEN], label[40], msg[120];
+    unsigned long round;
+    float v, prev;
+    short err, tries, starting;
+    struct timespec started;
+
+    while (1) {
+        pthread_mutex_lock( &acq_lock );
+        while (sl->done_round == sl->want_round) pthread_cond_wait( &acq_start, &acq_lock );
+        round = sl->want_round;
+        strcpy( path, sl->path );
+        strcpy( label, sl->label );
+        prev = sl->prev;
+        starting = sl->starting;
+        started = acq_started_at;
+        pthread_mutex_unlock( &acq_lock );
+
+        for (tries=1;;tries++) {
+            v = sensorRead(path, &err);
+            /* 85 C is also the DS18B20 power-on value; only believe it if we are already close */
+            if ((err == SENSOR_ERR_POR) && !starting && (prev > 80)) err = SENSOR_OK;
+            if (err == SENSOR_OK) break;
+            if (err == SENSOR_ERR_CRC) {
+                pthread_mutex_lock( &acq_lock );
+                sensor_crc_errors[i]++;
+                pthread_mutex_unlock( &acq_lock );
+            }
+            sprintf( msg, "WARNING: Sensor '%s' read failed (%s), attempt %d.", label, sensor_err_names[err], tries );
+            log_message(LOG_FILE, msg);
+            /* leave a read's worth of time before the deadline for the retry */
+            if ((tries > SENSOR_RETRIES) || (ms_since(&started) > SENSOR_DEADLINE_MS - 1000)) break;
+            pthread_mutex_lock( &acq_lock );
+            sensor_retries++;
+            pthread_mutex_unlock( &acq_lock );
+        }
+
+        pthread_mutex_lock( &acq_lock );
+        sl->value = v;
+        sl->err = err;
+        if (err == SENSOR_OK) clock_gettime( CLOCK_MONOTONIC, &sl->good_at );
+        sl->done_round = round;
+        pthread_cond_broadcast( &acq_done );
+        pthread_mutex_unlock( &acq_lock );
+    }
+    return NULL;
+}
+
+/* start the reader thread of a probe if not running yet; return 0 on error */
+short
+StartProbeReader(struct sensor_slot *sl) {
+    if (sl->running) return -1;
+    clock_gettime( CLOCK_MONOTONIC, &sl->good_at );
+    if (pthread_create( &sl->thread, NULL, SensorReader, sl )) return 0;
+    sl->running = 1;
+    return -1;
+}
+
+/* start the reader threads of all configured probes; return 0 on error */
+short
+StartSensorReaders() {
+    pthread_condattr_t ca;
+
+    pthread_condattr_init( &ca );
+    pthread_condattr_setclock( &ca, CLOCK_MONOTONIC );
+    if (pthread_cond_init( &acq_done, &ca )) return 0;
+    pthread_condattr_destroy( &ca );
+    for (short i=1;i<=MAXSENSORS;i++) {
+        for (short j=0;j<MAXPROBES;j++) {
+            acq[i][j].sensor = i;
+            acq[i][j].probe = j;
+            if ((j < probes_count[i]) && !StartProbeReader(&acq[i][j])) return 0;
+        }
+    }
+    return -1;
+}
+
+/* ask all readers for a new round of reads; a reader still stuck in a previous one
+   will pick the new round up when (if) it gets out. Probes added by a config re-read
+   get their reader here, removed ones are just not asked any more */
+void
+StartSensorsAcquisition() {
+    char msg[120];
+    short i, j, failed = 0;
+    struct sensor_slot *sl;
+
+    pthread_mutex_lock( &acq_lock );
+    acq_round++;
+    clock_gettime( CLOCK_MONOTONIC, &acq_started_at );
+    for (i=1;i<=MAXSENSORS;i++) {
+        for (j=0;j<probes_count[i];j++) {
+            sl = &acq[i][j];
+            if (!StartProbeReader(sl)) { failed = i; continue; }
+            strcpy( sl->path, probes[i][j].path );
+            if (probes_count[i] > 1) sprintf( sl->label, "%s#%d", sensor_names[i], j+1 );
+            else strcpy( sl->label, sensor_names[i] );
+            sl->weight = probes[i][j].weight;
+            sl->prev = sensors[i];
+            sl->starting = just_started;
+            sl->want_round = acq_round;
+        }
+    }
+    pthread_cond_broadcast( &acq_start );
+    pthread_mutex_unlock( &acq_lock );
+    if (failed) {
+        sprintf( msg, "WARNING: Failed to start a reader for sensor '%s'. Will retry.", sensor_names[failed] );
+        log_message(LOG_FILE, msg);
+    }
+}
+
+/* fuse n good reads v[] with weights w[] of one measurement point into one value: the
+   weighted median, and then the weighted mean of the reads within FUSE_MAX_SPREAD of it.
+   Two reads that disagree have no median to speak of - the one closer to the previous
+   value of the point wins (the heavier one when there is none yet). Reads left out of
+   the result get their out[] set */
+float
+FuseProbes(short n, const float *v, const float *w, float prev, short *out)
+{
+    short k, m, ord[MAXPROBES];
+    float total = 0, acc = 0, med, sum = 0, sumw = 0;
+
+    for (k=0;k<n;k++) {
+        out[k] = 0;
+        total += w[k];
+        /* insertion sort of the indexes by value - n is tiny */
+        for (m=k; (m > 0) && (v[ord[m-1]] > v[k]); m--) ord[m] = ord[m-1];
+        ord[m] = k;
+    }
+    if ((n == 2) && (fabs(v[0] - v[1]) > FUSE_MAX_SPREAD)) {
+        if (prev != -200) k = (fabs(v[1] - prev) < fabs(v[0] - prev));
+        else k = (w[1] > w[0]);
+        out[1-k] = 1;
+        return v[k];
+    }
+    med = v[ord[n-1]];
+    for (k=0;k<n;k++) {
+        acc += w[ord[k]];
+        if (acc >= total/2) { med = v[ord[k]]; break; }
+    }
+    for (k=0;k<n;k++) {
+        if (fabs(v[k] - med) > FUSE_MAX_SPREAD) { out[k] = 1; continue; }
+        sum += v[k] * w[k];
+        sumw += w[k];
+    }
+    return sum / sumw;
+}
+
+void
+ReadSensors() {
+    short i, j, k, n[MAXSENSORS+1], missed[MAXSENSORS+1][MAXPROBES];
+    short which[MAXSENSORS+1][MAXPROBES], out[MAXPROBES];
+    float vals[MAXSENSORS+1], v[MAXSENSORS+1][MAXPROBES], w[MAXSENSORS+1][MAXPROBES];
+    unsigned long ages[MAXSENSORS+1][MAXPROBES];
+    char msg[160];
+    struct timespec deadline;
+    struct sensor_slot *sl;
+
+    /* collect this round: normally it finished long ago, during the previous cycle's sleep;
+       wait only until the round deadline for whatever is still out */
+    pthread_mutex_lock( &acq_lock );
+    deadline = acq_started_at;
+    deadline.tv_sec += SENSOR_DEADLINE_MS / 1000;
+    deadline.tv_nsec += (SENSOR_DEADLINE_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+    for (i=1;i<=MAXSENSORS;i++) {
+        for (j=0;j<MAXPROBES;j++) {
+            while ((acq[i][j].want_round == acq_round) && (acq[i][j].done_round != acq_round)) {
+                if (pthread_cond_timedwait( &acq_done, &acq_lock, &deadline ) == ETIMEDOUT) break;
+            }
+        }
+    }
+    for (i=1;i<=MAXSENSORS;i++) {
+        n[i] = 0;
+        sensor_age[i] = 0;
+        for (j=0;j<MAXPROBES;j++) {
+            sl = &acq[i][j];
+            missed[i][j] = 0;
+            if (sl->want_round != acq_round) continue;
+            ages[i][j] = ms_since(&sl->good_at) / 1000;
+            if (sl->done_round != acq_round) { missed[i][j] = 1; sl->misses++; }
+            else if (sl->err == SENSOR_OK) {
+                v[i][n[i]] = sl->value;
+                w[i][n[i]] = sl->weight;
+                which[i][n[i]] = j;
+                n[i]++;
+                continue;
+            }
+            /* age of a point with no good read now is that of its freshest probe */
+            if (!sensor_age[i] || (ages[i][j] < sensor_age[i])) sensor_age[i] = ages[i][j];
+        }
+        if (n[i]) sensor_age[i] = 0;
+    }
+    pthread_mutex_unlock( &acq_lock );
+
+    for (i=1;i<=MAXSENSORS;i++) {
+        for (j=0;j<MAXPROBES;j++) {
+            if (!missed[i][j]) continue;
+            sprintf( msg, "WARNING: Sensor '%s' read missed its deadline; last good read %lu seconds old.", acq[i][j].label, ages[i][j] );
+            log_message(LOG_FILE, msg);
+        }
+        vals[i] = -200;
+        if (!n[i]) continue;
+        vals[i] = FuseProbes(n[i], v[i], w[i], sensors[i], out);
+        fuse_spread[i] = 0;
+        for (k=0;k<n[i];k++) {
+            j = which[i][k];
+            for (short m=0;m<n[i];m++) if (v[i][m] - v[i][k] > fuse_spread[i]) fuse_spread[i] = v[i][m] - v[i][k];
+            if (out[k]) probe_rejects[i][j]++;
+            /* log only when a probe starts or stops disagreeing with the rest */
+            if (out[k] && !probe_rejected[i][j]) {
+                sprintf( msg, "WARNING: Sensor '%s' disagrees: read %6.3f vs fused %6.3f - leaving it out.", acq[i][j].label, v[i][k], vals[i] );
+                log_message(LOG_FILE, msg);
+            }
+            if (!out[k] && probe_rejected[i][j]) {
+                sprintf( msg, "INFO: Sensor '%s' agrees again: read %6.3f vs fused %6.3f.", acq[i][j].label, v[i][k], vals[i] );
+                log_message(LOG_FILE, msg);
+            }
+            probe_rejected[i][j] = out[k];
+        }
+    }
+
+    if ( ! SensorsUpdate(vals) ) {
+        /* log the errors, clean up and bail out */
+        WritePersistentData();
+        if ( ! DisableGPIOpins() ) {
+            log_message(LOG_FILE, "ALARM: GPIO disable failed on handling sensor read failures.");
+            exit(66);
+        }
+        exit(55);
+    }
+}
+
+/* take this cycle's fused reads (-200: none) into sensors[], with the error counters and
+   the mtd[] clamp; return 0 if a safety-critical sensor has failed */
+short
+SensorsUpdate(const float *vals) {
+    float new_val = 0;
+    short i, k;
+    char msg[160];
+
+    for (i=1;i<=MAXSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
+        new_val = vals[i];
+        if ( new_val != -200 ) {
+            if (sensors_failed & (1<<i)) {
+                /* a failed sensor reads again - start over from the real value, and
+                   have it prove itself for a few cycles, like on start-up */
+                if (sensor_read_errors[i] > 3) {
+                    sensor_read_errors[i] = 3;
+                    sensors_prv[i] = new_val;
+                    sensors[i] = new_val;
+                }
+                if (sensor_read_errors[i] == 1) {
+                    sensors_failed &= ~(1<<i);
+                    sprintf( msg, "INFO: Sensor '%s' is back. Leaving degraded operation for it.", sensor_names[i] );
+                    log_message(LOG_FILE, msg);
+                }
+            }
+            if (sensor_read_errors[i]) sensor_read_errors[i]--;
+            if (just_started) { sensors_prv[i] = new_val; sensors[i] = new_val; }
+            if ((just_started > 2)&&(i == 5)) { for (k=0;k<12;k++) { TenvArr[k] = new_val; } }
+            if (new_val < (sensors[i]-mtd[i])) {
+                sprintf( msg, "WARNING: Correcting LOW %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]-mtd[i] );
+                log_message(LOG_FILE, msg);
+                new_val = sensors[i]-mtd[i];
+            }
+            if (new_val > (sensors[i]+mtd[i])) {
+                sprintf( msg, "WARNING: Correcting HIGH %6.3f for sensor '%s' with %6.3f.", new_val, sensor_names[i], sensors[i]+mtd[i] );
+                log_message(LOG_FILE, msg);
+                new_val = sensors[i]+mtd[i];
+            }
+            sensors_prv[i] = sensors[i];
+            sensors[i] = new_val;
+        }
+        else {
+            if (sensor_read_errors[i] < 100) sensor_read_errors[i]++;
+            sprintf( msg, "WARNING: Sensor '%s' ReadSensors() errors++. Counter at %d.", sensor_names[i], sensor_read_errors[i] );
+            log_message(LOG_FILE, msg);
+            if (sensors_failed & (1<<i)) {
+                sensors_prv[i] = sensors[i];
+                sensors[i] = SensorEstimate(i);
+            }
         }
     }
     /* Allow for maximum of 6 consecutive 10 second intervals of missing sensor data
-    on any of the sensors before quitting screaming... */
-    for (i=1;i<=TOTALSENSORS;i++) {
-        if (sensor_read_errors[i]>5) {
-            /* log the errors, clean up and bail out */
-            log_message(LOG_FILE, "ALARM: Too many sensor read errors! Stopping.");
-            if ( ! DisableGPIOpins() ) {
-                log_message(LOG_FILE, "ALARM: GPIO disable failed on handling sensor read failures.");
-                exit(66);
+    on any of the sensors before giving up on it: a safety-critical sensor stops everything,
+    any other one gets replaced by its estimate and the controller runs degraded */
+    for (i=1;i<=MAXSENSORS;i++) {
+        if (!SensorInUse(i)) continue;
+        if ((sensor_read_errors[i]>5) && !(sensors_failed & (1<<i))) {
+            if (sensor_fallback[i] == FALLBACK_NONE) {
+                sprintf( msg, "ALARM: Too many read errors on safety-critical sensor '%s'! Stopping.", sensor_names[i] );
+                log_message(LOG_FILE, msg);
+                return 0;
             }
-            exit(55);
+            sensors_failed |= (1<<i);
+            sprintf( msg, "ALARM: Sensor '%s' failed! Running DEGRADED, using %s instead.", sensor_names[i],
+                     fallback_names[sensor_fallback[i]] );
+            log_message(LOG_FILE, msg);
+            sensors[i] = SensorEstimate(i);
         }
     }
+    return 1;
 }
 
 /* Read cfg.bat_powered_pin into CPowerByBattery which should be 
@@ -1194,10 +2788,323 @@ ReadExternalPower() {
     CPowerByBattery = GPIORead(cfg.bat_powered_pin);
 }
 
+/* HEAT PUMP LINK: instead of the 4 COMMs pins, hwwm can talk to hpm over a serial line
+   or a unix/tcp socket (hp_link). Messages are NMEA-like text frames:
+     $<talker>,<seq>,<type>[,<field>...]*<XX>\r\n
+   XX being the hex XOR of all chars between '$' and '*'. hwwm sends
+     $HWWM,<seq>,REQ,<bits>             stage request - what sendBits holds
+   when it changes, again every cycle until hpm answers with
+     $HPM,<seq>,ACK,<request seq>
+   and once every HPLINK_REFRESH_S anyway, so hpm knows hwwm is alive. hpm sends
+     $HPM,<seq>,ST,<comms>,<compressor>,<power W>
+   on every change and at least every 30 seconds; <comms> is what the COMMs input pins
+   would read. A link without a good ST for HPLINK_STALE_S reads as COMMS 0, and a lost
+   connection is retried every cycle */
+#define HPLINK_STALE_S      60
+#define HPLINK_REFRESH_S    60
+#define HPLINK_FRAME_MAX    82
+
+HWWM_TLS int hp_fd = -1;
+HWWM_TLS short hp_connecting = 0;
+HWWM_TLS char hp_spec[MAXLEN];           /* hp_link the open link was made for */
+HWWM_TLS char hp_rx[2*HPLINK_FRAME_MAX];
+HWWM_TLS short hp_rx_len = 0;
+HWWM_TLS char hp_tx[HPLINK_FRAME_MAX+8];  /* the rest of a frame the link did not take in at once */
+HWWM_TLS short hp_tx_len = 0;
+HWWM_TLS short hp_sock = 0;              /* the link is a socket, not a tty */
+HWWM_TLS unsigned long hp_seq = 0;       /* of the last request */
+HWWM_TLS short hp_req_bits = -1;         /* sent last, -1 if nothing yet on this link */
+HWWM_TLS short hp_acked = 0;
+HWWM_TLS short hp_ack_logged = 0;
+HWWM_TLS struct timespec hp_opened, hp_req_sent, hp_req_first, hp_heard;
+HWWM_TLS short hp_heard_any = 0;
+HWWM_TLS short hp_up = 0;                /* an ST frame came within HPLINK_STALE_S */
+HWWM_TLS unsigned short hp_comms = 0;
+HWWM_TLS int hp_compressor = 0;
+HWWM_TLS int hp_power = 0;
+HWWM_TLS long hp_ack_ms = -1;
+HWWM_TLS unsigned long hp_bad_frames = 0;
+HWWM_TLS short hp_fail_logged = 0;
+HWWM_TLS short hp_pins_cleared = 0;      /* the COMMs outputs were put to 0 for the link */
+
+short
+HPLinkUsed() {
+    return strcmp( cfg.hp_link, "gpio" ) != 0;
+}
+
+void
+HPLinkClose() {
+    if (hp_fd < 0) return;
+    UnwatchFd( hp_fd );
+    close( hp_fd );
+    hp_fd = -1;
+    hp_connecting = 0;
+    hp_rx_len = 0;
+    hp_tx_len = 0;
+    hp_req_bits = -1;
+}
+
+unsigned char
+HPLinkChecksum(const char *s, size_t n) {
+    unsigned char cs = 0;
+    while (n--) cs ^= (unsigned char)*s++;
+    return cs;
+}
+
+/* send what is in hp_tx; a socket hpm closed must not raise SIGPIPE */
+short
+HPLinkFlush() {
+    char msg[100];
+    ssize_t n;
+
+    if (!hp_tx_len) return 1;
+    if (hp_sock) n = send( hp_fd, hp_tx, hp_tx_len, MSG_DONTWAIT|MSG_NOSIGNAL );
+    else n = write( hp_fd, hp_tx, hp_tx_len );
+    if (n > 0) {
+        hp_tx_len -= n;
+        memmove( hp_tx, hp_tx + n, hp_tx_len );
+    }
+    else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        sprintf( msg, "WARNING: Heat pump link lost (%s)", strerror(errno) );
+        log_message(LOG_FILE, msg);
+        HPLinkClose();
+        return 0;
+    }
+    return (hp_tx_len == 0);
+}
+
+void
+HPLinkSend(const char *type, long arg) {
+    char body[HPLINK_FRAME_MAX];
+
+    /* a frame goes out whole - only after the rest of the one before it;
+       one that cannot go now is sent again next cycle */
+    if (!HPLinkFlush()) return;
+    snprintf( body, sizeof body, "HWWM,%lu,%s,%ld", hp_seq, type, arg );
+    hp_tx_len = snprintf( hp_tx, sizeof hp_tx, "$%s*%02X\r\n", body, HPLinkChecksum( body, strlen(body) ) );
+    HPLinkFlush();
+}
+
+/* check and apply one frame, leading '$' and trailing CR LF already off */
+void
+HPLinkFrame(char *f) {
+    char *star = strrchr( f, '*' );
+    unsigned long seq, ack;
+    unsigned short comms;
+    int compressor, power;
+
+    if (!star || (strlen(star) != 3) ||
+        (strtoul( star+1, NULL, 16 ) != HPLinkChecksum( f, star - f ))) {
+        hp_bad_frames++;
+        return;
+    }
+    *star = 0;
+    if (sscanf( f, "HPM,%lu,ACK,%lu", &seq, &ack ) == 2) {
+        if ((ack == hp_seq) && !hp_acked) {
+            hp_acked = 1;
+            hp_ack_logged = 0;
+            hp_ack_ms = ms_since( &hp_req_sent );
+        }
+    }
+    else if (sscanf( f, "HPM,%lu,ST,%hu,%d,%d", &seq, &comms, &compressor, &power ) == 4) {
+        hp_comms = comms & 3;
+        hp_compressor = compressor;
+        hp_power = power;
+        clock_gettime( CLOCK_MONOTONIC, &hp_heard );
+        hp_heard_any = 1;
+    }
+    /* a well formed frame of a type we do not know yet is left alone */
+}
+
+/* read what came over the link and take the frames out of it */
+void
+HPLinkRecv(int fd) {
+    char *start, *end;
+    ssize_t n;
+
+    while ((n = read( fd, hp_rx + hp_rx_len, sizeof hp_rx - 1 - hp_rx_len )) > 0) {
+        /* a NUL would cut the text short for strchr - the frame it is in is a bad one */
+        for (char *c=hp_rx+hp_rx_len;c<hp_rx+hp_rx_len+n;c++) if (!*c) *c = '?';
+        hp_rx_len += n;
+        hp_rx[hp_rx_len] = 0;
+        start = hp_rx;
+        while ((end = strchr( start, '\n' ))) {
+            *end = 0;
+            if ((end > start) && (end[-1] == '\r')) end[-1] = 0;
+            /* anything before the '$' is line noise */
+            start = strchr( start, '$' );
+            if (start) HPLinkFrame( start + 1 );
+            start = end + 1;
+        }
+        hp_rx_len -= start - hp_rx;
+        memmove( hp_rx, start, hp_rx_len );
+        /* no end of frame in sight - drop the garbage */
+        if (hp_rx_len >= (short)sizeof hp_rx - 1) {
+            hp_bad_frames++;
+            hp_rx_len = 0;
+        }
+    }
+    if ((n == 0) || (errno != EAGAIN)) {
+        log_message(LOG_FILE, "WARNING: Heat pump link closed by the other side.");
+        HPLinkClose();
+    }
+}
+
+speed_t
+HPLinkBaud(long baud) {
+    switch (baud) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default: return B9600;
+    }
+}
+
+/* open the link hp_link asks for: /dev/tty...[@baud], unix:/path or tcp:ip:port */
+short
+HPLinkOpen() {
+    char spec[MAXLEN], *at;
+    struct termios tio;
+    struct sockaddr_un sa_un;
+    struct sockaddr_in sin;
+
+    strcpy( spec, cfg.hp_link );
+    strcpy( hp_spec, cfg.hp_link );
+    hp_sock = (strncmp( spec, "unix:", 5 ) == 0) || (strncmp( spec, "tcp:", 4 ) == 0);
+    if (strncmp( spec, "unix:", 5 ) == 0) {
+        memset( &sa_un, 0, sizeof sa_un );
+        sa_un.sun_family = AF_UNIX;
+        strncpy( sa_un.sun_path, spec+5, sizeof sa_un.sun_path - 1 );
+        hp_fd = socket( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+        if (hp_fd < 0) return 0;
+        if (connect( hp_fd, (struct sockaddr *)&sa_un, sizeof sa_un )) goto fail;
+    }
+    else if (strncmp( spec, "tcp:", 4 ) == 0) {
+        at = strrchr( spec+4, ':' );
+        if (!at) { errno = EINVAL; return 0; }
+        *at = 0;
+        memset( &sin, 0, sizeof sin );
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons( atoi(at+1) );
+        /* only an address - a name lookup could hold up the cycle */
+        if (!inet_aton( spec+4, &sin.sin_addr )) { errno = EINVAL; return 0; }
+        hp_fd = socket( AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+        if (hp_fd < 0) return 0;
+        if (connect( hp_fd, (struct sockaddr *)&sin, sizeof sin )) {
+            if (errno != EINPROGRESS) goto fail;
+            /* HPLinkUpdate() picks it up once connected */
+            hp_connecting = 1;
+        }
+    }
+    else {
+        at = strchr( spec, '@' );
+        if (at) *at = 0;
+        hp_fd = open( spec, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC );
+        if (hp_fd < 0) return 0;
+        if (tcgetattr( hp_fd, &tio )) goto fail;
+        cfmakeraw( &tio );
+        tio.c_cflag |= CLOCAL|CREAD;
+        cfsetispeed( &tio, HPLinkBaud( at ? atol(at+1) : 9600 ) );
+        cfsetospeed( &tio, HPLinkBaud( at ? atol(at+1) : 9600 ) );
+        if (tcsetattr( hp_fd, TCSANOW, &tio )) goto fail;
+        tcflush( hp_fd, TCIOFLUSH );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &hp_opened );
+    if (!hp_connecting) WatchFd( hp_fd, HPLinkRecv );
+    return 1;
+
+fail:
+    {
+        int e = errno;
+        close( hp_fd );
+        hp_fd = -1;
+        errno = e;
+    }
+    return 0;
+}
+
+/* keep the link up and tell if hpm is still heard; once per cycle */
+void
+HPLinkUpdate() {
+    char msg[200];
+    struct pollfd pfd;
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    /* hp_link changed by a config re-read */
+    if ((hp_fd >= 0) && strcmp( hp_spec, cfg.hp_link )) {
+        HPLinkClose();
+        hp_fail_logged = 0;
+    }
+    if (hp_fd < 0) {
+        if (HPLinkOpen()) {
+            sprintf( msg, "INFO: Heat pump link open on %s", cfg.hp_link );
+            log_message(LOG_FILE, msg);
+            hp_fail_logged = 0;
+        }
+        else if (!hp_fail_logged) {
+            sprintf( msg, "WARNING: Cannot open heat pump link %s (%s) - retrying every cycle", cfg.hp_link, strerror(errno) );
+            log_message(LOG_FILE, msg);
+            hp_fail_logged = 1;
+        }
+    }
+    if (hp_connecting) {
+        pfd.fd = hp_fd;
+        pfd.events = POLLOUT;
+        if (poll( &pfd, 1, 0 ) > 0) {
+            getsockopt( hp_fd, SOL_SOCKET, SO_ERROR, &err, &len );
+            if (err) {
+                HPLinkClose();
+            }
+            else {
+                hp_connecting = 0;
+                WatchFd( hp_fd, HPLinkRecv );
+            }
+        }
+        else if (ms_since( &hp_opened ) > 10000) HPLinkClose();
+    }
+    if (hp_heard_any && (ms_since( &hp_heard ) <= HPLINK_STALE_S*1000L)) {
+        if (!hp_up) log_message(LOG_FILE, "INFO: Heat pump manager heard over the link.");
+        hp_up = 1;
+    }
+    else {
+        if (hp_up) log_message(LOG_FILE, "WARNING: Heat pump manager not heard over the link - reading COMMS as 0.");
+        hp_up = 0;
+    }
+}
+
+/* send the stage request in sendBits, if not acked yet or due for a refresh */
+void
+HPLinkRequest() {
+    if ((hp_fd < 0) || hp_connecting) return;
+    if ((sendBits != hp_req_bits) || (hp_acked && (ms_since( &hp_req_sent ) >= HPLINK_REFRESH_S*1000L))) {
+        hp_seq++;
+        hp_req_bits = sendBits;
+        hp_acked = 0;
+        clock_gettime( CLOCK_MONOTONIC, &hp_req_first );
+    }
+    else if (hp_acked) return;
+    else if (!hp_ack_logged && (ms_since( &hp_req_first ) > 25000)) {
+        log_message(LOG_FILE, "WARNING: Heat pump manager does not ack stage requests.");
+        hp_ack_logged = 1;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &hp_req_sent );
+    HPLinkSend( "REQ", hp_req_bits );
+}
+
 /* Read comms and assemble the global byte COMMS */
 void
 ReadCommsPins() {
     unsigned short temp = 0;
+    if (HPLinkUsed()) {
+        HPLinkUpdate();
+        COMMS = hp_up ? hp_comms : 0;
+        return;
+    }
     COMMS = 0;
     temp = GPIORead(cfg.commspin3_pin);
     if (temp) COMMS |= 1;
@@ -1206,9 +3113,9 @@ ReadCommsPins() {
     if (temp) COMMS |= 2;
 }
 
-/* Write comms  */
+/* work out what to tell hpm */
 void
-WriteCommsPins() {
+ComputeSendBits() {
     sendBits = 0;
     /* if runnning on battery power - sendBits=3 */
     if (CPowerByBattery) {
@@ -1224,6 +3131,22 @@ WriteCommsPins() {
             if (CHP_high) sendBits = 2;
         }
     }
+}
+
+/* Write comms  */
+void
+WriteCommsPins() {
+    if (HPLinkUsed()) {
+        /* a heat pump still wired to the pins must not be left with the last request */
+        if (!hp_pins_cleared) {
+            GPIOWrite( cfg.commspin1_pin, 0 );
+            GPIOWrite( cfg.commspin2_pin, 0 );
+            hp_pins_cleared = 1;
+        }
+        HPLinkRequest();
+        return;
+    }
+    hp_pins_cleared = 0;
     GPIOWrite( cfg.commspin1_pin,  (sendBits&1) );
     GPIOWrite( cfg.commspin2_pin,  (sendBits&2) );
 }
@@ -1232,17 +3155,149 @@ WriteCommsPins() {
 void
 ControlStateToGPIO() {
     /* put state on GPIO pins */
-    if (cfg.invert_output) {
-            GPIOWrite( cfg.pump1_pin, !CPump1 );
-            GPIOWrite( cfg.pump2_pin, !CPump2 );
-            GPIOWrite( cfg.valve1_pin, !CValve );
-            GPIOWrite( cfg.el_heater_pin,  !CHeater );
+    for (short i=0;i<devices_count;i++) {
+        struct device *d = &devices[i];
+        if (d->pin < 0) continue;
+        if (d->invert) GPIOWrite( d->pin, !controls[d->ctrl] );
+        else GPIOWrite( d->pin, controls[d->ctrl] );
     }
-    else {
-            GPIOWrite( cfg.pump1_pin, CPump1 );
-            GPIOWrite( cfg.pump2_pin, CPump2 );
-            GPIOWrite( cfg.valve1_pin, CValve );
-            GPIOWrite( cfg.el_heater_pin,  CHeater );
+}
+
+/* WATCHDOG: after every complete control cycle that met CYCLE_DEADLINE_MS hwwm sends a
+   keepalive to the systemd notify socket (WATCHDOG=1) and/or to /dev/watchdog. Both get a
+   timeout that lets cfg.watchdog_tolerance cycles go missing. Before that timeout runs
+   out, StallGuard() - a thread of its own - puts all relays to OFF, so they fail safe
+   even if the main loop hangs in some I/O for good; the next cycle on time brings them
+   back. The watchdog settings are only taken at start-up */
+#define CYCLE_DEADLINE_MS       9000
+
+HWWM_TLS int wd_fd = -1;
+HWWM_TLS int wd_sock = -1;
+HWWM_TLS struct sockaddr_un wd_addr;
+HWWM_TLS socklen_t wd_addr_len;
+/* CLOCK_MONOTONIC time of last keepalive, and are the relays held OFF by StallGuard() */
+HWWM_TLS struct timespec wd_last_kick;
+HWWM_TLS pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+HWWM_TLS short wd_relays_off = 0;
+HWWM_TLS unsigned long wd_late_cycles = 0;
+
+/* seconds without a keepalive before StallGuard() steps in; the watchdogs fire 10 later */
+int
+WatchdogLimit() {
+    return (cfg.watchdog_tolerance + 1) * 10;
+}
+
+/* send a state string to the systemd notify socket */
+void
+WatchdogNotify(const char *state) {
+    if (wd_sock < 0) return;
+    sendto( wd_sock, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&wd_addr, wd_addr_len );
+}
+
+/* put all relays to OFF, the way a board reset would leave them */
+void
+RelaysOff() {
+    for (short i=0;i<devices_count;i++) {
+        if (devices[i].pin >= 0) GPIOWrite( devices[i].pin, devices[i].invert ? 1 : 0 );
+    }
+}
+
+void *
+StallGuard(void *arg) {
+    char msg[120];
+    short stalled;
+
+    while (1) {
+        sleep(1);
+        pthread_mutex_lock( &wd_lock );
+        stalled = !wd_relays_off && (ms_since(&wd_last_kick) > WatchdogLimit()*1000L);
+        if (stalled) wd_relays_off = 1;
+        pthread_mutex_unlock( &wd_lock );
+        if (stalled) {
+            sprintf( msg, "ALARM: Control loop stalled for over %d seconds! Putting all relays OFF.", WatchdogLimit() );
+            log_message(LOG_FILE, msg);
+            RelaysOff();
+        }
+    }
+    return NULL;
+}
+
+/* set up the configured watchdogs; return 0 on error */
+short
+WatchdogStart() {
+    const char *ns = getenv("NOTIFY_SOCKET");
+    char msg[120];
+    int timeout = WatchdogLimit() + 10;
+    pthread_t guard;
+
+    clock_gettime( CLOCK_MONOTONIC, &wd_last_kick );
+    if (cfg.watchdog_systemd) {
+        if ((ns == NULL) || ((ns[0] != '/') && (ns[0] != '@')) || (strlen(ns) >= sizeof wd_addr.sun_path)) {
+            log_message(LOG_FILE, "WARNING: watchdog_systemd is set, but hwwm was not started with a usable NOTIFY_SOCKET.");
+        }
+        else {
+            memset( &wd_addr, 0, sizeof wd_addr );
+            wd_addr.sun_family = AF_UNIX;
+            strcpy( wd_addr.sun_path, ns );
+            /* '@' stands for the abstract namespace */
+            if (ns[0] == '@') wd_addr.sun_path[0] = 0;
+            wd_addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(ns);
+            wd_sock = socket( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+            if (wd_sock < 0) return 0;
+            sprintf( msg, "READY=1\nWATCHDOG_USEC=%lu", timeout * 1000000UL );
+            WatchdogNotify( msg );
+        }
+    }
+    if (cfg.watchdog_device) {
+        wd_fd = open( WATCHDOG_DEVICE, O_WRONLY | O_CLOEXEC );
+        if (wd_fd < 0) return 0;
+        if (ioctl( wd_fd, WDIOC_SETTIMEOUT, &timeout )) {
+            log_message(LOG_FILE, "WARNING: Could not set "WATCHDOG_DEVICE" timeout - using its default.");
+        }
+    }
+    if ((wd_sock >= 0) || (wd_fd >= 0)) {
+        if (pthread_create( &guard, NULL, StallGuard, NULL )) return 0;
+        sprintf( msg, "INFO: Watchdog active: relays go OFF after %d seconds of stall, watchdog timeout %d seconds.",
+                 WatchdogLimit(), timeout );
+        log_message(LOG_FILE, msg);
+    }
+    return -1;
+}
+
+/* end of a control cycle: keepalive, but only if the cycle was on time */
+void
+WatchdogKick(long cycle_ms) {
+    char msg[120];
+    short back;
+
+    if ((wd_sock < 0) && (wd_fd < 0)) return;
+    if (cycle_ms > CYCLE_DEADLINE_MS) {
+        wd_late_cycles++;
+        sprintf( msg, "WARNING: Control cycle took %ld ms - no watchdog keepalive this time.", cycle_ms );
+        log_message(LOG_FILE, msg);
+        return;
+    }
+    WatchdogNotify( "WATCHDOG=1" );
+    if (wd_fd >= 0) write( wd_fd, "k", 1 );
+    pthread_mutex_lock( &wd_lock );
+    clock_gettime( CLOCK_MONOTONIC, &wd_last_kick );
+    back = wd_relays_off;
+    wd_relays_off = 0;
+    pthread_mutex_unlock( &wd_lock );
+    if (back) {
+        log_message(LOG_FILE, "INFO: Control loop is back on time. Relays follow it again.");
+        ControlStateToGPIO();
+    }
+}
+
+/* on exit: tell systemd, and disarm /dev/watchdog with the magic close */
+void
+WatchdogStop() {
+    WatchdogNotify( "STOPPING=1" );
+    if (wd_fd >= 0) {
+        write( wd_fd, "V", 1 );
+        close( wd_fd );
+        wd_fd = -1;
     }
 }
 
@@ -1255,6 +3310,7 @@ write_log_start() {
     log_message(LOG_FILE,"PID written to "LOCK_FILE", writing CSV data to "DATA_FILE );
     log_message(LOG_FILE,"Writing table data for collectd to "TABLE_FILE );
     log_message(LOG_FILE,"Persistent data file "PERSISTENCE_FILE );
+    log_message(LOG_FILE,"Thermal model file "MODEL_FILE );
     sprintf( start_log_text, "Powers: heater=%3.1f W, pump1=%3.1f W, pump2=%3.1f W",
     HEATERPPC*(6*60), PUMP1PPC*(6*60), PUMP2PPC*(6*60) );
     log_message(LOG_FILE, start_log_text );
@@ -1269,7 +3325,7 @@ without the need for root access (necessary to read /etc/hwwm.cfg), so relevant
 This function should be called less often, e.g. once every 5 minutes or something... */
 void
 ReWrite_CFG_TABLE_FILE() {
-    static char data[280];
+    static HWWM_TLS char data[280];
     /* Log data like so:
     Time(by log function),mode,wanted_T,use_electric_heater_night,use_electric_heater_day,
 	pump1_always_on,use_pump1,use_pump2,day_to_reset_Pcounters,night_boost,abs_max;
@@ -1286,271 +3342,3303 @@ ReWrite_CFG_TABLE_FILE() {
 /* function to calculate average temp of environment based on last minute or so data */
 void 
 CalcTenvAverage() {
-    float na = 0;
     /* do index moving first */
     TenvArr_lu++;
     if (TenvArr_lu > 11) { /* if index is beyond array end - move it to first element */
         TenvArr_lu = 0;
     }
-    /* then replace oldest value in array with last read one */
+    /* keep the -200 of a sensor that was never read out of the average */
+    if (Tenv == -200) return;
+    /* while starting up TenvArr gets re-filled by ReadSensors() - re-sum it then */
+    if (just_started) {
+        TenvSum = 0;
+        for (short k=0;k<12;k++) TenvSum += TenvArr[k];
+    }
+    /* then replace oldest value in array with last read one, keeping the sum current */
+    TenvSum += Tenv - TenvArr[TenvArr_lu];
     TenvArr[TenvArr_lu] = Tenv;
     /* and finaly - calculate new average */
-    for (short k=0;k<12;k++) {
-        na = na + TenvArr[k];
-    }
-    TenvAvrg = na / 12.0;
+    TenvAvrg = TenvSum / 12.0;
 }
 
-/* Function to get current time and put the hour in current_timer_hour */
+/* slide window w over the raw ring: y_new enters, the sample w->len positions back leaves;
+   all x positions shift down by one, so sxy loses the sum of the samples that stay */
 void
-GetCurrentTime() {
-    static char buff[80];
-    time_t t;
-    struct tm *t_struct;
-    short adjusted = 0;
-    short must_check = 0;
-    unsigned short current_day_of_month = 0;
-    static char data[280];
-	
-	ReWrite_CFG_TABLE_FILE();
+HistWindowPush(struct hist_window *w, const float *raw, float y_new) {
+    float y_old = 0;
+    if (hist_count >= w->len) {
+        short k = hist_pos - w->len;
+        if (k < 0) k += HIST_RAW_LEN;
+        y_old = raw[k];
+    }
+    w->sxy = w->sxy - (w->sy - y_old) + (w->len - 1) * (double)y_new;
+    w->sy = w->sy - y_old + y_new;
+}
 
-    t = time(NULL);
-    t_struct = localtime( &t );
+/* least-squares slope of a full window in degrees C per minute; 0 until window is full */
+float
+HistWindowSlope(const struct hist_window *w) {
+    double n = w->len;
+    double sx = n*(n-1)/2;
+    double sxx = (n-1)*n*(2*n-1)/6;
+    if (hist_count < w->len) return 0;
+    return (float)(((n*w->sxy - sx*w->sy) / (n*sxx - sx*sx)) * 6);
+}
 
-    /* get current hour */
-    strftime( buff, sizeof buff, "%H", t_struct );
-    current_timer_hour = atoi( buff );
-    
-    if ((current_timer_hour == 8) && ((ProgramRunCycles % (6*60)) == 0)) must_check = 1;
+void
+HistAggAdd(struct hist_agg *a, float v, short first) {
+    if (first || (v < a->min)) a->min = v;
+    if (first || (v > a->max)) a->max = v;
+    a->avg = first ? v : (a->avg + v);
+}
 
-    /* adjust night tariff start and stop hours at program start and
-    every day sometime between 8:00 and 9:00 */
-    if (( just_started ) || ( must_check )) {
-        strftime( buff, sizeof buff, "%m", t_struct );
-        current_month = atoi( buff );
-        if ((current_month >= 4)&&(current_month <= 10)) {
-            /* April through October - use NE from 23:00 till 6:59 */
-            if (NEstart != 23) {
-                adjusted = 1;
-                NEstart = 23;
-                NEstop  = 6;
-            }
+/* push this cycle's sensors[] into the history ring and update all statistics */
+void
+HistPush() {
+    short i;
+    float v;
+    short new_minute = ((hist_count % 6) == 0);
+    short new_hour = ((hist_count % (6*60)) == 0);
+
+    hist_pos++;
+    if (hist_pos >= HIST_RAW_LEN) hist_pos = 0;
+    for (i=1;i<=TOTALSENSORS;i++) {
+        struct sensor_history *h = &hist[i];
+        v = sensors[i];
+        if (hist_count == 0) {
+            h->wshort.len = HIST_SHORT;
+            h->wlong.len = HIST_LONG;
+            h->ewma = v;
         }
-        else {
-            /* November through March - use NE from 22:00 till 5:59 */
-            if (NEstart != 22) {
-                adjusted = 1;
-                NEstart = 22;
-                NEstop  = 5;
-            }
+        HistWindowPush(&h->wshort, h->raw, v);
+        HistWindowPush(&h->wlong, h->raw, v);
+        if (hist_count >= HIST_RAW_LEN) h->sum -= h->raw[hist_pos];
+        h->sum += v;
+        h->raw[hist_pos] = v;
+        h->ewma += HIST_EWMA_ALPHA * (v - h->ewma);
+        HistAggAdd(&h->cur_min, v, new_minute);
+        HistAggAdd(&h->cur_hour, v, new_hour);
+    }
+    hist_count++;
+    /* roll up completed minute and hour */
+    if ((hist_count % 6) == 0) {
+        for (i=1;i<=TOTALSENSORS;i++) {
+            struct hist_agg *a = &hist[i].minute[hist_minutes % HIST_MIN_LEN];
+            *a = hist[i].cur_min;
+            a->avg /= 6;
+        }
+        hist_minutes++;
+    }
+    if ((hist_count % (6*60)) == 0) {
+        for (i=1;i<=TOTALSENSORS;i++) {
+            struct hist_agg *a = &hist[i].hour[hist_hours % HIST_HOUR_LEN];
+            *a = hist[i].cur_hour;
+            a->avg /= 6*60;
         }
-        if (adjusted) {
-            sprintf( buff, "INFO: Adjusted night energy hours, start %.2hu:00,"\
-            " stop %.2hu:59.", NEstart, NEstop );
-            log_message(LOG_FILE, buff);
+        hist_hours++;
+    }
+}
+
+/* trend rate of sensor in degrees C per minute, over the short (1 min) or long (10 min) window */
+float
+HistRate(short sensor, short long_window) {
+    return HistWindowSlope(long_window ? &hist[sensor].wlong : &hist[sensor].wshort);
+}
+
+/* mean of sensor over the samples kept - up to 24 hours */
+float
+HistMean(short sensor) {
+    unsigned long n = (hist_count < HIST_RAW_LEN) ? hist_count : HIST_RAW_LEN;
+    if (!n) return sensors[sensor];
+    return (float)(hist[sensor].sum / n);
+}
+
+void
+ModelReset(struct rls_model *m) {
+    memset(m->theta, 0, sizeof m->theta);
+    memset(m->P, 0, sizeof m->P);
+    for (short i=0;i<MODEL_PARAMS;i++) {
+        m->P[i][i] = MODEL_P0;
+        m->excited[i] = 0;
+    }
+    m->var = 1;
+    m->updates = 0;
+}
+
+/* one RLS step: fit y = phi . theta */
+void
+ModelRLS(struct rls_model *m, const double *phi, double y) {
+    double Pphi[MODEL_PARAMS], k[MODEL_PARAMS];
+    double denom = MODEL_LAMBDA, e = y;
+    short i, j;
+
+    for (i=0;i<MODEL_PARAMS;i++) {
+        Pphi[i] = 0;
+        for (j=0;j<MODEL_PARAMS;j++) Pphi[i] += m->P[i][j] * phi[j];
+        denom += phi[i] * Pphi[i];
+        e -= phi[i] * m->theta[i];
+    }
+    for (i=0;i<MODEL_PARAMS;i++) {
+        k[i] = Pphi[i] / denom;
+        m->theta[i] += k[i] * e;
+    }
+    /* P = (P - k * phi' * P) / lambda; P stays symmetric so phi' * P == Pphi' */
+    for (i=0;i<MODEL_PARAMS;i++) {
+        for (j=0;j<MODEL_PARAMS;j++) {
+            m->P[i][j] = (m->P[i][j] - k[i] * Pphi[j]) / MODEL_LAMBDA;
+        }
+        if (m->P[i][i] > MODEL_PMAX) m->P[i][i] = MODEL_PMAX;
+        if (phi[i] != 0) m->excited[i]++;
+    }
+    m->var += 0.02 * (e*e - m->var);
+    m->updates++;
+}
+
+/* confidence in a model parameter, 0..100: zero until it has been excited for a while,
+   then based on its standard deviation relative to its value */
+short
+ModelConfidence(const struct rls_model *m, short i) {
+    double sd, c;
+    if (m->excited[i] < MODEL_MIN_EXCITED) return 0;
+    sd = sqrt(m->P[i][i] * m->var);
+    if (m->theta[i] == 0) return 0;
+    c = 100 * (1 - sd / fabs(m->theta[i]));
+    if (c < 0) c = 0;
+    return (short)c;
+}
+
+/* collect controls state each cycle and do a model update once a minute */
+void
+ModelUpdate() {
+    unsigned char bits = 0, old;
+    double phi[MODEL_PARAMS], y, t;
+    short i;
+
+    /* controls[] still hold the state that drove the temps seen this cycle */
+    if (CPump2) bits |= 2;
+    if (CValve) bits |= 4;
+    if (CHeater) bits |= 8;
+    if (CHP_low) bits |= 32;
+    if (CHP_high) bits |= 64;
+    old = model_ctrl_ring[model_ctrl_pos];
+    model_ctrl_ring[model_ctrl_pos] = bits;
+    if (++model_ctrl_pos >= HIST_LONG) model_ctrl_pos = 0;
+    for (i=0;i<7;i++) {
+        if (old & (2<<i)) model_ctrl_count[i]--;
+        if (bits & (2<<i)) model_ctrl_count[i]++;
+    }
+    if ((hist_count < HIST_LONG) || (hist_count % 6)) return;
+
+    /* BOILER: hot water being drawn drops the tank faster than any loss - skip those minutes */
+    y = 60 * (HistRate(3, 1) + HistRate(4, 1)) / 2;
+    t = (hist[3].wlong.sy + hist[4].wlong.sy) / (2 * HIST_LONG);
+    if ((y > -6) && !(sensors_failed & (S_BOILERH|S_BOILERL))) {
+        phi[0] = -(t - BOILER_ROOM_T);
+        phi[1] = (double)model_ctrl_count[2] / HIST_LONG;
+        phi[2] = (double)model_ctrl_count[1] / HIST_LONG;
+        phi[3] = (double)model_ctrl_count[0] / HIST_LONG;
+        ModelRLS(&boiler_model, phi, y);
+    }
+    /* FURNACE: a fire in the furnace is a heat source the model knows nothing about */
+    y = 60 * HistRate(1, 1);
+    t = hist[1].wlong.sy / HIST_LONG;
+    if (t < 38) {
+        phi[0] = -(t - TenvAvrg);
+        phi[1] = (double)model_ctrl_count[4] / HIST_LONG;
+        phi[2] = (double)model_ctrl_count[5] / HIST_LONG;
+        phi[3] = (double)model_ctrl_count[1] / HIST_LONG;
+        ModelRLS(&furnace_model, phi, y);
+    }
+}
+
+void
+WriteModelOne(FILE *fp, const struct rls_model *m) {
+    short i, j;
+    fprintf( fp, "%s_theta=", m->name );
+    for (i=0;i<MODEL_PARAMS;i++) fprintf( fp, "%s%.6g", i ? " " : "", m->theta[i] );
+    fprintf( fp, "\n%s_P=", m->name );
+    for (i=0;i<MODEL_PARAMS;i++) for (j=0;j<MODEL_PARAMS;j++) fprintf( fp, "%s%.6g", (i||j) ? " " : "", m->P[i][j] );
+    fprintf( fp, "\n%s_excited=", m->name );
+    for (i=0;i<MODEL_PARAMS;i++) fprintf( fp, "%s%lu", i ? " " : "", m->excited[i] );
+    fprintf( fp, "\n%s_var=%.6g\n%s_updates=%lu\n", m->name, m->var, m->name, m->updates );
+}
+
+void
+WriteModelData() {
+    FILE *fp;
+    char timestamp[30];
+    time_t t;
+
+    t = time(NULL);
+    strftime( timestamp, sizeof timestamp, "%F %T", localtime( &t ) );
+    fp = fopen( MODEL_FILE, "w" );
+    if ( !fp ) return;
+    fprintf( fp, "# hwwm thermal model file written @ %s\n", timestamp );
+    WriteModelOne( fp, &boiler_model );
+    WriteModelOne( fp, &furnace_model );
+    fclose( fp );
+}
+
+/* read space separated numbers from value into array; return count read */
+short
+ParseNumbers(char *value, double *arr, short max) {
+    char *e;
+    short n = 0;
+    while (n < max) {
+        arr[n] = strtod(value, &e);
+        if (e == value) break;
+        value = e;
+        n++;
+    }
+    return n;
+}
+
+void
+ReadModelData() {
+    char *s, buff[600], name[MAXLEN], *value;
+    double arr[MODEL_PARAMS*MODEL_PARAMS];
+    struct rls_model *m;
+    short i, n;
+    FILE *fp;
+
+    ModelReset(&boiler_model);
+    ModelReset(&furnace_model);
+    fp = fopen(MODEL_FILE, "r");
+    if (fp == NULL) {
+        log_message(LOG_FILE,"INFO: No "MODEL_FILE" file - thermal model starts from scratch.");
+        return;
+    }
+    while ((s = fgets (buff, sizeof buff, fp)) != NULL)
+    {
+        /* Skip blank lines and comments */
+        if (buff[0] == '\n' || buff[0] == '#')
+        continue;
+        /* Parse name/value pair from line */
+        s = strtok (buff, "=");
+        if (s==NULL) continue;
+        else strncpy (name, s, MAXLEN-1);
+        name[MAXLEN-1] = 0;
+        value = strtok (NULL, "=");
+        if (value==NULL) continue;
+        if (strncmp(name, "boiler_", 7)==0) { m = &boiler_model; s = name+7; }
+        else if (strncmp(name, "furnace_", 8)==0) { m = &furnace_model; s = name+8; }
+        else continue;
+        n = ParseNumbers(value, arr, MODEL_PARAMS*MODEL_PARAMS);
+        if ((strcmp(s, "theta")==0) && (n == MODEL_PARAMS))
+        for (i=0;i<n;i++) m->theta[i] = arr[i];
+        else if ((strcmp(s, "P")==0) && (n == MODEL_PARAMS*MODEL_PARAMS))
+        for (i=0;i<n;i++) m->P[i/MODEL_PARAMS][i%MODEL_PARAMS] = arr[i];
+        else if ((strcmp(s, "excited")==0) && (n == MODEL_PARAMS))
+        for (i=0;i<n;i++) m->excited[i] = (unsigned long)arr[i];
+        else if ((strcmp(s, "var")==0) && (n == 1))
+        m->var = arr[0];
+        else if ((strcmp(s, "updates")==0) && (n == 1))
+        m->updates = (unsigned long)arr[0];
+    }
+    fclose (fp);
+    sprintf( buff, "INFO: Read thermal model: boiler loss=%.4f/h, heater=%.2f, valve=%.2f, solar=%.2f C/h;"\
+    " furnace loss=%.4f/h, HPL=%.2f, HPH=%.2f, valve=%.2f C/h",
+    boiler_model.theta[0], boiler_model.theta[1], boiler_model.theta[2], boiler_model.theta[3],
+    furnace_model.theta[0], furnace_model.theta[1], furnace_model.theta[2], furnace_model.theta[3] );
+    log_message(LOG_FILE, buff);
+}
+
+/* CONTROLLER STATE: everything a restart would otherwise lose - controls[] with their
+   state cycles (the min on/off interlocks), the sensors and their error counters, TenvArr,
+   the power counters, the sensors history, the thermal model and the device stats - is copied each cycle into
+   STATE_FILE, a region mmap'd from tmpfs. The file holds two slots, written in turns; a slot
+   is valid when the sequence numbers before and after it match, so a crash mid-write still
+   leaves the other one good. On start-up the newest valid slot is restored if it is not
+   older than STATE_MAX_AGE, and hwwm resumes after a single cycle instead of warming up */
+#define STATE_MAGIC         "HWWMST01"
+/* bump when struct saved_state changes; its size is checked too */
+#define STATE_VERSION       5
+#define STATE_MAX_AGE       180
+
+/* RLS model, less the names */
+struct saved_model
+{
+    double  theta[MODEL_PARAMS];
+    double  P[MODEL_PARAMS][MODEL_PARAMS];
+    double  var;
+    unsigned long updates;
+    unsigned long excited[MODEL_PARAMS];
+};
+
+struct saved_state
+{
+    time_t  saved_at;
+    short   controls[TOTALCONTROLS];
+    unsigned long ctrlstatecycles[TOTALCONTROLS];
+    float   sensors[MAXSENSORS+1];
+    float   sensors_prv[MAXSENSORS+1];
+    unsigned short sensor_read_errors[MAXSENSORS+1];
+    unsigned short sensors_failed;
+    float   TenvArr[12];
+    unsigned short TenvArr_lu;
+    double  TenvSum;
+    float   TenvAvrg;
+    float   TotalPowerUsed;
+    float   NightlyPowerUsed;
+    float   PowerCost;
+    struct sensor_history hist[TOTALSENSORS+1];
+    unsigned long hist_count;
+    unsigned short hist_pos;
+    unsigned long hist_minutes;
+    unsigned long hist_hours;
+    struct saved_model boiler_model;
+    struct saved_model furnace_model;
+    unsigned char model_ctrl_ring[HIST_LONG];
+    unsigned short model_ctrl_count[8];
+    unsigned short model_ctrl_pos;
+    short   boost_was_on;
+    struct device_stats dev_stats[MAXDEVICES];
+    unsigned short stats_cycles[STATS_SLOTS];
+    unsigned long stats_slot;
+};
+
+struct state_slot
+{
+    volatile unsigned long seq_begin;
+    struct saved_state s;
+    volatile unsigned long seq_end;
+};
+
+struct state_file
+{
+    char    magic[8];
+    unsigned int version;
+    unsigned int size;
+    struct state_slot slot[2];
+};
+
+HWWM_TLS struct state_file *state_map = NULL;
+HWWM_TLS unsigned long state_seq = 0;
+
+void
+SaveModel(struct saved_model *d, const struct rls_model *m) {
+    memcpy( d->theta, m->theta, sizeof d->theta );
+    memcpy( d->P, m->P, sizeof d->P );
+    d->var = m->var;
+    d->updates = m->updates;
+    memcpy( d->excited, m->excited, sizeof d->excited );
+}
+
+void
+LoadModel(struct rls_model *m, const struct saved_model *d) {
+    memcpy( m->theta, d->theta, sizeof m->theta );
+    memcpy( m->P, d->P, sizeof m->P );
+    m->var = d->var;
+    m->updates = d->updates;
+    memcpy( m->excited, d->excited, sizeof m->excited );
+}
+
+/* copy the controller state out of / into a saved_state */
+void
+StateStore(struct saved_state *st) {
+    st->saved_at = cycle_time;
+    memcpy( st->controls, controls, sizeof controls );
+    memcpy( st->ctrlstatecycles, ctrlstatecycles, sizeof ctrlstatecycles );
+    memcpy( st->sensors, sensors, sizeof sensors );
+    memcpy( st->sensors_prv, sensors_prv, sizeof sensors_prv );
+    memcpy( st->sensor_read_errors, sensor_read_errors, sizeof sensor_read_errors );
+    st->sensors_failed = sensors_failed;
+    memcpy( st->TenvArr, TenvArr, sizeof TenvArr );
+    st->TenvArr_lu = TenvArr_lu;
+    st->TenvSum = TenvSum;
+    st->TenvAvrg = TenvAvrg;
+    st->TotalPowerUsed = TotalPowerUsed;
+    st->NightlyPowerUsed = NightlyPowerUsed;
+    st->PowerCost = PowerCost;
+    if (hist && (st->hist != hist)) memcpy( st->hist, hist, sizeof st->hist );
+    st->hist_count = hist_count;
+    st->hist_pos = hist_pos;
+    st->hist_minutes = hist_minutes;
+    st->hist_hours = hist_hours;
+    SaveModel( &st->boiler_model, &boiler_model );
+    SaveModel( &st->furnace_model, &furnace_model );
+    memcpy( st->model_ctrl_ring, model_ctrl_ring, sizeof model_ctrl_ring );
+    memcpy( st->model_ctrl_count, model_ctrl_count, sizeof model_ctrl_count );
+    memcpy( st->dev_stats, dev_stats, sizeof dev_stats );
+    memcpy( st->stats_cycles, stats_cycles, sizeof stats_cycles );
+    st->stats_slot = stats_slot;
+    st->model_ctrl_pos = model_ctrl_pos;
+    st->boost_was_on = boost_was_on;
+}
+
+void
+StateLoad(const struct saved_state *st) {
+    memcpy( controls, st->controls, sizeof controls );
+    memcpy( ctrlstatecycles, st->ctrlstatecycles, sizeof ctrlstatecycles );
+    memcpy( sensors, st->sensors, sizeof sensors );
+    memcpy( sensors_prv, st->sensors_prv, sizeof sensors_prv );
+    memcpy( sensor_read_errors, st->sensor_read_errors, sizeof sensor_read_errors );
+    sensors_failed = st->sensors_failed;
+    memcpy( TenvArr, st->TenvArr, sizeof TenvArr );
+    TenvArr_lu = st->TenvArr_lu;
+    TenvSum = st->TenvSum;
+    TenvAvrg = st->TenvAvrg;
+    TotalPowerUsed = st->TotalPowerUsed;
+    NightlyPowerUsed = st->NightlyPowerUsed;
+    PowerCost = st->PowerCost;
+    if (st->hist != hist) memcpy( hist, st->hist, sizeof st->hist );
+    hist_count = st->hist_count;
+    hist_pos = st->hist_pos;
+    hist_minutes = st->hist_minutes;
+    hist_hours = st->hist_hours;
+    LoadModel( &boiler_model, &st->boiler_model );
+    LoadModel( &furnace_model, &st->furnace_model );
+    memcpy( model_ctrl_ring, st->model_ctrl_ring, sizeof model_ctrl_ring );
+    memcpy( model_ctrl_count, st->model_ctrl_count, sizeof model_ctrl_count );
+    memcpy( dev_stats, st->dev_stats, sizeof dev_stats );
+    memcpy( stats_cycles, st->stats_cycles, sizeof stats_cycles );
+    stats_slot = st->stats_slot;
+    model_ctrl_pos = st->model_ctrl_pos;
+    boost_was_on = st->boost_was_on;
+}
+
+/* map STATE_FILE; on trouble hwwm just runs without it */
+void
+StateOpen() {
+    int fd;
+    void *p;
+
+    fd = open( STATE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if (fd < 0) {
+        log_message(LOG_FILE, "WARNING: Cannot open "STATE_FILE" - controller state will not survive restarts.");
+        return;
+    }
+    if (ftruncate( fd, sizeof(struct state_file) )) {
+        log_message(LOG_FILE, "WARNING: Cannot size "STATE_FILE" - controller state will not survive restarts.");
+        close( fd );
+        return;
+    }
+    p = mmap( NULL, sizeof(struct state_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    /* the mapping stays valid after the descriptor is closed */
+    close( fd );
+    if (p == MAP_FAILED) {
+        log_message(LOG_FILE, "WARNING: Cannot map "STATE_FILE" - controller state will not survive restarts.");
+        return;
+    }
+    state_map = p;
+}
+
+/* restore the newest valid saved state if fresh enough; return 1 if restored */
+short
+RestoreState() {
+    struct saved_state *st = NULL;
+    char msg[160];
+    time_t now = time(NULL);
+    unsigned long gap;
+    short i;
+
+    if (state_map == NULL) return 0;
+    if (memcmp( state_map->magic, STATE_MAGIC, 8 ) || (state_map->version != STATE_VERSION) ||
+        (state_map->size != sizeof(struct saved_state))) {
+        if (state_map->magic[0]) log_message(LOG_FILE, "INFO: Saved controller state is of another hwwm version - not used.");
+        memset( state_map, 0, sizeof(struct state_file) );
+        memcpy( state_map->magic, STATE_MAGIC, 8 );
+        state_map->version = STATE_VERSION;
+        state_map->size = sizeof(struct saved_state);
+        return 0;
+    }
+    for (i=0;i<2;i++) {
+        struct state_slot *sl = &state_map->slot[i];
+        if (!sl->seq_begin || (sl->seq_begin != sl->seq_end)) continue;
+        if (sl->seq_begin > state_seq) { state_seq = sl->seq_begin; st = &sl->s; }
+    }
+    if (st == NULL) return 0;
+    if ((now < st->saved_at) || (now - st->saved_at > STATE_MAX_AGE)) {
+        sprintf( msg, "INFO: Saved controller state is %ld seconds old - starting afresh.", (long)(now - st->saved_at) );
+        log_message(LOG_FILE, msg);
+        return 0;
+    }
+    StateLoad( st );
+    /* the state counters tell time since a change - the downtime counts too */
+    gap = (now - st->saved_at) / 10;
+    for (i=1;i<TOTALCONTROLS;i++) ctrlstatecycles[i] += gap;
+    /* only a handed over binary finds the relays as they were saved; after a stop or a
+       crash they went OFF with the old process (or go now, as the pins are set up), so
+       they count as OFF since the save and min_off holds from there */
+    if (!handed_over) {
+        for (i=0;i<devices_count;i++) {
+            struct device *d = &devices[i];
+            if (!controls[d->ctrl]) continue;
+            controls[d->ctrl] = 0;
+            ctrlstatecycles[d->ctrl] = gap;
+        }
+    }
+    sprintf( msg, "INFO: Restored controller state saved %ld seconds ago: P1=%d P2=%d V=%d H=%d HPL=%d HPH=%d.",
+             (long)(now - st->saved_at), CPump1, CPump2, CValve, CHeater, CHP_low, CHP_high );
+    log_message(LOG_FILE, msg);
+    return 1;
+}
+
+/* copy the controller state into the older slot */
+void
+SaveState() {
+    struct state_slot *sl;
+    struct saved_state *st;
+
+    if (state_map == NULL) return;
+    state_seq++;
+    sl = &state_map->slot[state_seq & 1];
+    st = &sl->s;
+    sl->seq_begin = state_seq;
+    __sync_synchronize();
+    StateStore( st );
+    __sync_synchronize();
+    sl->seq_end = state_seq;
+}
+
+/* BINARY UPGRADE: on SIGUSR2 hwwm re-executes HWWM_BINARY in the same process, so the PID
+   stays. The state goes over through STATE_FILE and the lock file descriptor is inherited.
+   GPIO pins are never unexported and the new binary skips exporting them and setting their
+   direction (that would drive outputs low), so no relay moves. Install a new binary with
+   mv, not cp, over the running one, then signal. If the exec fails, the running binary
+   goes on */
+void
+HandOver() {
+    char msg[160], fd_str[12];
+
+    if (state_map == NULL) {
+        log_message(LOG_FILE, "WARNING: No "STATE_FILE" to hand the state over with - not upgrading.");
+        return;
+    }
+    if (access( HWWM_BINARY, X_OK )) {
+        log_message(LOG_FILE, "WARNING: "HWWM_BINARY" is not there or not executable - not upgrading.");
+        return;
+    }
+    SaveState();
+    WritePersistentData();
+    /* the sink threads do not live through exec */
+    SinksFlush();
+    log_message(LOG_FILE, "INFO: Handing over to "HWWM_BINARY"...");
+    sprintf( fd_str, "%d", lock_fd );
+    setenv( HANDOFF_ENV, fd_str, 1 );
+    execl( HWWM_BINARY, HWWM_BINARY, (char *)NULL );
+    unsetenv( HANDOFF_ENV );
+    sprintf( msg, "ALARM: Handing over to "HWWM_BINARY" failed (%s)! Continuing with the running binary.", strerror(errno) );
+    log_message(LOG_FILE, msg);
+}
+
+/* stop on SIGTERM: what the outputs have queued is written out before the pins go */
+void
+Stop() {
+    WritePersistentData();
+    SinksFlush();
+    if ( ! DisableGPIOpins() ) {
+        log_message(LOG_FILE, "WARNING: Errors disabling GPIO pins! Quitting anyway.");
+        exit(14);
+    }
+    // this run was ProgramRunCycles cycles ;) 
+    log_message(LOG_FILE,"Exiting normally. Bye, bye!");
+    exit(0);
+}
+
+/* furnace water target off the tables at a minute of the day and an outdoor temp */
+float
+HeatCurveAt(short mode, short minute, float tout) {
+    float target;
+    long i = lroundf( (tout - CURVE_T_MIN) * 10 );
+
+    if (i < 0) i = 0;
+    if (i >= CURVE_STEPS) i = CURVE_STEPS-1;
+    target = curve->base[mode][minute] + curve->offset[mode][i];
+    if (target < CURVE_TARGET_MIN) target = CURVE_TARGET_MIN;
+    if (target > CURVE_TARGET_MAX) target = CURVE_TARGET_MAX;
+    return target;
+}
+
+float
+HeatCurveMin(short mode, float tout) {
+    float f = CURVE_TARGET_MAX;
+    for (short i=0;i<24*60;i++) if (HeatCurveAt( mode, i, tout ) < f) f = HeatCurveAt( mode, i, tout );
+    return f;
+}
+
+float
+HeatCurveMax(short mode, float tout) {
+    float f = CURVE_TARGET_MIN;
+    for (short i=0;i<24*60;i++) if (HeatCurveAt( mode, i, tout ) > f) f = HeatCurveAt( mode, i, tout );
+    return f;
+}
+
+/* heat pump mode and furnace water target of this cycle; a target set over HA wins over the curve */
+void
+HeatCurveUpdate() {
+    struct tm tm;
+
+    /* heat/cool switch-over with hysteresis: the average outdoor temp has to get half of it
+       past the switch temp */
+    if ((HPmode == HEAT) && (TenvAvrg > cfg.mode_switch_t + cfg.mode_hysteresis/2)) HPmode = COOL;
+    else if ((HPmode == COOL) && (TenvAvrg <= cfg.mode_switch_t - cfg.mode_hysteresis/2)) HPmode = HEAT;
+    if (ha_water_target) {
+        furnace_water_target = ha_water_target;
+        return;
+    }
+    localtime_r( &cycle_time, &tm );
+    furnace_water_target = HeatCurveAt( HPmode, tm.tm_hour*60 + tm.tm_min, TenvAvrg );
+}
+
+/* work heat_hours/cool_hours and heat_curve/cool_curve out into the heating curve tables; a bad
+   setting is left out with a warning - the built-in hours or a flat curve go in its place */
+void
+HeatCurveCompile() {
+    static const char *modes[2] = { "heat", "cool" };
+    const char *hours_cfg[2] = { cfg.heat_hours, cfg.cool_hours };
+    const char *curve_cfg[2] = { cfg.heat_curve, cfg.cool_curve };
+    float hours[24], pt[CURVE_POINTS], po[CURVE_POINTS], t;
+    char msg[200], buf[SENSORSLEN], *item, *save;
+    short m, h, n, k, i;
+
+    for (m=HEAT;m<=COOL;m++) {
+        /* hourly setpoints, from 0:00 to 23:00 */
+        n = 0;
+        snprintf( buf, sizeof buf, "%s", hours_cfg[m] );
+        for (item=strtok_r( buf, ",", &save );item && (n < 24);item=strtok_r( NULL, ",", &save )) hours[n++] = atof( item );
+        if (hours_cfg[m][0] && ((n != 24) || item)) {
+            sprintf( msg, "WARNING: %s_hours should list 24 temps, for 0:00 to 23:00 - using the built-in ones.", modes[m] );
+            log_message(LOG_FILE, msg);
+            n = 0;
+        }
+        if (n != 24) for (h=0;h<24;h++) hours[h] = (m == HEAT) ? HTTBh[h] : HTTBc[h];
+        for (i=0;i<24*60;i++) {
+            h = i / 60;
+            curve->base[m][i] = hours[h] + (hours[(h+1)%24] - hours[h]) * (i % 60) / 60;
+        }
+        /* outdoor_temp:offset points, temps going up */
+        n = 0;
+        snprintf( buf, sizeof buf, "%s", curve_cfg[m] );
+        for (item=strtok_r( buf, ",", &save );item;item=strtok_r( NULL, ",", &save )) {
+            if ((n == CURVE_POINTS) || (sscanf( item, "%f:%f", &pt[n], &po[n] ) != 2) || (n && (pt[n] <= pt[n-1]))) {
+                sprintf( msg, "WARNING: %s_curve should be up to %d outdoor_temp:offset points, temps going up"\
+                " - using a flat curve.", modes[m], CURVE_POINTS );
+                log_message(LOG_FILE, msg);
+                n = 0;
+                break;
+            }
+            n++;
+        }
+        for (i=0;i<CURVE_STEPS;i++) {
+            t = CURVE_T_MIN + i / 10.0;
+            if (!n) curve->offset[m][i] = 0;
+            else if (t <= pt[0]) curve->offset[m][i] = po[0];
+            else if (t >= pt[n-1]) curve->offset[m][i] = po[n-1];
+            else {
+                for (k=1;t > pt[k];k++);
+                curve->offset[m][i] = po[k-1] + (po[k] - po[k-1]) * (t - pt[k-1]) / (pt[k] - pt[k-1]);
+            }
+        }
+    }
+    sprintf( msg, "INFO: Heating curve targets over the day: heat %.1f..%.1f C at 0 C outdoor, %.1f..%.1f C at"\
+    " -10 C; cool %.1f..%.1f C at 30 C", HeatCurveMin( HEAT, 0 ), HeatCurveMax( HEAT, 0 ), HeatCurveMin( HEAT, -10 ),
+    HeatCurveMax( HEAT, -10 ), HeatCurveMin( COOL, 30 ), HeatCurveMax( COOL, 30 ) );
+    log_message(LOG_FILE, msg);
+    sprintf( msg, "INFO: Heat pumps switch to cool above %.1f C outdoor, back to heat at %.1f C and below",
+    cfg.mode_switch_t + cfg.mode_hysteresis/2, cfg.mode_switch_t - cfg.mode_hysteresis/2 );
+    log_message(LOG_FILE, msg);
+}
+
+/* Function to get current time and put the hour in current_timer_hour */
+void
+GetCurrentTime() {
+    static HWWM_TLS char buff[80];
+    struct tm tm, *t_struct = &tm;
+    short must_check = 0;
+    unsigned short current_day_of_month = 0;
+    static HWWM_TLS char data[280];
+	
+	ReWrite_CFG_TABLE_FILE();
+
+    localtime_r( &cycle_time, t_struct );
+
+    /* get current hour */
+    strftime( buff, sizeof buff, "%H", t_struct );
+    current_timer_hour = atoi( buff );
+    
+    if ((current_timer_hour == 8) && ((ProgramRunCycles % (6*60)) == 0)) must_check = 1;
+
+    /* the tariff hours come from the tariff calendar; update the month at program start
+    and every day sometime between 8:00 and 9:00 */
+    if (( just_started ) || ( must_check )) {
+        strftime( buff, sizeof buff, "%m", t_struct );
+        current_month = atoi( buff );
+        /* among other things - manage power used counters; only check one
+        time during the day: at 8'something...*/
+        if (must_check) {
+            strftime( buff, sizeof buff, "%e", t_struct );
+            current_day_of_month = atoi( buff );
+            if (current_day_of_month == cfg.day_to_reset_Pcounters) {
+                /*...if it is the correct day of month - log gathered data and reset counters */
+                sprintf( buff, "INFO: Power used last month: nightly: %3.1f Wh, daily: %3.1f Wh;",
+                NightlyPowerUsed, (TotalPowerUsed-NightlyPowerUsed) );
+                log_message(LOG_FILE, buff);
+                sprintf( buff, "INFO: Total: %3.1f Wh, cost %.2f. Power counters reset.", TotalPowerUsed, PowerCost );
+                log_message(LOG_FILE, buff);
+                TotalPowerUsed = 0;
+                NightlyPowerUsed = 0;
+                PowerCost = 0;
+            }
+        }
+    }
+    sprintf( data, "------> GetCurrentTime:" );
+    /* base furnace water target temp: sliding target between hourly ones, off the heating curve */
+    HeatCurveUpdate();
+    sprintf( data + strlen(data), (HPmode == COOL) ? " COOL" : " HEAT" );
+    sprintf( data + strlen(data), " fwt=%5.3f", furnace_water_target);
+    DataNote( data );
+}
+
+/* SNAPSHOT: what a cycle ends with - taken once by LogData(), and handed from there to
+   the output sinks, which write it out in the formats of DATA_FILE, TABLE_FILE and JSON_FILE.
+   The formats take the device names and bits from devices[] - these are only set up at
+   start-up, so a sink thread can read them too */
+struct snapshot
+{
+    time_t  at;
+    unsigned long cycle;
+    unsigned short hour;
+    /* temps by sensor number; the environment one is its average */
+    float   t[MAXSENSORS+1];
+    short   in_use[MAXSENSORS+1];
+    float   rate[TOTALSENSORS+1];
+    float   spread[TOTALSENSORS+1];
+    unsigned long age[MAXSENSORS+1];
+    unsigned long crc_errors[TOTALSENSORS+1];
+    unsigned long retries;
+    unsigned short degraded;
+    int     wanted_T;
+    int     abs_max;
+    int     night_boost;
+    float   fwt;
+    unsigned short wanted;
+    unsigned short state;
+    unsigned short on_battery;
+    float   power_used;
+    float   power_used_nt;
+    float   power_cost;
+    double  boiler[MODEL_PARAMS];
+    short   boiler_conf[MODEL_PARAMS];
+    double  furnace[MODEL_PARAMS];
+    short   furnace_conf[MODEL_PARAMS];
+    unsigned long late_cycles;
+    unsigned short send_bits;
+    unsigned short comms;
+    short   site;
+    short   site_shared;
+    int     site_grant;
+    short   hp_link;
+    short   hp_up;
+    short   hp_acked;
+    int     hp_compressor;
+    int     hp_power;
+    long    hp_ack_ms;
+    unsigned long hp_bad_frames;
+    /* the DATA_FILE lines of the cycle, each ending with a new line */
+    char    notes[DATA_NOTES_LEN];
+    short   notes_only;     /* to DATA_FILE in a cycle it is not due - only the lines */
+};
+
+/* the snapshot of the last cycle - the control socket answers from it between cycles */
+HWWM_TLS struct snapshot snap_last;
+
+void
+SnapshotTake(struct snapshot *s, unsigned short wanted) {
+    short i;
+
+    s->at = cycle_time;
+    s->cycle = ProgramRunCycles;
+    s->hour = current_timer_hour;
+    for (i=1;i<=MAXSENSORS;i++) {
+        s->t[i] = sensors[i];
+        s->in_use[i] = SensorInUse(i);
+        s->age[i] = sensor_age[i];
+    }
+    s->t[5] = TenvAvrg;
+    for (i=1;i<=TOTALSENSORS;i++) {
+        s->rate[i] = HistRate(i, 1);
+        s->spread[i] = fuse_spread[i];
+        s->crc_errors[i] = sensor_crc_errors[i];
+    }
+    s->retries = sensor_retries;
+    s->degraded = sensors_failed;
+    s->wanted_T = cfg.wanted_T;
+    s->abs_max = cfg.abs_max;
+    s->night_boost = cfg.night_boost;
+    s->fwt = furnace_water_target;
+    s->wanted = wanted;
+    s->state = DevicesState();
+    s->on_battery = CPowerByBattery;
+    s->power_used = TotalPowerUsed;
+    s->power_used_nt = NightlyPowerUsed;
+    s->power_cost = PowerCost;
+    for (i=0;i<MODEL_PARAMS;i++) {
+        s->boiler[i] = boiler_model.theta[i];
+        s->boiler_conf[i] = ModelConfidence(&boiler_model, i);
+        s->furnace[i] = furnace_model.theta[i];
+        s->furnace_conf[i] = ModelConfidence(&furnace_model, i);
+    }
+    s->late_cycles = wd_late_cycles;
+    s->send_bits = sendBits;
+    s->comms = COMMS;
+    s->site = (site_sock >= 0);
+    s->site_shared = site_shared;
+    s->site_grant = site_grant;
+    s->hp_link = HPLinkUsed();
+    s->hp_up = hp_up;
+    s->hp_acked = hp_acked;
+    s->hp_compressor = hp_compressor;
+    s->hp_power = hp_power;
+    s->hp_ack_ms = hp_ack_ms;
+    s->hp_bad_frames = hp_bad_frames;
+    memcpy( s->notes, data_notes, data_notes_len + 1 );
+    data_notes_len = 0;
+    data_notes[0] = 0;
+}
+
+/* " name" of every device with a bit in bits */
+void
+SnapshotDevices(struct text *t, unsigned short bits) {
+    for (short i=0;i<devices_count;i++) {
+        if (!(bits & devices[i].bit)) continue;
+        TextAdd( t, " " );
+        TextAdd( t, devices[i].name );
+    }
+}
+
+/* the DATA_FILE line:
+   11,  45.500,61.250,40.125,48.000,12.500  40,63,0,32.000  WANTED: P1 V got: P1 V    OK!   sendBits:0 COMMS:0 */
+void
+SnapshotLine(const struct snapshot *s, struct text *t) {
+    unsigned short diff = (s->wanted ^ s->state) & ~DEV_HEATER_FORCED;
+    short i;
+
+    TextLong( t, s->hour, 2 );
+    TextAdd( t, ",  " );
+    TextFixed( t, s->t[1], 6, 3 );
+    TextAdd( t, "," );
+    TextFixed( t, s->t[2], 6, 3 );
+    TextAdd( t, "," );
+    TextFixed( t, s->t[4], 6, 3 );
+    TextAdd( t, "," );
+    TextFixed( t, s->t[3], 6, 3 );
+    TextAdd( t, "," );
+    TextFixed( t, s->t[5], 6, 3 );
+    TextAdd( t, "  " );
+    TextLong( t, s->wanted_T, 2 );
+    TextAdd( t, "," );
+    TextLong( t, s->abs_max, 2 );
+    TextAdd( t, "," );
+    TextLong( t, s->night_boost, 0 );
+    TextAdd( t, "," );
+    TextFixed( t, s->fwt, 6, 3 );
+    if (s->wanted) {
+        TextAdd( t, "  WANTED:" );
+        for (i=0;i<devices_count;i++) {
+            if (s->wanted & devices[i].bit) { TextAdd( t, " " ); TextAdd( t, devices[i].name ); }
+            if (s->wanted & devices[i].force_bit) { TextAdd( t, " *" ); TextAdd( t, devices[i].name ); TextAdd( t, "f*" ); }
+        }
+    }
+    if (s->state) {
+        TextAdd( t, " got:" );
+        SnapshotDevices( t, s->state );
+    }
+    if (diff) {
+        TextAdd( t, " DIFF:" );
+        SnapshotDevices( t, diff );
+    }
+    else TextAdd( t, "    OK!  " );
+    if (s->on_battery) TextAdd( t, " *UPS*" );
+    if (s->degraded) {
+        TextAdd( t, " *DEGRADED:" );
+        TextLong( t, s->degraded, 0 );
+        TextAdd( t, "*" );
+    }
+    for (i=1;i<=MAXSENSORS;i++) {
+        if (!s->age[i]) continue;
+        TextAdd( t, " *STALE" );
+        TextLong( t, i, 0 );
+        TextAdd( t, ":" );
+        TextUlong( t, s->age[i], 0 );
+        TextAdd( t, "s*" );
+    }
+    TextAdd( t, " sendBits:" );
+    TextLong( t, s->send_bits, 0 );
+    TextAdd( t, " COMMS:" );
+    TextLong( t, s->comms, 0 );
+    if (s->hp_link) {
+        TextAdd( t, s->hp_up ? (s->hp_acked ? " HP:ok," : " HP:noack,") : " HP:down," );
+        TextLong( t, s->hp_compressor, 0 );
+        TextAdd( t, "," );
+        TextLong( t, s->hp_power, 0 );
+        TextAdd( t, "W" );
+    }
+}
+
+/* numbers of the sensors, to go after names */
+const char *snapshot_nums[MAXSENSORS+1] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+
+/* one "name,value" pair of TABLE_FILE - pairs after the first are on lines of their own,
+   starting with "_"; the name comes in two parts */
+void
+SnapshotRow(struct text *t, const char *name, const char *suffix) {
+    TextAdd( t, t->len ? "\n_," : "," );
+    TextAdd( t, name );
+    TextAdd( t, suffix );
+    TextAdd( t, "," );
+}
+
+void
+SnapshotTable(const struct snapshot *s, struct text *t) {
+    static const char *ctrls[4] = { "Pump1", "Pump2", "Valve", "Heater" };
+    short i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotRow( t, "Temp", snapshot_nums[i] );
+        TextFixed( t, s->t[i], 5, 3 );
+    }
+    for (i=0;i<4;i++) {
+        SnapshotRow( t, ctrls[i], "" );
+        TextLong( t, (s->state & devices[i].bit) ? 1 : 0, 0 );
+    }
+    SnapshotRow( t, "PoweredByBattery", "" );
+    TextLong( t, s->on_battery, 0 );
+    SnapshotRow( t, "TempWanted", "" );
+    TextLong( t, s->wanted_T, 0 );
+    SnapshotRow( t, "BoilerTabsMax", "" );
+    TextLong( t, s->abs_max, 0 );
+    SnapshotRow( t, "ElectricityUsed", "" );
+    TextFixed( t, s->power_used, 5, 3 );
+    SnapshotRow( t, "ElectricityUsedNT", "" );
+    TextFixed( t, s->power_used_nt, 5, 3 );
+    SnapshotRow( t, "ElectricityCost", "" );
+    TextFixed( t, s->power_cost, 5, 3 );
+    SnapshotRow( t, "Degraded", "" );
+    TextLong( t, s->degraded, 0 );
+    /* extra sensors and devices go after the built-in ones */
+    for (i=TOTALSENSORS+1;i<=MAXSENSORS;i++) {
+        if (!s->in_use[i]) continue;
+        SnapshotRow( t, "Temp", snapshot_nums[i] );
+        TextFixed( t, s->t[i], 5, 3 );
+    }
+    for (i=BUILTINDEVICES;i<devices_count;i++) {
+        SnapshotRow( t, devices[i].name, "" );
+        TextLong( t, (s->state & devices[i].bit) ? 1 : 0, 0 );
+    }
+}
+
+/* one "name:value" pair of JSON_FILE */
+void
+SnapshotKey(struct text *t, const char *name, const char *suffix) {
+    TextAdd( t, (t->len > 1) ? "," : "" );
+    TextAdd( t, name );
+    TextAdd( t, suffix );
+    TextAdd( t, ":" );
+}
+
+void
+SnapshotJSON(const struct snapshot *s, struct text *t) {
+    static const char *temps[TOTALSENSORS+1] = { "", "Tkotel", "Tkolektor", "TboilerH", "TboilerL", "Tenv" };
+    static const char *ctrls[4] = { "PumpFurnace", "PumpSolar", "Valve", "Heater" };
+    static const char *boiler[MODEL_PARAMS] = { "BoilerLoss", "HeaterRate", "ValveRate", "SolarRate" };
+    static const char *furnace[MODEL_PARAMS] = { "FurnaceLoss", "HPLRate", "HPHRate", "FurnaceValveRate" };
+    short i;
+
+    TextAdd( t, "{" );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotKey( t, temps[i], "" );
+        TextFixed( t, s->t[i], 5, 3 );
+    }
+    for (i=0;i<4;i++) {
+        SnapshotKey( t, ctrls[i], "" );
+        TextLong( t, (s->state & devices[i].bit) ? 1 : 0, 0 );
+    }
+    SnapshotKey( t, "PoweredByBattery", "" );
+    TextLong( t, s->on_battery, 0 );
+    SnapshotKey( t, "TempWanted", "" );
+    TextLong( t, s->wanted_T, 0 );
+    SnapshotKey( t, "BoilerTabsMax", "" );
+    TextLong( t, s->abs_max, 0 );
+    SnapshotKey( t, "ElectricityUsed", "" );
+    TextFixed( t, s->power_used, 5, 3 );
+    SnapshotKey( t, "ElectricityUsedNT", "" );
+    TextFixed( t, s->power_used_nt, 5, 3 );
+    SnapshotKey( t, "ElectricityCost", "" );
+    TextFixed( t, s->power_cost, 5, 3 );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotKey( t, temps[i], "Rate" );
+        TextFixed( t, s->rate[i], 5, 3 );
+    }
+    /* model parameters: the losses with 4 decimals, the rates with 3 */
+    for (i=0;i<MODEL_PARAMS;i++) {
+        SnapshotKey( t, boiler[i], "" );
+        TextFixed( t, s->boiler[i], i ? 5 : 6, i ? 3 : 4 );
+        SnapshotKey( t, boiler[i], "Conf" );
+        TextLong( t, s->boiler_conf[i], 0 );
+    }
+    for (i=0;i<MODEL_PARAMS;i++) {
+        SnapshotKey( t, furnace[i], "" );
+        TextFixed( t, s->furnace[i], i ? 5 : 6, i ? 3 : 4 );
+        SnapshotKey( t, furnace[i], "Conf" );
+        TextLong( t, s->furnace_conf[i], 0 );
+    }
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotKey( t, "CrcErr", snapshot_nums[i] );
+        TextUlong( t, s->crc_errors[i], 0 );
+    }
+    SnapshotKey( t, "SensorRetries", "" );
+    TextUlong( t, s->retries, 0 );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotKey( t, "Age", snapshot_nums[i] );
+        TextUlong( t, s->age[i], 0 );
+    }
+    SnapshotKey( t, "Degraded", "" );
+    TextLong( t, s->degraded, 0 );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        SnapshotKey( t, "Spread", snapshot_nums[i] );
+        TextFixed( t, s->spread[i], 4, 2 );
+    }
+    SnapshotKey( t, "LateCycles", "" );
+    TextUlong( t, s->late_cycles, 0 );
+    for (i=TOTALSENSORS+1;i<=MAXSENSORS;i++) {
+        if (!s->in_use[i]) continue;
+        SnapshotKey( t, "Temp", snapshot_nums[i] );
+        TextFixed( t, s->t[i], 5, 3 );
+    }
+    for (i=BUILTINDEVICES;i<devices_count;i++) {
+        SnapshotKey( t, devices[i].name, "" );
+        TextLong( t, (s->state & devices[i].bit) ? 1 : 0, 0 );
+    }
+    if (s->site) {
+        SnapshotKey( t, "SiteShared", "" );
+        TextLong( t, s->site_shared, 0 );
+        SnapshotKey( t, "SiteGrant", "" );
+        TextLong( t, s->site_grant, 0 );
+    }
+    if (s->hp_link) {
+        SnapshotKey( t, "HPLink", "" );
+        TextLong( t, s->hp_up, 0 );
+        SnapshotKey( t, "HPCompressor", "" );
+        TextLong( t, s->hp_compressor, 0 );
+        SnapshotKey( t, "HPPowerW", "" );
+        TextLong( t, s->hp_power, 0 );
+        SnapshotKey( t, "HPAckMs", "" );
+        TextLong( t, s->hp_ack_ms, 0 );
+        SnapshotKey( t, "HPBadFrames", "" );
+        TextUlong( t, s->hp_bad_frames, 0 );
+    }
+    TextAdd( t, "}" );
+}
+
+/* OUTPUT SINKS: every sink takes the snapshots of the cycles at its own cadence (its
+   <name>_every setting, in cycles; 0 turns it off) and writes them out from a thread of its
+   own, so a slow disk or a dead server never holds up a control cycle. What a sink does
+   with snapshots it cannot keep up with is its policy:
+     SINK_LATEST - only the newest one matters: a new snapshot replaces one still waiting
+     SINK_BUFFER - every one matters: up to SINK_QUEUE wait in order, written SINK_BATCH
+                   at a time; when full the oldest is dropped, and a failed batch is put
+                   back to be retried
+   A failing sink is retried after SINK_RETRY_S. Until SinksStart(), and in libhwwm, the
+   snapshots are written out right away, on the control thread */
+#define SINK_LATEST         0
+#define SINK_BUFFER         1
+#define SINK_QUEUE          64
+#define SINK_BATCH          16
+#define SINK_RETRY_S        5
+#define SINK_FLUSH_MS       2000
+
+struct sink
+{
+    const char *name;
+    short   policy;
+    /* write out n snapshots, oldest first; return 0 on failure */
+    short   (*write)(const struct snapshot *s, short n);
+    int     every;
+    /* the queue: depth snapshots, count of them waiting from head on */
+    struct snapshot *queue;
+    short   depth;
+    short   head;
+    short   count;
+    struct snapshot *batch;
+    short   writing;
+    short   dropping;
+    short   failing;
+    unsigned long dropped;
+    unsigned long failed;
+    short   running;
+    pthread_t thread;
+    pthread_cond_t wake;
+};
+
+/* where the emoncms sink posts to - a copy of the config, as its thread cannot read cfg */
+struct emoncms_target
+{
+    char    url[MAXLEN];
+    char    node[MAXLEN];
+    char    apikey[MAXLEN];
+};
+
+HWWM_TLS pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+HWWM_TLS struct emoncms_target emoncms;
+
+/* timestamp of a snapshot, as log_message() puts it */
+void
+SinkStamp(const struct snapshot *s, char *ts, size_t size) {
+    struct tm tm;
+
+    localtime_r( &s->at, &tm );
+    strftime( ts, size, "%F %T", &tm );
+}
+
+/* DATA_FILE: the lines of each cycle, then its data line - a batch in one open of the file */
+short
+SinkData(const struct snapshot *s, short n) {
+    char line[1600], ts[30];
+    const char *p, *e;
+    struct text t;
+    FILE *fp;
+
+    fp = fopen( DATA_FILE, "a" );
+    if ( !fp ) return 0;
+    for (short i=0;i<n;i++) {
+        SinkStamp( &s[i], ts, sizeof ts );
+        for (p=s[i].notes;(e = strchr( p, '\n' )) != NULL;p=e+1) fprintf( fp, "%s %.*s\n", ts, (int)(e-p), p );
+        if (s[i].notes_only) continue;
+        SnapshotLine( &s[i], TextStart( &t, line, sizeof line ) );
+        fprintf( fp, "%s %s\n", ts, line );
+    }
+    return (fclose( fp ) == 0);
+}
+
+/* for the first 2 cycles = 20 seconds - do not create or update the files that go out to
+   other systems - sometimes there is garbage, which would be nice if is not sent at all */
+short
+SinkWarmingUp(const struct snapshot *s) {
+    return (s->cycle < 2);
+}
+
+short
+SinkTable(const struct snapshot *s, short n) {
+    char text[1600], ts[30];
+    struct text t;
+    FILE *fp;
+
+    s += n-1;
+    if (SinkWarmingUp(s)) return -1;
+    SinkStamp( s, ts, sizeof ts );
+    SnapshotTable( s, TextStart( &t, text, sizeof text ) );
+    fp = fopen( TABLE_FILE, "w" );
+    if ( !fp ) return 0;
+    fprintf( fp, "%s%s\n", ts, text );
+    return (fclose( fp ) == 0);
+}
+
+short
+SinkJSON(const struct snapshot *s, short n) {
+    char text[1600];
+    struct text t;
+    FILE *fp;
+
+    s += n-1;
+    if (SinkWarmingUp(s)) return -1;
+    SnapshotJSON( s, TextStart( &t, text, sizeof text ) );
+    fp = fopen( JSON_FILE, "w" );
+    if ( !fp ) return 0;
+    fputs( text, fp );
+    return (fclose( fp ) == 0);
+}
+
+/* send all of n bytes; return 0 on failure */
+short
+SendAll(int fd, const char *p, size_t n) {
+    ssize_t r;
+
+    for (;n;p+=r,n-=r) {
+        r = send( fd, p, n, MSG_NOSIGNAL );
+        if (r <= 0) return 0;
+    }
+    return -1;
+}
+
+/* POST a form to url (http://host[:port]/path), giving each step 2 seconds; return 0 on
+   failure, or if the answer is not a 2xx */
+short
+HttpPost(const char *url, const char *form) {
+    struct addrinfo hints, *ai, *a;
+    struct timeval tv = { 2, 0 };
+    char host[MAXLEN], port[8] = "80", req[256], reply[16];
+    const char *path, *h = url + 7;
+    char *c;
+    size_t n;
+    ssize_t r;
+    short ok;
+    int fd = -1;
+
+    if (strncmp( url, "http://", 7 )) return 0;
+    path = strchr( h, '/' );
+    if (path == NULL) path = h + strlen(h);
+    n = path - h;
+    if (!n || (n >= sizeof host)) return 0;
+    memcpy( host, h, n );
+    host[n] = 0;
+    if ((c = strrchr( host, ':' )) != NULL) {
+        *c = 0;
+        snprintf( port, sizeof port, "%s", c+1 );
+    }
+    memset( &hints, 0, sizeof hints );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo( host, port, &hints, &ai )) return 0;
+    for (a=ai;a!=NULL;a=a->ai_next) {
+        fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+        if (fd < 0) continue;
+        /* on Linux the send timeout bounds connect() too */
+        setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv );
+        setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv );
+        if (connect( fd, a->ai_addr, a->ai_addrlen ) == 0) break;
+        close( fd );
+        fd = -1;
+    }
+    freeaddrinfo( ai );
+    if (fd < 0) return 0;
+
+    n = snprintf( req, sizeof req, "POST %s HTTP/1.0\r\nHost: %s\r\nContent-Type: application/x-www-form-urlencoded\r\n"\
+        "Content-Length: %zu\r\nConnection: close\r\n\r\n", path[0] ? path : "/", host, strlen(form) );
+    ok = (n < sizeof req) && SendAll( fd, req, n ) && SendAll( fd, form, strlen(form) );
+    /* "HTTP/1.1 200" - only the status code is looked at */
+    n = 0;
+    if (ok) {
+        while ((n < sizeof reply - 1) && ((r = recv( fd, reply + n, sizeof reply - 1 - n, 0 )) > 0)) n += r;
+    }
+    close( fd );
+    reply[n] = 0;
+    return (n >= 10) && !strncmp( reply, "HTTP/1.", 7 ) && (reply[9] == '2');
+}
+
+/* emoncms input API: what scripts/rc.hwwm_sender did with JSON_FILE and curl */
+short
+SinkEmoncms(const struct snapshot *s, short n) {
+    struct emoncms_target to;
+    char json[1600], form[4000];
+    struct text t;
+
+    s += n-1;
+    if (SinkWarmingUp(s)) return -1;
+    pthread_mutex_lock( &sink_lock );
+    to = emoncms;
+    pthread_mutex_unlock( &sink_lock );
+    SnapshotJSON( s, TextStart( &t, json, sizeof json ) );
+    TextStart( &t, form, sizeof form );
+    TextAdd( &t, "node=" );
+    TextUrl( &t, to.node );
+    TextAdd( &t, "&data=" );
+    TextUrl( &t, json );
+    TextAdd( &t, "&apikey=" );
+    TextUrl( &t, to.apikey );
+    return HttpPost( to.url, form );
+}
+
+HWWM_TLS struct sink sinks[] = {
+    { "data", SINK_BUFFER, SinkData },
+    { "table", SINK_LATEST, SinkTable },
+    { "json", SINK_LATEST, SinkJSON },
+    { "emoncms", SINK_LATEST, SinkEmoncms },
+};
+#define SINKS               ((short)(sizeof sinks / sizeof sinks[0]))
+
+/* take the cadences and the emoncms target from the config */
+void
+SinksConfigure() {
+    char msg[200];
+
+    sinks[0].every = cfg.data_every;
+    sinks[1].every = cfg.table_every;
+    sinks[2].every = cfg.json_every;
+    sinks[3].every = cfg.emoncms_url[0] ? cfg.emoncms_every : 0;
+    pthread_mutex_lock( &sink_lock );
+    strcpy( emoncms.url, cfg.emoncms_url );
+    strcpy( emoncms.node, cfg.emoncms_node );
+    strcpy( emoncms.apikey, cfg.emoncms_apikey );
+    pthread_mutex_unlock( &sink_lock );
+    sprintf( msg, "INFO: Outputs every N cycles (0 = OFF): data=%d, table=%d, json=%d, emoncms=%d",
+             sinks[0].every, sinks[1].every, sinks[2].every, sinks[3].every );
+    log_message(LOG_FILE, msg);
+    if (cfg.emoncms_url[0] && strncmp( cfg.emoncms_url, "http://", 7 )) {
+        sprintf( msg, "WARNING: emoncms_url should start with http:// - posting to %.80s will fail.", cfg.emoncms_url );
+        log_message(LOG_FILE, msg);
+    }
+}
+
+/* sink thread: takes what waits in the queue, a batch at a time, and writes it out */
+void *
+SinkWriter(void *arg) {
+    struct sink *sk = (struct sink *)arg;
+    char msg[160];
+    short n, i, ok, report;
+    unsigned long failed;
+
+    while (1) {
+        pthread_mutex_lock( &sink_lock );
+        while (!sk->count) pthread_cond_wait( &sk->wake, &sink_lock );
+        n = (sk->count < SINK_BATCH) ? sk->count : SINK_BATCH;
+        for (i=0;i<n;i++) {
+            sk->batch[i] = sk->queue[sk->head];
+            sk->head = (sk->head + 1) % sk->depth;
+        }
+        sk->count -= n;
+        sk->writing = 1;
+        pthread_mutex_unlock( &sink_lock );
+
+        ok = sk->write( sk->batch, n );
+
+        pthread_mutex_lock( &sink_lock );
+        sk->writing = 0;
+        report = (sk->failing != !ok);
+        sk->failing = !ok;
+        if (!ok) {
+            sk->failed += n;
+            /* put the batch back in front of what came meanwhile - as much as fits */
+            if (sk->policy == SINK_BUFFER) {
+                for (i=n-1;(i >= 0) && (sk->count < sk->depth);i--) {
+                    sk->head = (sk->head + sk->depth - 1) % sk->depth;
+                    sk->queue[sk->head] = sk->batch[i];
+                    sk->count++;
+                }
+                sk->dropped += i+1;
+            }
+        }
+        failed = sk->failed;
+        pthread_mutex_unlock( &sink_lock );
+
+        if (report) {
+            if (ok) sprintf( msg, "INFO: Output '%s' works again, after %lu failed writes.", sk->name, failed );
+            else sprintf( msg, "WARNING: Output '%s' failed - retrying every %d seconds.", sk->name, SINK_RETRY_S );
+            log_message(LOG_FILE, msg);
+        }
+        if (!ok) sleep( SINK_RETRY_S );
+    }
+    return NULL;
+}
+
+/* start a thread for each sink; return 0 on error */
+short
+SinksStart() {
+    struct sink *sk;
+
+    for (short i=0;i<SINKS;i++) {
+        sk = &sinks[i];
+        sk->depth = (sk->policy == SINK_BUFFER) ? SINK_QUEUE : 1;
+        sk->queue = malloc( sk->depth * sizeof *sk->queue );
+        sk->batch = malloc( ((sk->policy == SINK_BUFFER) ? SINK_BATCH : 1) * sizeof *sk->batch );
+        if ((sk->queue == NULL) || (sk->batch == NULL)) return 0;
+        if (pthread_cond_init( &sk->wake, NULL )) return 0;
+        if (pthread_create( &sk->thread, NULL, SinkWriter, sk )) return 0;
+        sk->running = 1;
+    }
+    return -1;
+}
+
+/* hand a snapshot to the sinks due for one this cycle */
+void
+SinksPush(const struct snapshot *s) {
+    static HWWM_TLS struct snapshot note;
+    struct sink *sk;
+    char msg[160];
+    short report, notes_only;
+    unsigned long dropped;
+
+    for (short i=0;i<SINKS;i++) {
+        sk = &sinks[i];
+        /* the lines of the cycle go to DATA_FILE even when its data line is not due */
+        notes_only = (sk->write == SinkData) && (s->cycle % (sk->every ? sk->every : 1)) && s->notes[0];
+        if (!sk->every || ((s->cycle % sk->every) && !notes_only)) continue;
+        if (!sk->running) {
+            if (notes_only) {
+                note = *s;
+                note.notes_only = 1;
+                if (!sk->write( &note, 1 )) sk->failed++;
+            }
+            else if (!sk->write( s, 1 )) sk->failed++;
+            continue;
+        }
+        report = 0;
+        pthread_mutex_lock( &sink_lock );
+        if (sk->count == sk->depth) {
+            /* full: the oldest goes - for SINK_LATEST that is the one waiting */
+            sk->head = (sk->head + 1) % sk->depth;
+            sk->count--;
+            sk->dropped++;
+            if ((sk->policy == SINK_BUFFER) && !sk->dropping) report = sk->dropping = 1;
+        }
+        else if (sk->dropping && (sk->count < sk->depth/2)) {
+            sk->dropping = 0;
+            report = 2;
+        }
+        sk->queue[(sk->head + sk->count) % sk->depth] = *s;
+        sk->queue[(sk->head + sk->count) % sk->depth].notes_only = notes_only;
+        sk->count++;
+        dropped = sk->dropped;
+        pthread_cond_signal( &sk->wake );
+        pthread_mutex_unlock( &sink_lock );
+
+        if (report == 1) {
+            sprintf( msg, "WARNING: Output '%s' cannot keep up - dropping its oldest data.", sk->name );
+            log_message(LOG_FILE, msg);
+        }
+        if (report == 2) {
+            sprintf( msg, "INFO: Output '%s' keeps up again, %lu snapshots dropped so far.", sk->name, dropped );
+            log_message(LOG_FILE, msg);
+        }
+    }
+}
+
+/* wait a while for the sinks to write out what waits in their queues */
+void
+SinksFlush() {
+    struct timespec start, nap = { 0, 20000000 };
+    short busy;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    do {
+        busy = 0;
+        pthread_mutex_lock( &sink_lock );
+        for (short i=0;i<SINKS;i++) {
+            if (sinks[i].running && (sinks[i].count || sinks[i].writing) && !sinks[i].failing) busy = 1;
+        }
+        pthread_mutex_unlock( &sink_lock );
+        if (!busy) return;
+        nanosleep( &nap, NULL );
+    } while (ms_since(&start) < SINK_FLUSH_MS);
+    log_message(LOG_FILE, "WARNING: Outputs not written out in time - some of their data is lost.");
+}
+
+void
+LogData(short HM) {
+    SnapshotTake( &snap_last, HM );
+    SinksPush( &snap_last );
+}
+
+#ifndef HWWM_LIB
+/* CONTROL SOCKET: local clients connect to CONTROL_SOCKET and send commands, one per line;
+   each gets one line back, starting with "ok" or "err". Commands are served between cycles,
+   in CycleSleep(), and what they change is in effect from the next cycle on:
+     get                            the snapshot of the last cycle, as in JSON_FILE
+     get <setting>                  the value of a setting
+     set <setting> <value>          change a setting, until the config is read again
+     force <device> on|off <min>    force a device for that many minutes - its minimum ON
+                                    and OFF times, the power budget, the collector and
+                                    furnace protections and abs_max for the heater still
+                                    apply
+     force <device> auto            give the device back to the control logic
+     forces                         list the devices forced
+   Every command is logged, with the pid and uid of the client */
+#define MAXCTLCLIENTS       4
+#define CTL_LINE            160
+#define CTL_MAX_FORCE_MIN   (7*24*60)
+
+struct ctl_client
+{
+    int     fd;
+    int     pid;
+    int     uid;
+    char    buf[CTL_LINE];
+    short   len;
+};
+
+struct ctl_setting
+{
+    const char *name;
+    int     *value;
+    int     min, max;
+};
+
+HWWM_TLS int ctl_fd = -1;
+HWWM_TLS struct ctl_client ctl_clients[MAXCTLCLIENTS];
+
+/* the settings the control socket can change */
+struct ctl_setting ctl_settings[] = {
+    { "mode", &cfg.mode, 0, 1 },
+    { "wanted_T", &cfg.wanted_T, 25, 52 },
+    { "use_acs", &cfg.use_acs, 0, 1 },
+    { "use_electric_heater_night", &cfg.use_electric_heater_night, 0, 1 },
+    { "use_electric_heater_day", &cfg.use_electric_heater_day, 0, 1 },
+    { "use_pump1", &cfg.use_pump1, 0, 1 },
+    { "use_pump2", &cfg.use_pump2, 0, 1 },
+    { "night_boost", &cfg.night_boost, 0, 1 },
+};
+#define CTLSETTINGS         ((short)(sizeof ctl_settings / sizeof ctl_settings[0]))
+
+void
+CtlClose(struct ctl_client *c) {
+    UnwatchFd( c->fd );
+    close( c->fd );
+    c->fd = -1;
+}
+
+/* send a reply line; a client that does not take it in is dropped */
+void
+CtlReply(struct ctl_client *c, const char *reply) {
+    char line[1800];
+    int n = snprintf( line, sizeof line, "%s\n", reply );
+
+    if (n >= (int)sizeof line) n = sizeof line - 1;
+    if (send( c->fd, line, n, MSG_DONTWAIT|MSG_NOSIGNAL ) != n) CtlClose( c );
+}
+
+struct ctl_setting *
+CtlSetting(const char *name) {
+    for (short i=0;i<CTLSETTINGS;i++) if (!strcmp( ctl_settings[i].name, name )) return &ctl_settings[i];
+    return NULL;
+}
+
+short
+CtlDevice(const char *name) {
+    for (short i=0;i<devices_count;i++) if (!strcmp( devices[i].name, name )) return i;
+    return -1;
+}
+
+/* carry out one command line into reply */
+void
+CtlCommand(const char *line, char *reply, size_t size) {
+    char cmd[16], a1[48], a2[16], a3[16], ts[30], json[1600], *end;
+    struct ctl_setting *st;
+    struct text t;
+    long v;
+    short n, d;
+
+    n = sscanf( line, "%15s %47s %15s %15s", cmd, a1, a2, a3 );
+    if (n < 1) {
+        snprintf( reply, size, "err empty command" );
+    }
+    else if (!strcmp( cmd, "get" ) && (n == 1)) {
+        if (!ProgramRunCycles) snprintf( reply, size, "err no cycle run yet" );
+        else {
+            SnapshotJSON( &snap_last, TextStart( &t, json, sizeof json ) );
+            snprintf( reply, size, "ok %s", json );
+        }
+    }
+    else if (!strcmp( cmd, "get" ) && (n == 2)) {
+        if ((st = CtlSetting( a1 )) == NULL) snprintf( reply, size, "err no setting %s", a1 );
+        else snprintf( reply, size, "ok %s=%d", st->name, *st->value );
+    }
+    else if (!strcmp( cmd, "set" ) && (n == 3)) {
+        v = strtol( a2, &end, 10 );
+        if ((st = CtlSetting( a1 )) == NULL) snprintf( reply, size, "err no setting %s", a1 );
+        else if (*end || (end == a2) || (v < st->min) || (v > st->max))
+            snprintf( reply, size, "err %s takes %d..%d", st->name, st->min, st->max );
+        else {
+            *st->value = v;
+            /* the settings HA can override are taken back to these when its file is gone */
+            if (st->value == &cfg.use_acs) acs_allowed_original = v;
+            if (st->value == &cfg.use_electric_heater_day) boiler_allowed_original = v;
+            SetNightEnergyTemp();
+            snprintf( reply, size, "ok %s=%d", st->name, *st->value );
+        }
+    }
+    else if (!strcmp( cmd, "force" ) && (n >= 3)) {
+        v = (n == 4) ? strtol( a3, &end, 10 ) : 0;
+        if ((d = CtlDevice( a1 )) < 0) snprintf( reply, size, "err no device %s", a1 );
+        else if (!strcmp( a2, "auto" ) && (n == 3)) {
+            forced_on &= ~devices[d].bit;
+            forced_off &= ~devices[d].bit;
+            snprintf( reply, size, "ok %s auto", devices[d].name );
+        }
+        else if ((strcmp( a2, "on" ) && strcmp( a2, "off" )) || (n != 4) || *end || (v < 1) || (v > CTL_MAX_FORCE_MIN))
+            snprintf( reply, size, "err force %s on|off 1..%d minutes, or auto", devices[d].name, CTL_MAX_FORCE_MIN );
+        else {
+            forced_on &= ~devices[d].bit;
+            forced_off &= ~devices[d].bit;
+            if (!strcmp( a2, "on" )) forced_on |= devices[d].bit;
+            else forced_off |= devices[d].bit;
+            forced_until[d] = time(NULL) + v*60;
+            strftime( ts, sizeof ts, "%F %T", localtime( &forced_until[d] ) );
+            snprintf( reply, size, "ok %s forced %s until %s", devices[d].name, a2, ts );
+        }
+    }
+    else if (!strcmp( cmd, "forces" ) && (n == 1)) {
+        TextStart( &t, reply, size );
+        TextAdd( &t, "ok" );
+        for (d=0;d<devices_count;d++) {
+            if (!((forced_on | forced_off) & devices[d].bit)) continue;
+            strftime( ts, sizeof ts, "%F %T", localtime( &forced_until[d] ) );
+            TextAdd( &t, " " );
+            TextAdd( &t, devices[d].name );
+            TextAdd( &t, (forced_on & devices[d].bit) ? "=on@" : "=off@" );
+            TextAdd( &t, ts );
+        }
+        if (!(forced_on | forced_off)) TextAdd( &t, " none" );
+    }
+    else snprintf( reply, size, "err commands: get [setting], set setting value, force device on|off minutes,"\
+         " force device auto, forces" );
+}
+
+void
+CtlRecv(int fd) {
+    struct ctl_client *c = NULL;
+    char reply[1700], msg[300], *nl;
+    ssize_t n;
+
+    for (short i=0;i<MAXCTLCLIENTS;i++) if (ctl_clients[i].fd == fd) c = &ctl_clients[i];
+    if (c == NULL) return;
+    n = recv( fd, c->buf + c->len, sizeof c->buf - 1 - c->len, MSG_DONTWAIT );
+    if (n <= 0) {
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) return;
+        CtlClose( c );
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = 0;
+    while ((c->fd >= 0) && ((nl = strchr( c->buf, '\n' )) != NULL)) {
+        *nl = 0;
+        if ((nl > c->buf) && (nl[-1] == '\r')) nl[-1] = 0;
+        CtlCommand( c->buf, reply, sizeof reply );
+        snprintf( msg, sizeof msg, "INFO: Control from pid %d uid %d: %.60s -> %.80s", c->pid, c->uid, c->buf, reply );
+        log_message(LOG_FILE, msg);
+        CtlReply( c, reply );
+        c->len -= nl + 1 - c->buf;
+        memmove( c->buf, nl + 1, c->len + 1 );
+    }
+    if ((c->fd >= 0) && (c->len >= (short)sizeof c->buf - 1)) {
+        CtlReply( c, "err line too long" );
+        if (c->fd >= 0) CtlClose( c );
+    }
+}
+
+void
+CtlAccept(int fd) {
+    struct ctl_client *c = NULL;
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    int cfd;
+
+    cfd = accept4( fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC );
+    if (cfd < 0) return;
+    for (short i=0;i<MAXCTLCLIENTS;i++) if (ctl_clients[i].fd < 0) c = &ctl_clients[i];
+    if ((c == NULL) || !WatchFd( cfd, CtlRecv )) {
+        send( cfd, "err busy\n", 9, MSG_DONTWAIT|MSG_NOSIGNAL );
+        close( cfd );
+        return;
+    }
+    c->fd = cfd;
+    c->len = 0;
+    c->pid = -1;
+    c->uid = -1;
+    if (!getsockopt( cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len )) {
+        c->pid = cred.pid;
+        c->uid = cred.uid;
+    }
+}
+
+/* listen on CONTROL_SOCKET - for root only; hwwm runs on without it if that fails */
+void
+CtlStart() {
+    struct sockaddr_un sa;
+    char msg[200];
+    mode_t mask;
+    int err;
+
+    for (short i=0;i<MAXCTLCLIENTS;i++) ctl_clients[i].fd = -1;
+    memset( &sa, 0, sizeof sa );
+    sa.sun_family = AF_UNIX;
+    strncpy( sa.sun_path, CONTROL_SOCKET, sizeof sa.sun_path - 1 );
+    /* one left by an earlier hwwm - also the one a hand over came from */
+    unlink( CONTROL_SOCKET );
+    ctl_fd = socket( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if (ctl_fd < 0) goto fail;
+    mask = umask( 077 );
+    err = bind( ctl_fd, (struct sockaddr *)&sa, sizeof sa );
+    umask( mask );
+    if (err || listen( ctl_fd, MAXCTLCLIENTS ) || !WatchFd( ctl_fd, CtlAccept )) goto fail;
+    log_message(LOG_FILE, "INFO: Control socket listening on "CONTROL_SOCKET);
+    return;
+
+fail:
+    sprintf( msg, "WARNING: Cannot listen on "CONTROL_SOCKET" (%s) - running without the control socket.", strerror(errno) );
+    log_message(LOG_FILE, msg);
+    if (ctl_fd >= 0) close( ctl_fd );
+    ctl_fd = -1;
+}
+#endif
+
+#ifndef HWWM_LIB
+/* MQTT: hwwm is a client of an MQTT 3.1.1 broker, for Home Assistant. Every mqtt_every cycles
+   it publishes, retained, the snapshot of the cycle as JSON to <prefix>/state, and the settings
+   HA can change to <prefix>/target_temp, <prefix>/acs_allowed and <prefix>/boiler_allowed;
+   HA changes them by publishing to the same topics with "/set" added - what it put in
+   HA_SETTINGS_FILE before, which is not read once a setting came over MQTT, until the config
+   is read again; an empty or "auto" target gives it back to the heating curve. <prefix>/status
+   is "online", or "offline" as the will. HA discovery configs go to <discovery>/... on every
+   connect, so the entities show up by themselves.
+   Nothing waits on the broker: it is connected to without blocking and heard in CycleSleep(),
+   and what it does not take in at once goes out in the next cycles. A broker given by name
+   would need a lookup that can hold up the cycle - so only ip[:port] */
+#define MQTT_PORT           1883
+#define MQTT_KEEPALIVE_S    60
+#define MQTT_RETRY_S        30
+#define MQTT_TX             16384
+#define MQTT_RX             2048
+
+HWWM_TLS int mqtt_fd = -1;
+HWWM_TLS short mqtt_connecting = 0;
+HWWM_TLS short mqtt_up = 0;                 /* the broker took the CONNECT */
+HWWM_TLS short mqtt_fail_logged = 0;
+HWWM_TLS char mqtt_spec[MAXLEN];            /* mqtt_broker connected to */
+HWWM_TLS struct timespec mqtt_opened, mqtt_heard, mqtt_pinged;
+HWWM_TLS unsigned char mqtt_tx[MQTT_TX];
+HWWM_TLS size_t mqtt_tx_len = 0;
+HWWM_TLS unsigned char mqtt_rx[MQTT_RX];
+HWWM_TLS size_t mqtt_rx_len = 0;
+HWWM_TLS unsigned long mqtt_cycles = 0;
+HWWM_TLS char mqtt_node[MAXLEN];            /* mqtt_prefix fit for ids */
+
+void
+MqttClose() {
+    if (mqtt_fd < 0) return;
+    UnwatchFd( mqtt_fd );
+    close( mqtt_fd );
+    mqtt_fd = -1;
+    mqtt_connecting = 0;
+    mqtt_up = 0;
+    mqtt_tx_len = 0;
+    mqtt_rx_len = 0;
+}
+
+/* drop the connection, telling why once - it is tried again every MQTT_RETRY_S */
+void
+MqttLost(const char *why) {
+    char msg[200];
+
+    if (mqtt_up || !mqtt_fail_logged) {
+        sprintf( msg, "WARNING: MQTT broker %s: %s - retrying every %d s", cfg.mqtt_broker, why, MQTT_RETRY_S );
+        log_message(LOG_FILE, msg);
+        mqtt_fail_logged = 1;
+    }
+    MqttClose();
+}
+
+/* queue a packet - fixed header, remaining length, body; 0 if it does not fit */
+short
+MqttQueue(unsigned char type, const unsigned char *body, size_t n) {
+    unsigned char len[4];
+    size_t rl = n;
+    short k = 0;
+
+    do {
+        len[k] = rl % 128;
+        rl /= 128;
+        if (rl) len[k] |= 128;
+        k++;
+    } while (rl && (k < 4));
+    if (mqtt_tx_len + 1 + k + n > sizeof mqtt_tx) return 0;
+    mqtt_tx[mqtt_tx_len++] = type;
+    memcpy( mqtt_tx + mqtt_tx_len, len, k );
+    mqtt_tx_len += k;
+    if (n) memcpy( mqtt_tx + mqtt_tx_len, body, n );
+    mqtt_tx_len += n;
+    return 1;
+}
+
+/* append a string with its 2 byte length */
+void
+MqttString(unsigned char *b, size_t *n, const char *s) {
+    size_t l = strlen(s);
+
+    b[(*n)++] = l >> 8;
+    b[(*n)++] = l & 255;
+    memcpy( b + *n, s, l );
+    *n += l;
+}
+
+short
+MqttPublish(const char *topic, const char *payload, short retain) {
+    unsigned char b[2048];
+    size_t n = 0, l = strlen(payload);
+
+    if (strlen(topic) + 2 + l > sizeof b) return 0;
+    MqttString( b, &n, topic );
+    memcpy( b + n, payload, l );
+    return MqttQueue( retain ? 0x31 : 0x30, b, n + l );
+}
+
+/* <prefix>/<what> */
+char *
+MqttTopic(char *topic, const char *what) {
+    sprintf( topic, "%s/%s", cfg.mqtt_prefix, what );
+    return topic;
+}
+
+void
+MqttConnect() {
+    unsigned char b[512];
+    char id[24], will[MAXLEN+16];
+    unsigned char flags = 0x02|0x04|0x20;   /* clean session, a will, retained */
+    size_t n = 0;
+
+    if (cfg.mqtt_user[0]) flags |= 0x80;
+    if (cfg.mqtt_user[0] && cfg.mqtt_password[0]) flags |= 0x40;
+    MqttString( b, &n, "MQTT" );
+    b[n++] = 4;
+    b[n++] = flags;
+    b[n++] = MQTT_KEEPALIVE_S >> 8;
+    b[n++] = MQTT_KEEPALIVE_S & 255;
+    /* 23 characters - all a broker has to take */
+    snprintf( id, sizeof id, "hwwm-%.18s", mqtt_node );
+    MqttString( b, &n, id );
+    MqttString( b, &n, MqttTopic( will, "status" ) );
+    MqttString( b, &n, "offline" );
+    if (flags & 0x80) MqttString( b, &n, cfg.mqtt_user );
+    if (flags & 0x40) MqttString( b, &n, cfg.mqtt_password );
+    MqttQueue( 0x10, b, n );
+}
+
+void
+MqttSubscribe() {
+    static const char *sets[3] = { "target_temp/set", "acs_allowed/set", "boiler_allowed/set" };
+    unsigned char b[3*(MAXLEN+24)+2];
+    char topic[MAXLEN+24];
+    size_t n = 0;
+
+    b[n++] = 0;
+    b[n++] = 1;         /* packet id */
+    for (short i=0;i<3;i++) {
+        MqttString( b, &n, MqttTopic( topic, sets[i] ) );
+        b[n++] = 0;     /* QoS 0 */
+    }
+    MqttQueue( 0x82, b, n );
+}
+
+/* one HA discovery config; extra is the entity specific part of it */
+void
+MqttDiscoveryOne(const char *component, const char *object, const char *name, const char *extra) {
+    char topic[2*MAXLEN+64], avty[MAXLEN+16], payload[1024];
+
+    snprintf( topic, sizeof topic, "%s/%s/%s/%s/config", cfg.mqtt_discovery, component, mqtt_node, object );
+    snprintf( payload, sizeof payload, "{\"name\":\"%s\",\"uniq_id\":\"%s_%s\",\"avty_t\":\"%s\",%s,"
+              "\"dev\":{\"ids\":[\"%s\"],\"name\":\"hwwm %s\",\"mf\":\"hwwm\",\"sw\":\"%s\"}}",
+              name, mqtt_node, object, MqttTopic( avty, "status" ), extra, mqtt_node, mqtt_node, PGMVER );
+    MqttPublish( topic, payload, 1 );
+}
+
+void
+MqttDiscovery() {
+    static const char *temps[TOTALSENSORS+1] = { "", "Tkotel", "Tkolektor", "TboilerH", "TboilerL", "Tenv" };
+    static const char *temp_names[TOTALSENSORS+1] = { "", "Furnace", "Solar collector", "Boiler high",
+                                                      "Boiler low", "Outside" };
+    static const char *ctrls[4] = { "PumpFurnace", "PumpSolar", "Valve", "Heater" };
+    static const char *ctrl_names[4] = { "Furnace pump", "Solar pump", "Valve", "Electric heater" };
+    char state[MAXLEN+16], set[MAXLEN+32], extra[600];
+    short i;
+
+    MqttTopic( state, "state" );
+    for (i=1;i<=TOTALSENSORS;i++) {
+        snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"val_tpl\":\"{{ value_json.%s }}\","
+                  "\"unit_of_meas\":\"\\u00b0C\",\"dev_cla\":\"temperature\",\"stat_cla\":\"measurement\"",
+                  state, temps[i] );
+        MqttDiscoveryOne( "sensor", temps[i], temp_names[i], extra );
+    }
+    snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"val_tpl\":\"{{ value_json.ElectricityUsed }}\","
+              "\"unit_of_meas\":\"Wh\",\"dev_cla\":\"energy\"", state );
+    MqttDiscoveryOne( "sensor", "ElectricityUsed", "Electricity used this month", extra );
+    snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"val_tpl\":\"{{ value_json.ElectricityCost }}\"", state );
+    MqttDiscoveryOne( "sensor", "ElectricityCost", "Electricity cost this month", extra );
+    for (i=0;i<4;i++) {
+        snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"val_tpl\":\"{{ value_json.%s }}\","
+                  "\"pl_on\":1,\"pl_off\":0", state, ctrls[i] );
+        MqttDiscoveryOne( "binary_sensor", ctrls[i], ctrl_names[i], extra );
+    }
+    snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"cmd_t\":\"%s\",\"min\":%d,\"max\":%d,\"step\":0.5,"
+              "\"unit_of_meas\":\"\\u00b0C\"", MqttTopic( state, "target_temp" ),
+              MqttTopic( set, "target_temp/set" ), CURVE_TARGET_MIN, CURVE_TARGET_MAX );
+    MqttDiscoveryOne( "number", "target_temp", "ACs water target", extra );
+    snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"cmd_t\":\"%s\"", MqttTopic( state, "acs_allowed" ),
+              MqttTopic( set, "acs_allowed/set" ) );
+    MqttDiscoveryOne( "switch", "acs_allowed", "ACs allowed", extra );
+    snprintf( extra, sizeof extra, "\"stat_t\":\"%s\",\"cmd_t\":\"%s\"", MqttTopic( state, "boiler_allowed" ),
+              MqttTopic( set, "boiler_allowed/set" ) );
+    MqttDiscoveryOne( "switch", "boiler_allowed", "Boiler heater allowed", extra );
+}
+
+/* the settings HA can change, as they are now */
+void
+MqttPublishSettings() {
+    char topic[MAXLEN+24], v[16];
+
+    sprintf( v, "%.1f", furnace_water_target );
+    MqttPublish( MqttTopic( topic, "target_temp" ), v, 1 );
+    MqttPublish( MqttTopic( topic, "acs_allowed" ), cfg.use_acs ? "ON" : "OFF", 1 );
+    MqttPublish( MqttTopic( topic, "boiler_allowed" ), cfg.use_electric_heater_day ? "ON" : "OFF", 1 );
+}
+
+/* the snapshot of the last cycle and the settings; the snapshot is JSON_FILE with its keys
+   quoted, and a value that is not a number (a rate with no history yet) as null */
+void
+MqttPublishState() {
+    char snap[1600], json[2400], topic[MAXLEN+24], *p, *q;
+    struct text t;
+
+    SnapshotJSON( &snap_last, TextStart( &t, snap, sizeof snap ) );
+    for (p=snap, q=json; *p && (q < json + sizeof json - 6); p++) {
+        if (*p == ':') *q++ = '"';
+        *q++ = *p;
+        if ((*p == '{') || (*p == ',')) *q++ = '"';
+        if ((*p == ':') && isalpha( (unsigned char)p[1 + strspn( p+1, " -" )] )) {
+            strcpy( q, "null" );
+            q += 4;
+            p += strcspn( p, ",}" ) - 1;
+        }
+    }
+    *q = 0;
+    MqttPublish( MqttTopic( topic, "state" ), json, 1 );
+    MqttPublishSettings();
+}
+
+/* ON/OFF or 1/0 as HA sends it; -1 if neither */
+short
+MqttOnOff(const char *v) {
+    if (!strcasecmp( v, "ON" ) || !strcmp( v, "1" )) return 1;
+    if (!strcasecmp( v, "OFF" ) || !strcmp( v, "0" )) return 0;
+    return -1;
+}
+
+/* a setting HA published; it holds until the config is read again or HA changes it */
+void
+MqttCommand(const char *topic, const char *v) {
+    char msg[300];
+    size_t l = strlen( cfg.mqtt_prefix );
+    const char *what = topic + l + 1;
+    float f;
+    char *end;
+    short on;
+
+    if (strncmp( topic, cfg.mqtt_prefix, l ) || (topic[l] != '/')) return;
+    if (!strcmp( what, "target_temp/set" ) && (!v[0] || !strcasecmp( v, "auto" ))) {
+        /* the target goes back to the heating curve */
+        ha_water_target = 0;
+        HeatCurveUpdate();
+    }
+    else if (!strcmp( what, "target_temp/set" )) {
+        f = strtof( v, &end );
+        if ((end == v) || *end || !(f >= CURVE_TARGET_MIN) || (f > CURVE_TARGET_MAX)) {
+            sprintf( msg, "WARNING: MQTT: target_temp %.20s ignored - takes %d..%d, or auto", v, CURVE_TARGET_MIN, CURVE_TARGET_MAX );
+            log_message(LOG_FILE, msg);
+            return;
+        }
+        ha_water_target = f;
+        furnace_water_target = f;
+    }
+    else if (!strcmp( what, "acs_allowed/set" ) || !strcmp( what, "boiler_allowed/set" )) {
+        if ((on = MqttOnOff( v )) < 0) {
+            sprintf( msg, "WARNING: MQTT: %.40s %.20s ignored - takes ON or OFF", what, v );
+            log_message(LOG_FILE, msg);
+            return;
+        }
+        if (what[0] == 'a') cfg.use_acs = on;
+        else cfg.use_electric_heater_day = on;
+    }
+    else return;
+    ha_pushed = 1;
+    sprintf( msg, "INFO: MQTT: %.40s %.20s -> ACs target temp=%5.3f, use ACs=%d, el. heater allowed=%d",
+             what, v, furnace_water_target, cfg.use_acs, cfg.use_electric_heater_day );
+    log_message(LOG_FILE, msg);
+    /* HA shows the change only once it comes back */
+    MqttPublishSettings();
+}
+
+/* one packet from the broker */
+void
+MqttPacket(unsigned char type, const unsigned char *b, size_t n) {
+    char topic[MAXLEN+32], v[32], msg[200];
+    size_t tl, at;
+
+    switch (type >> 4) {
+        case 2:     /* CONNACK */
+            if ((n < 2) || b[1]) {
+                sprintf( msg, "connection refused, code %d", (n < 2) ? -1 : b[1] );
+                MqttLost( msg );
+                return;
+            }
+            sprintf( msg, "INFO: MQTT connected to %s, publishing to %s/", cfg.mqtt_broker, cfg.mqtt_prefix );
+            log_message(LOG_FILE, msg);
+            mqtt_up = 1;
+            mqtt_fail_logged = 0;
+            clock_gettime( CLOCK_MONOTONIC, &mqtt_pinged );
+            MqttSubscribe();
+            MqttPublish( MqttTopic( topic, "status" ), "online", 1 );
+            MqttDiscovery();
+            /* the state goes out with the next cycle */
+            mqtt_cycles = 0;
+            break;
+        case 3:     /* PUBLISH */
+            if (n < 2) return;
+            tl = (b[0] << 8) | b[1];
+            at = 2 + tl + (((type >> 1) & 3) ? 2 : 0);
+            if ((at > n) || (tl >= sizeof topic) || (n - at >= sizeof v)) return;
+            memcpy( topic, b + 2, tl );
+            topic[tl] = 0;
+            memcpy( v, b + at, n - at );
+            v[n - at] = 0;
+            MqttCommand( topic, v );
+            break;
+        /* SUBACK, PINGRESP - being heard is all they tell */
+    }
+}
+
+/* read what the broker sent and take the packets out of it */
+void
+MqttRecv(int fd) {
+    size_t rl, mult, k;
+    ssize_t n;
+
+    n = recv( fd, mqtt_rx + mqtt_rx_len, sizeof mqtt_rx - mqtt_rx_len, MSG_DONTWAIT );
+    if (n <= 0) {
+        if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) return;
+        MqttLost( n ? strerror(errno) : "connection closed" );
+        return;
+    }
+    mqtt_rx_len += n;
+    clock_gettime( CLOCK_MONOTONIC, &mqtt_heard );
+    while (mqtt_rx_len >= 2) {
+        for (k=1, rl=0, mult=1;;k++) {
+            if (k >= mqtt_rx_len) return;   /* the rest comes later */
+            if (k > 4) {
+                MqttLost( "bad packet" );
+                return;
+            }
+            rl += (mqtt_rx[k] & 127) * mult;
+            mult *= 128;
+            if (!(mqtt_rx[k] & 128)) break;
+        }
+        if (k + 1 + rl > sizeof mqtt_rx) {
+            MqttLost( "packet too big" );
+            return;
+        }
+        if (k + 1 + rl > mqtt_rx_len) return;
+        MqttPacket( mqtt_rx[0], mqtt_rx + k + 1, rl );
+        if (mqtt_fd < 0) return;
+        mqtt_rx_len -= k + 1 + rl;
+        memmove( mqtt_rx, mqtt_rx + k + 1 + rl, mqtt_rx_len );
+    }
+}
+
+/* send what the broker takes in now; the rest waits for the next cycle */
+void
+MqttFlush() {
+    ssize_t n;
+
+    if ((mqtt_fd < 0) || mqtt_connecting || !mqtt_tx_len) return;
+    n = send( mqtt_fd, mqtt_tx, mqtt_tx_len, MSG_DONTWAIT|MSG_NOSIGNAL );
+    if (n > 0) {
+        mqtt_tx_len -= n;
+        memmove( mqtt_tx, mqtt_tx + n, mqtt_tx_len );
+    }
+    else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) MqttLost( strerror(errno) );
+}
+
+/* start connecting to mqtt_broker: ip[:port] */
+short
+MqttOpen() {
+    char spec[MAXLEN], *colon, *p;
+    struct sockaddr_in sin;
+
+    /* tried again MQTT_RETRY_S from now, whatever comes of it */
+    clock_gettime( CLOCK_MONOTONIC, &mqtt_opened );
+    strcpy( spec, cfg.mqtt_broker );
+    strcpy( mqtt_node, cfg.mqtt_prefix );
+    for (p=mqtt_node;*p;p++) if (!isalnum( (unsigned char)*p )) *p = '_';
+    memset( &sin, 0, sizeof sin );
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons( MQTT_PORT );
+    colon = strchr( spec, ':' );
+    if (colon) {
+        *colon = 0;
+        sin.sin_port = htons( atoi(colon+1) );
+    }
+    if (!inet_aton( spec, &sin.sin_addr )) {
+        errno = EINVAL;
+        return 0;
+    }
+    mqtt_fd = socket( AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+    if (mqtt_fd < 0) return 0;
+    if (connect( mqtt_fd, (struct sockaddr *)&sin, sizeof sin )) {
+        if (errno != EINPROGRESS) {
+            int e = errno;
+            close( mqtt_fd );
+            mqtt_fd = -1;
+            errno = e;
+            return 0;
+        }
+    }
+    /* MqttUpdate() sends the CONNECT once connected */
+    mqtt_connecting = 1;
+    return 1;
+}
+
+/* keep the broker connection up and publish the state; once per cycle */
+void
+MqttUpdate() {
+    char msg[200];
+    struct pollfd pfd;
+    int err = 0;
+    socklen_t len = sizeof err;
+
+    /* mqtt_broker changed by a config re-read - the new one is tried at once */
+    if (strcmp( mqtt_spec, cfg.mqtt_broker )) {
+        MqttClose();
+        strcpy( mqtt_spec, cfg.mqtt_broker );
+        mqtt_fail_logged = 0;
+        mqtt_opened.tv_sec = 0;
+    }
+    if (!cfg.mqtt_broker[0]) return;
+    if ((mqtt_fd < 0) && (!mqtt_opened.tv_sec || (ms_since( &mqtt_opened ) >= MQTT_RETRY_S*1000L))) {
+        if (!MqttOpen() && !mqtt_fail_logged) {
+            sprintf( msg, "WARNING: Cannot connect to MQTT broker %s (%s) - retrying every %d s",
+                     cfg.mqtt_broker, strerror(errno), MQTT_RETRY_S );
+            log_message(LOG_FILE, msg);
+            mqtt_fail_logged = 1;
+        }
+    }
+    if (mqtt_fd < 0) return;
+    if (mqtt_connecting) {
+        pfd.fd = mqtt_fd;
+        pfd.events = POLLOUT;
+        if (poll( &pfd, 1, 0 ) > 0) {
+            getsockopt( mqtt_fd, SOL_SOCKET, SO_ERROR, &err, &len );
+            if (err) {
+                errno = err;
+                MqttLost( strerror(err) );
+                return;
+            }
+            mqtt_connecting = 0;
+            if (!WatchFd( mqtt_fd, MqttRecv )) {
+                MqttLost( "no room to watch it" );
+                return;
+            }
+            clock_gettime( CLOCK_MONOTONIC, &mqtt_heard );
+            MqttConnect();
+        }
+        else if (ms_since( &mqtt_opened ) > 10000) {
+            MqttLost( "connect timed out" );
+            return;
+        }
+    }
+    else if (!mqtt_up) {
+        if (ms_since( &mqtt_heard ) > 10000) {
+            MqttLost( "no CONNACK" );
+            return;
+        }
+    }
+    else {
+        if (ms_since( &mqtt_heard ) > MQTT_KEEPALIVE_S*1500L) {
+            MqttLost( "not heard" );
+            return;
+        }
+        if (ms_since( &mqtt_pinged ) >= MQTT_KEEPALIVE_S*500L) {
+            MqttQueue( 0xC0, NULL, 0 );
+            clock_gettime( CLOCK_MONOTONIC, &mqtt_pinged );
+        }
+        /* a broker behind on what it was sent gets no new state until it catches up */
+        if (cfg.mqtt_every && !SinkWarmingUp( &snap_last ) && ((mqtt_cycles++ % cfg.mqtt_every) == 0) &&
+            (mqtt_tx_len < sizeof mqtt_tx / 2)) MqttPublishState();
+    }
+    MqttFlush();
+}
+#endif
+
+/* LOG KEEPER: a thread of low priority rotates DATA_FILE and LOG_FILE when they grow past their
+   size, or get older than their time, and gzips every closed segment to <archive>-YYYYmmdd-HHMMSS.gz
+   with the hwwm_history index next to it, so hwwm-query reads the segments as they are. A log is
+   rotated by renaming it to <log>.seg: writers open it anew for every line or batch, so the next
+   one starts a new log, and one that had it open just then still writes to the segment - which
+   is compressed KEEPER_GRACE_S later, and again if it grew meanwhile. It goes only once compressed,
+   and a log is not rotated while its previous segment is still there - so no line is lost, even
+   when the archive is full or hwwm stops half way; a segment left over is compressed at start */
+#define KEEPER_CHECK_S      30
+#define KEEPER_GRACE_S      2
+#define KEEPER_NICE         10
+#define KEEPER_TRIES        3
+
+struct kept_log
+{
+    const char *path;
+    const char *archive;
+    long    max_kb;             /* 0: not by size */
+    long    max_min;            /* 0: not by time */
+    time_t  started;
+    short   stuck;              /* its segment could not be compressed */
+};
+
+HWWM_TLS pthread_mutex_t keeper_lock = PTHREAD_MUTEX_INITIALIZER;
+HWWM_TLS struct kept_log kept_logs[2] = {
+    { DATA_FILE, DATA_ARCHIVE },
+    { LOG_FILE, LOG_FILE },
+};
+HWWM_TLS long keep_days = 0;
+
+/* take the rotation settings from the config */
+void
+LogsConfigure() {
+    char msg[160];
+
+    pthread_mutex_lock( &keeper_lock );
+    kept_logs[0].max_kb = cfg.data_log_rotate_kb;
+    kept_logs[0].max_min = cfg.data_log_rotate_min;
+    kept_logs[1].max_kb = cfg.log_rotate_kb;
+    kept_logs[1].max_min = 0;
+    keep_days = cfg.log_keep_days;
+    pthread_mutex_unlock( &keeper_lock );
+    sprintf( msg, "INFO: Logs rotate at: data %d KB or %d min, events %d KB; segments kept %d days (0 = OFF)",
+             cfg.data_log_rotate_kb, cfg.data_log_rotate_min, cfg.log_rotate_kb, cfg.log_keep_days );
+    log_message(LOG_FILE, msg);
+}
+
+/* item of a list: its index in names[], or for a number list its offset from 'first'; -1 if bad */
+short
+TariffListItem(const char *s, const char **names, short n, short first) {
+    short v;
+
+    if (names) {
+        for (v=0;v<n;v++) if (!strcmp( s, names[v] )) return v;
+        return -1;
+    }
+    if (!isdigit( (unsigned char)s[0] )) return -1;
+    v = atoi( s ) - first;
+    return ((v < 0) || (v >= n)) ? -1 : v;
+}
+
+/* bits of a list of items and ranges, e.g. "mon-fri,sun" or "11-3" - a range can wrap around;
+   names are bits 0..n-1, numbers are bits first..first+n-1; 0 if the list is bad */
+unsigned long
+TariffList(const char *s, const char **names, short n, short first) {
+    char buf[MAXLEN], *item, *save, *dash;
+    unsigned long bits = 0;
+    short a, b;
+
+    snprintf( buf, sizeof buf, "%s", s );
+    for (item=strtok_r( buf, ",", &save );item;item=strtok_r( NULL, ",", &save )) {
+        dash = strchr( item, '-' );
+        if (dash) *dash++ = 0;
+        a = TariffListItem( item, names, n, first );
+        b = dash ? TariffListItem( dash, names, n, first ) : a;
+        if ((a < 0) || (b < 0)) return 0;
+        for (;;a=(a+1)%n) {
+            bits |= 1UL << (a + (names ? 0 : first));
+            if (a == b) break;
+        }
+    }
+    return bits;
+}
+
+/* day bits of a rule: week days, "hol" for the holidays, "all" for any day */
+unsigned char
+TariffDays(const char *s) {
+    static const char *wdays[7] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+    char buf[MAXLEN], rest[MAXLEN], *item, *save;
+    unsigned char bits = 0;
+
+    if (!strcmp( s, "all" )) return 0x7f | TARIFF_HOLIDAY;
+    snprintf( buf, sizeof buf, "%s", s );
+    rest[0] = 0;
+    for (item=strtok_r( buf, ",", &save );item;item=strtok_r( NULL, ",", &save )) {
+        if (!strcmp( item, "hol" )) bits |= TARIFF_HOLIDAY;
+        else sprintf( rest + strlen(rest), "%s%s", rest[0] ? "," : "", item );
+    }
+    if (rest[0]) {
+        unsigned long w = TariffList( rest, wdays, 7, 0 );
+        if (!w) return 0;
+        bits |= w;
+    }
+    return bits;
+}
+
+/* compile the tariff settings into the calendar; bad parts are left out with a warning */
+void
+TariffCompile() {
+    struct tariff_calendar *c = tariff;
+    struct tariff_rule *r;
+    char msg[300], buf[MAXLEN], days[MAXLEN], rate[MAXLEN], months[MAXLEN], *item, *save;
+    int h1, m1, h2, m2, mon, day, n;
+    float price;
+    short k, i;
+
+    c->rates_count = 0;
+    c->rules_count = 0;
+    c->holidays_count = 0;
+    c->base = 0;
+    /* rates are name:price pairs */
+    snprintf( buf, sizeof buf, "%s", cfg.tariff_rates );
+    for (item=strtok_r( buf, ",", &save );item && (c->rates_count < MAXTARIFFRATES);item=strtok_r( NULL, ",", &save )) {
+        if ((sscanf( item, " %15[^:]:%f", c->names[c->rates_count], &price ) != 2) || (price < 0)) {
+            sprintf( msg, "WARNING: Tariff rate '%s' should be name:price - ignoring it.", item );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        c->rates[c->rates_count++] = price;
+    }
+    if (!c->rates_count) {
+        strcpy( c->names[0], "day" );
+        c->rates[0] = 0;
+        c->rates_count = 1;
+    }
+    /* holidays are MM-DD dates */
+    snprintf( buf, sizeof buf, "%s", cfg.tariff_holidays );
+    for (item=strtok_r( buf, ", ", &save );item && (c->holidays_count < MAXHOLIDAYS);item=strtok_r( NULL, ", ", &save )) {
+        if ((sscanf( item, "%d-%d", &mon, &day ) != 2) || (mon < 1) || (mon > 12) || (day < 1) || (day > 31)) {
+            sprintf( msg, "WARNING: Tariff holiday '%s' should be MM-DD - ignoring it.", item );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        c->holidays[c->holidays_count++] = mon*100 + day;
+    }
+    /* rules are "days HH:MM-HH:MM rate [months]" - a later rule wins over an earlier one */
+    for (k=0;k<MAXTARIFFRULES;k++) {
+        if (!cfg.tariff_rule[k][0]) continue;
+        r = &c->rules[c->rules_count];
+        n = sscanf( cfg.tariff_rule[k], "%79s %d:%d-%d:%d %79s %79s", days, &h1, &m1, &h2, &m2, rate, months );
+        for (i=0;(n >= 6) && (i<c->rates_count);i++) if (!strcmp( rate, c->names[i] )) break;
+        if ((n < 6) || (i == c->rates_count) || (h1 < 0) || (h1 > 23) || (m1 < 0) || (m1 > 59) ||
+            (h2 < 0) || (h2 > 24) || (m2 < 0) || (m2 > 59) || (h2*60+m2 > 24*60) ||
+            !(r->days = TariffDays( days )) ||
+            !(r->months = (n == 7) ? TariffList( months, NULL, 12, 1 ) : 0x1ffe)) {
+            sprintf( msg, "WARNING: tariff_rule_%d should be days HH:MM-HH:MM rate [months] with a rate"\
+            " from tariff_rates - ignoring it.", k+1 );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        r->start = h1*60 + m1;
+        r->stop = (h2*60 + m2) % (24*60);
+        r->rate = i;
+        c->rules_count++;
+    }
+    sprintf( msg, "INFO: Tariff: %d rules, %d holidays, rates:", c->rules_count, c->holidays_count );
+    for (i=0;i<c->rates_count;i++)
+        sprintf( msg + strlen(msg), " %s=%.3f%s", c->names[i], c->rates[i], (c->rates[i] < c->rates[0]) ? " (cheap)" : "" );
+    log_message(LOG_FILE, msg);
+}
+
+/* day bits and month bit of a date, for matching it against the rules */
+void
+TariffDayOf(const struct tm *tm, unsigned char *day, unsigned short *month) {
+    *day = 1 << tm->tm_wday;
+    for (short i=0;i<tariff->holidays_count;i++)
+        if (tariff->holidays[i] == (tm->tm_mon+1)*100 + tm->tm_mday) *day = TARIFF_HOLIDAY;
+    *month = 1 << (tm->tm_mon+1);
+}
+
+/* fill the table with the rate of each minute from 'now' on; local time of every minute is
+   taken on its own, so DST changes fall where they happen. The part of a rule past midnight
+   belongs to the day it started on - "fri 22:00-06:00" is cheap until Saturday 6:00. */
+void
+TariffBuild(time_t now) {
+    struct tariff_calendar *c = tariff;
+    const struct tariff_rule *r;
+    struct tm tm, ytm;
+    unsigned char day = 0, yday = 0;
+    unsigned short month = 0, ymonth = 0;
+    short m, k, mod, in, mday = -1;
+    time_t t;
+
+    c->base = now - now % 60;
+    for (m=0;m<TARIFF_LUT_MIN;m++) {
+        t = c->base + (time_t)m*60;
+        localtime_r( &t, &tm );
+        mod = tm.tm_hour*60 + tm.tm_min;
+        if (tm.tm_mday != mday) {
+            if (mday < 0) {
+                /* two hours more than the wall clock minutes is the day before, DST or not */
+                t -= (time_t)(mod + 121)*60;
+                localtime_r( &t, &ytm );
+                TariffDayOf( &ytm, &yday, &ymonth );
+            }
+            else {
+                yday = day;
+                ymonth = month;
+            }
+            TariffDayOf( &tm, &day, &month );
+            mday = tm.tm_mday;
+        }
+        c->rate[m] = 0;
+        for (k=0;k<c->rules_count;k++) {
+            r = &c->rules[k];
+            if (r->start < r->stop) in = (mod >= r->start) && (mod < r->stop) ? 1 : 0;
+            else if ((r->start == r->stop) || (mod >= r->start)) in = 1;
+            else in = (mod < r->stop) ? 2 : 0;
+            if ((in == 1) && (r->days & day) && (r->months & month)) c->rate[m] = r->rate;
+            if ((in == 2) && (r->days & yday) && (r->months & ymonth)) c->rate[m] = r->rate;
+        }
+    }
+    for (m=TARIFF_LUT_MIN-1;m>=0;m--) {
+        c->left[m] = 1;
+        if ((m+1 < TARIFF_LUT_MIN) && ((c->rates[c->rate[m+1]] < c->rates[0]) == (c->rates[c->rate[m]] < c->rates[0])))
+            c->left[m] += c->left[m+1];
+    }
+}
+
+/* minute of cycle_time in the table - it is built anew when less than a day is left ahead */
+short
+TariffMinute() {
+    time_t m = (cycle_time - tariff->base) / 60;
+
+    if (!tariff->base || (cycle_time < tariff->base) || (m >= TARIFF_LUT_MIN/2)) {
+        TariffBuild( cycle_time );
+        m = 0;
+    }
+    return m;
+}
+
+/* rate of the current minute */
+short
+TariffRate() {
+    return tariff->rate[TariffMinute()];
+}
+
+/* the current rate is cheaper than the default one - what was the night tariff */
+short
+TariffCheap() {
+    return tariff->rates[TariffRate()] < tariff->rates[0];
+}
+
+/* minutes left until the rate stops being cheap, or until it gets cheap */
+float
+TariffLeft() {
+    return tariff->left[TariffMinute()] - (float)(cycle_time % 60)/60;
+}
+
+#ifndef HWWM_LIB
+/* time of a line starting with a log_message() timestamp; -1 for other lines */
+time_t
+KeeperLineTime(const char *line) {
+    struct tm tm;
+
+    memset( &tm, 0, sizeof tm );
+    if (sscanf( line, "%4d-%2d-%2d %2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec ) != 6) return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    tm.tm_isdst = -1;
+    return mktime( &tm );
+}
+
+/* run the deflate stream with flush, writing out what comes; return 0 on error */
+short
+KeeperDeflate(z_stream *z, FILE *out, int flush) {
+    unsigned char buf[16384];
+    size_t n;
+
+    do {
+        z->next_out = buf;
+        z->avail_out = sizeof buf;
+        if (deflate( z, flush ) == Z_STREAM_ERROR) return 0;
+        n = sizeof buf - z->avail_out;
+        if (fwrite( buf, 1, n, out ) != n) return 0;
+    } while (z->avail_out == 0);
+    return -1;
+}
+
+/* gzip seg to gz, with a full flush and an index entry before the first stamped line after
+   every HH_INDEX_STRIDE bytes; return the bytes of seg compressed, or -1 on failure */
+long
+KeeperCompress(const char *seg, const char *gz) {
+    char tmp[MAXLEN+16], idx[MAXLEN+16], *line = NULL;
+    struct hh_idx_header h;
+    struct stat st;
+    long long *pairs = NULL, *p;
+    long long pos = 0, next_mark = 0, count = 0;
+    size_t cap = 0;
+    ssize_t len;
+    time_t t;
+    short ok = -1;
+    FILE *in, *out, *fi;
+    z_stream z;
+
+    snprintf( tmp, sizeof tmp, "%s.tmp", gz );
+    snprintf( idx, sizeof idx, "%s.idx", gz );
+    in = fopen( seg, "r" );
+    if (in == NULL) return -1;
+    out = fopen( tmp, "w" );
+    if (out == NULL) { fclose( in ); return -1; }
+    memset( &z, 0, sizeof z );
+    if (deflateInit2( &z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS+16, 8, Z_DEFAULT_STRATEGY ) != Z_OK) {
+        fclose( in );
+        fclose( out );
+        unlink( tmp );
+        return -1;
+    }
+    memset( &h, 0, sizeof h );
+    while (ok && ((len = getline( &line, &cap, in )) > 0)) {
+        if (((t = KeeperLineTime( line )) != -1) && (pos >= next_mark)) {
+            /* index times do not go back - the binary search of hwwm-query needs that */
+            if (count && (t < h.last_t)) t = h.last_t;
+            /* the first entry is the start of the file; the others start a raw deflate stream */
+            if (pos) ok = KeeperDeflate( &z, out, Z_FULL_FLUSH );
+            if ((count % 256) == 0) {
+                p = realloc( pairs, (count + 256) * 2 * sizeof *pairs );
+                if (p == NULL) { ok = 0; break; }
+                pairs = p;
+            }
+            pairs[count*2] = t;
+            pairs[count*2+1] = pos ? (long long)z.total_out : 0;
+            if (!count++) h.first_t = t;
+            next_mark = (pos / HH_INDEX_STRIDE + 1) * HH_INDEX_STRIDE;
+        }
+        if ((t != -1) && (t > h.last_t)) h.last_t = t;
+        z.next_in = (unsigned char *)line;
+        z.avail_in = len;
+        if (ok) ok = KeeperDeflate( &z, out, Z_NO_FLUSH );
+        pos += len;
+    }
+    if (ok) ok = KeeperDeflate( &z, out, Z_FINISH );
+    deflateEnd( &z );
+    free( line );
+    fclose( in );
+    /* the segment is only let go once its archive is safe on the card */
+    if (ok && (fflush( out ) || fsync( fileno(out) ) || fstat( fileno(out), &st ))) ok = 0;
+    if ((fclose( out ) != 0) || !ok || rename( tmp, gz )) {
+        unlink( tmp );
+        free( pairs );
+        return -1;
+    }
+
+    /* the index: without it hwwm-query still reads the segment, from its start */
+    memcpy( h.magic, HH_IDX_MAGIC, 8 );
+    h.ino = st.st_ino;
+    h.indexed_size = st.st_size;
+    h.count = count;
+    fi = fopen( idx, "w" );
+    if (fi != NULL) {
+        fwrite( &h, sizeof h, 1, fi );
+        if (count) fwrite( pairs, 2 * sizeof *pairs, count, fi );
+        if (fclose( fi )) unlink( idx );
+    }
+    free( pairs );
+    return pos;
+}
+
+/* drop the archive of a segment that is compressed again, and its index */
+void
+KeeperDrop(const char *gz) {
+    char idx[MAXLEN+16];
+
+    snprintf( idx, sizeof idx, "%s.idx", gz );
+    unlink( gz );
+    unlink( idx );
+}
+
+/* compress a closed segment of a log into its archive, then remove it; return 0 if it stays */
+short
+KeeperSegment(struct kept_log *l, const char *seg) {
+    char gz[MAXLEN], stamp[20], msg[300];
+    struct stat st;
+    struct tm tm;
+    long done = -1;
+
+    sleep( KEEPER_GRACE_S );
+    for (short tries=0;tries<KEEPER_TRIES;tries++) {
+        /* the archive of the try before is short of what the segment grew by - and the next
+           one may be named after another second; only one archive of a segment is kept */
+        if (done >= 0) KeeperDrop( gz );
+        if (stat( seg, &st )) return -1;
+        /* named after its last line */
+        localtime_r( &st.st_mtime, &tm );
+        strftime( stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm );
+        snprintf( gz, sizeof gz, "%s-%s.gz", l->archive, stamp );
+        done = KeeperCompress( seg, gz );
+        if (done < 0) break;
+        /* a writer got a line in while it was being compressed - do it again */
+        if (stat( seg, &st ) || (st.st_size == done)) {
+            unlink( seg );
+            if (l->stuck) {
+                sprintf( msg, "INFO: Compressed %.60s to %.80s - rotating again.", seg, gz );
+                log_message(LOG_FILE, msg);
+            }
+            l->stuck = 0;
+            return -1;
+        }
+    }
+    /* the segment stays, to be compressed whole later */
+    if (done >= 0) KeeperDrop( gz );
+    if (!l->stuck) {
+        sprintf( msg, "WARNING: Cannot compress %.60s to %.80s - keeping it, and the log as it is.", seg, gz );
+        log_message(LOG_FILE, msg);
+    }
+    l->stuck = 1;
+    return 0;
+}
+
+/* remove the archived segments of a log older than days */
+void
+KeeperPrune(const struct kept_log *l, long days, time_t now) {
+    char dir[MAXLEN], path[MAXLEN+300], *base;
+    struct dirent *e;
+    struct stat st;
+    size_t n;
+    DIR *d;
+
+    snprintf( dir, sizeof dir, "%s", l->archive );
+    base = strrchr( dir, '/' );
+    if (base == NULL) return;
+    *base++ = 0;
+    n = strlen( base );
+    d = opendir( dir[0] ? dir : "/" );
+    if (d == NULL) return;
+    while ((e = readdir( d )) != NULL) {
+        /* <archive>-YYYYmmdd-HHMMSS.gz and its .idx */
+        if (strncmp( e->d_name, base, n ) || (e->d_name[n] != '-') || !strstr( e->d_name + n, ".gz" )) continue;
+        snprintf( path, sizeof path, "%s/%s", dir, e->d_name );
+        if (!stat( path, &st ) && (st.st_mtime < now - days*24*60*60)) unlink( path );
+    }
+    closedir( d );
+}
+
+void *
+LogKeeper(void *arg) {
+    struct kept_log l;
+    struct stat st;
+    char seg[MAXLEN+8];
+    time_t now, pruned = 0;
+    long days;
+    short i;
+
+    /* compressing is never more urgent than a control cycle */
+    setpriority( PRIO_PROCESS, syscall(SYS_gettid), KEEPER_NICE );
+    for (i=0;i<2;i++) {
+        snprintf( seg, sizeof seg, "%s.seg", kept_logs[i].path );
+        if (!access( seg, F_OK )) KeeperSegment( &kept_logs[i], seg );
+        kept_logs[i].started = time(NULL);
+    }
+    while (1) {
+        sleep( KEEPER_CHECK_S );
+        now = time(NULL);
+        for (i=0;i<2;i++) {
+            pthread_mutex_lock( &keeper_lock );
+            l = kept_logs[i];
+            pthread_mutex_unlock( &keeper_lock );
+            if (stat( l.path, &st ) || !st.st_size) continue;
+            if (!(l.max_kb && (st.st_size >= l.max_kb*1024)) && !(l.max_min && (now - l.started >= l.max_min*60))) continue;
+            snprintf( seg, sizeof seg, "%s.seg", l.path );
+            /* the previous segment first - while it is there, the log just goes on */
+            if (!access( seg, F_OK ) && !KeeperSegment( &kept_logs[i], seg )) continue;
+            if (rename( l.path, seg )) continue;
+            kept_logs[i].started = now;
+            KeeperSegment( &kept_logs[i], seg );
+        }
+        pthread_mutex_lock( &keeper_lock );
+        days = keep_days;
+        pthread_mutex_unlock( &keeper_lock );
+        if (days && (now - pruned >= 60*60)) {
+            pruned = now;
+            for (i=0;i<2;i++) KeeperPrune( &kept_logs[i], days, now );
+        }
+    }
+    return NULL;
+}
+
+/* start the log keeper; return 0 on error */
+short
+LogsStart() {
+    pthread_t keeper;
+
+    if (pthread_create( &keeper, NULL, LogKeeper, NULL )) return 0;
+    pthread_detach( keeper );
+    return -1;
+}
+#endif
+
+unsigned short ValveIsFullyOpen() {
+    if (CValve && (SCValve > 13)) return 1;
+    else return 0;
+}
+
+unsigned short ValveIsFullyClosed() {
+    if (!CValve && (SCValve > 15)) return 1;
+    else return 0;
+}
+
+/* the interlocks of the built-in devices, on top of their min on/off times */
+unsigned short Pump1MayTurnOn() {
+    return cfg.use_pump1;
+}
+
+unsigned short Pump1MayTurnOff() {
+    if (!CValve && !CHP_low && (SCValve > 5)) return 1;
+    else return 0;
+}
+
+unsigned short Pump2MayTurnOn() {
+    return cfg.use_pump2;
+}
+
+unsigned short HeaterMayTurnOn() {
+    if ((SCHP_low<2) || (SCHP_high<2)) return 0;
+    /* Do the check with config to see if its OK to use electric heater,
+    for example: if its on "night tariff" - switch it on */
+    /* Determine current tariff: */
+    if ( TariffCheap() ) {
+            /* NIGHT TARIFF TIME */
+            /* If heater use is allowed by config - turn it on */
+            if (cfg.use_electric_heater_night) return 1;
+    }
+    else {
+            /* DAY TIME */
+            /* If heater use is allowed by config - turn it on */
+            if (cfg.use_electric_heater_day) return 1;
+    }
+    return 0;
+}
+
+unsigned short HeatPumpLowMayTurnOn() {
+    if ((SCHeater > 2) && ((COMMS==1) || (COMMS==3))) return 1;
+    else return 0;
+}
+
+unsigned short HeatPumpLowMayTurnOff() {
+    if (!CHP_high && (SCHP_high>5) && (COMMS>=2))  return 1;
+    else return 0;
+}
+
+unsigned short HeatPumpHighMayTurnOn() {
+    if (CHP_low && (SCHP_low>3) && (SCHeater > 2) && ((COMMS==1) || (COMMS==3))) return 1;
+    else return 0;
+}
+
+unsigned short HeatPumpHighMayTurnOff() {
+    if (COMMS>=2)  return 1;
+    else return 0;
+}
+
+unsigned short DeviceCanTurnOn(const struct device *d) {
+    if (controls[d->ctrl] || (ctrlstatecycles[d->ctrl] < d->min_off)) return 0;
+    if (d->may_turn_on && !d->may_turn_on()) return 0;
+    return 1;
+}
+
+unsigned short DeviceCanTurnOff(const struct device *d) {
+    if (!controls[d->ctrl] || (ctrlstatecycles[d->ctrl] < d->min_on)) return 0;
+    if (d->may_turn_off && !d->may_turn_off()) return 0;
+    return 1;
+}
+
+void
+JournalHeader(struct hj_header *h) {
+    memset( h, 0, sizeof *h );
+    memcpy( h->magic, HJ_MAGIC, 8 );
+    h->rec_size = sizeof(struct hj_rec);
+    h->devices = devices_count;
+    for (short i=0;i<devices_count;i++) snprintf( h->names[i], HJ_NAMELEN, "%s", devices[i].name );
+}
+
+/* start a new journal, keeping the previous one as JOURNAL_FILE.1 */
+int
+JournalNew() {
+    struct hj_header h;
+    struct stat st;
+    int fd;
+
+    JournalHeader( &h );
+    if (!stat( JOURNAL_FILE, &st ) && st.st_size) rename( JOURNAL_FILE, JOURNAL_FILE".1" );
+    fd = open( JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if (fd < 0) return -1;
+    if (write( fd, &h, sizeof h ) != sizeof h) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+void
+JournalWrite(unsigned char dev, unsigned char from, unsigned char to, unsigned char reason, unsigned long ran) {
+    struct hj_rec r;
+    struct stat st;
+
+    if (journal_fd < 0) return;
+    memset( &r, 0, sizeof r );
+    r.t = cycle_time;
+    r.ran = ran;
+    r.dev = dev;
+    r.from = from;
+    r.to = to;
+    r.reason = reason;
+    if ((write( journal_fd, &r, sizeof r ) != sizeof r) && !journal_err_logged) {
+        log_message(LOG_FILE, "WARNING: Cannot write to "JOURNAL_FILE" - device transitions are not journaled.");
+        journal_err_logged = 1;
+    }
+    if (!fstat( journal_fd, &st ) && (st.st_size >= HJ_MAX_SIZE)) {
+        close( journal_fd );
+        journal_fd = JournalNew();
+    }
+}
+
+/* open the journal, starting a new one if it is full or names other devices; start-up only */
+void
+JournalOpen(short resumed) {
+    struct hj_header h, old;
+    struct stat st;
+
+    JournalHeader( &h );
+    journal_fd = open( JOURNAL_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+    if (journal_fd >= 0) {
+        if ((read( journal_fd, &old, sizeof old ) != sizeof old) || memcmp( &old, &h, sizeof h ) ||
+            fstat( journal_fd, &st ) || (st.st_size >= HJ_MAX_SIZE)) {
+            close( journal_fd );
+            journal_fd = JournalNew();
         }
-        /* among other things - manage power used counters; only check one
-        time during the day: at 8'something...*/
-        if (must_check) {
-            strftime( buff, sizeof buff, "%e", t_struct );
-            current_day_of_month = atoi( buff );
-            if (current_day_of_month == cfg.day_to_reset_Pcounters) {
-                /*...if it is the correct day of month - log gathered data and reset counters */
-                sprintf( buff, "INFO: Power used last month: nightly: %3.1f Wh, daily: %3.1f Wh;",
-                NightlyPowerUsed, (TotalPowerUsed-NightlyPowerUsed) );
-                log_message(LOG_FILE, buff);
-                sprintf( buff, "INFO: Total: %3.1f Wh. Power counters reset.", TotalPowerUsed );
-                log_message(LOG_FILE, buff);
-                TotalPowerUsed = 0;
-                NightlyPowerUsed = 0;
+    }
+    if (journal_fd < 0) {
+        log_message(LOG_FILE, "WARNING: Cannot open "JOURNAL_FILE" - device transitions are not journaled.");
+        return;
+    }
+    JournalWrite( HJ_NODEV, 0, resumed ? 1 : 0, HJ_START, 0 );
+}
+
+/* move on to the slot of now, emptying the ones passed over */
+void
+StatsAdvance(time_t now) {
+    unsigned long slot = now / STATS_SLOT_S, s;
+    short i, k;
+
+    if (slot > stats_slot) {
+        for (s=stats_slot+1;(s<=slot) && (s<=stats_slot+STATS_SLOTS);s++) {
+            k = s % STATS_SLOTS;
+            stats_cycles[k] = 0;
+            for (i=0;i<MAXDEVICES;i++) {
+                dev_stats[i].starts[k] = 0;
+                dev_stats[i].on_cycles[k] = 0;
             }
         }
     }
-    sprintf( data, "------> GetCurrentTime:" );
-    if (TenvAvrg > 23) { 
-        HPmode = COOL;
-        sprintf( data + strlen(data), " COOL");
-    } else { 
-        HPmode = HEAT;
-        sprintf( data + strlen(data), " HEAT");
-    }
-    /* do base furnace water target temp adjusment: sliding target between hourly ones */
-    if (HPmode == HEAT) {
-        furnace_water_target = HTTBh[current_timer_hour];
-    } else {
-        furnace_water_target = HTTBc[current_timer_hour];
-    }
-    sprintf( data + strlen(data), " fwt=%5.3f", furnace_water_target);
-    log_message(DATA_FILE, data);
+    /* a clock stepped back just goes on in the older slot */
+    stats_slot = slot;
+}
+
+/* sum of the last n slots of a[] */
+unsigned long
+StatsSum(const unsigned short *a, short n) {
+    unsigned long sum = 0;
+    for (short i=0;i<n;i++) sum += a[(stats_slot - i) % STATS_SLOTS];
+    return sum;
+}
+
+/* the part of the last n slots device d was ON */
+float
+StatsDuty(const struct device_stats *ds, short n) {
+    unsigned long cycles = StatsSum( stats_cycles, n );
+    return cycles ? (float)StatsSum( ds->on_cycles, n ) / cycles : 0;
 }
 
 void
-LogData(short HM) {
-    static char data[280];
-    unsigned short diff=0;
-    unsigned short RS=0; /* real state */
-    if (CPump1) RS|=1;
-    if (CPump2) RS|=2;
-    if (CValve) RS|=4;
-    if (CHeater) RS|=8;
-    if (CHP_low) RS|=32;
-    if (CHP_high) RS|=64;
-    diff = (HM ^ RS);
-
-    sprintf( data, "%2d,  %6.3f,%6.3f,%6.3f,%6.3f,%6.3f  %2d,%2d,%d,%6.3f", \
-    current_timer_hour, Tkotel, Tkolektor, TboilerLow, TboilerHigh, TenvAvrg, \
-    cfg.wanted_T, cfg.abs_max, cfg.night_boost, furnace_water_target );
-    if (HM) {
-        sprintf( data + strlen(data), "  WANTED:");
-        if (HM&1) sprintf( data + strlen(data), " P1");
-        if (HM&2) sprintf( data + strlen(data), " P2");
-        if (HM&4) sprintf( data + strlen(data), " V");
-        if (HM&8) sprintf( data + strlen(data), " H");
-        if (HM&16) sprintf( data + strlen(data), " *Hf*");
-        if (HM&32) sprintf( data + strlen(data), " HP1");
-        if (HM&64) sprintf( data + strlen(data), " HP2");
-    }
-    if (RS) {
-        sprintf( data + strlen(data), " got:");
-        if (CPump1) sprintf( data + strlen(data), " P1");
-        if (CPump2) sprintf( data + strlen(data), " P2");
-        if (CValve) sprintf( data + strlen(data), " V");
-        if (CHeater) sprintf( data + strlen(data), " H");
-        if (CHP_low) sprintf( data + strlen(data), " HP1");
-        if (CHP_high) sprintf( data + strlen(data), " HP2");
+WriteDeviceStats() {
+    static HWWM_TLS char data[MAXDEVICES*100+120];
+    struct device_stats *ds;
+
+    sprintf( data, "\ndevice,switches_1h,switches_24h,duty_1h,duty_24h,switches,on_hours,longest_on_s,shortest_on_s" );
+    for (short i=0;i<devices_count;i++) {
+        ds = &dev_stats[i];
+        sprintf( data + strlen(data), "\n%s,%lu,%lu,%4.3f,%4.3f,%lu,%.1f,%lu,%lu", devices[i].name,
+                    StatsSum( ds->starts, 6 ), StatsSum( ds->starts, STATS_SLOTS ), StatsDuty( ds, 6 ),
+                    StatsDuty( ds, STATS_SLOTS ), ds->switches, ds->on_s/3600.0, ds->longest_on, ds->shortest_on );
     }
-    if (diff) {
-        sprintf( data + strlen(data), " DIFF:");
-        if (diff&1) sprintf( data + strlen(data), " P1");
-        if (diff&2) sprintf( data + strlen(data), " P2");
-        if (diff&4) sprintf( data + strlen(data), " V");
-        if (diff&8) sprintf( data + strlen(data), " H");
-        if (diff&32) sprintf( data + strlen(data), " HP1");
-        if (diff&64) sprintf( data + strlen(data), " HP2");
-    }
-    else sprintf( data + strlen(data), "    OK!  ");
-    if (CPowerByBattery) { sprintf( data + strlen(data), " *UPS*"); }
-    sprintf( data + strlen(data), " sendBits:%d COMMS:%d", sendBits, COMMS);
-    log_message(DATA_FILE, data);
-
-    /* for the first 2 cycles = 20 seconds - do not create or update the files that go out to
-       other systems - sometimes there is garbage, which would be nice if is not sent at all */
-    if ( ProgramRunCycles < 2 ) return;
-
-    sprintf( data, ",Temp1,%5.3f\n_,Temp2,%5.3f\n_,Temp3,%5.3f\n_,Temp4,%5.3f\n_,Temp5,%5.3f\n"\
-    "_,Pump1,%d\n_,Pump2,%d\n_,Valve,%d\n_,Heater,%d\n_,PoweredByBattery,%d\n"\
-    "_,TempWanted,%d\n_,BoilerTabsMax,%d\n_,ElectricityUsed,%5.3f\n_,ElectricityUsedNT,%5.3f",\
-    Tkotel, Tkolektor, TboilerHigh, TboilerLow, TenvAvrg, CPump1, CPump2,\
-    CValve, CHeater, CPowerByBattery, cfg.wanted_T, cfg.abs_max,\
-    TotalPowerUsed, NightlyPowerUsed );
-    log_msg_ovr(TABLE_FILE, data);
-
-    sprintf( data, "{Tkotel:%5.3f,Tkolektor:%5.3f,TboilerH:%5.3f,TboilerL:%5.3f,Tenv:%5.3f,"\
-    "PumpFurnace:%d,PumpSolar:%d,Valve:%d,Heater:%d,PoweredByBattery:%d,"\
-    "TempWanted:%d,BoilerTabsMax:%d,ElectricityUsed:%5.3f,ElectricityUsedNT:%5.3f}",\
-    Tkotel, Tkolektor, TboilerHigh, TboilerLow, TenvAvrg, CPump1, CPump2,\
-    CValve, CHeater, CPowerByBattery, cfg.wanted_T, cfg.abs_max,\
-    TotalPowerUsed, NightlyPowerUsed );
-    log_msg_cln(JSON_FILE, data);
+    log_msg_ovr(STATS_FILE, data);
 }
 
-unsigned short ValveIsFullyOpen() {
-    if (CValve && (SCValve > 13)) return 1;
-    else return 0;
+void
+DeviceTurn(const struct device *d, short on, unsigned char reason) {
+    short n = d - devices;
+    struct device_stats *ds = &dev_stats[n];
+    unsigned long ran = ctrlstatecycles[d->ctrl]*10;
+
+    /* a forced heater is turned ON every cycle - its run goes on counting */
+    if (!controls[d->ctrl] == !on) return;
+    JournalWrite( n, controls[d->ctrl] ? 1 : 0, on ? 1 : 0, reason, ran );
+    if (on) {
+        ds->switches++;
+        ds->starts[stats_slot % STATS_SLOTS]++;
+    }
+    else {
+        if (ran > ds->longest_on) ds->longest_on = ran;
+        if (!ds->shortest_on || (ran < ds->shortest_on)) ds->shortest_on = ran;
+    }
+    controls[d->ctrl] = on;
+    ctrlstatecycles[d->ctrl] = 0;
 }
 
-unsigned short ValveIsFullyClosed() {
-    if (!CValve && (SCValve > 15)) return 1;
-    else return 0;
+/* state bits of the devices that are ON */
+unsigned short
+DevicesState() {
+    unsigned short st = 0;
+    for (short i=0;i<devices_count;i++) {
+        if (controls[devices[i].ctrl]) st |= devices[i].bit;
+    }
+    return st;
 }
 
-unsigned short CanTurnPump1On() {
-    if (cfg.use_pump1 && (!CPump1) && (SCPump1 > 2)) return 1;
-    else return 0;
+unsigned short CanTurnHeaterOn() { return DeviceCanTurnOn(&devices[D_HEATER]); }
+unsigned short CanTurnHeatPumpLowOn() { return DeviceCanTurnOn(&devices[D_HP_LOW]); }
+unsigned short CanTurnHeatPumpLowOff() { return DeviceCanTurnOff(&devices[D_HP_LOW]); }
+unsigned short CanTurnHeatPumpHighOn() { return DeviceCanTurnOn(&devices[D_HP_HIGH]); }
+unsigned short CanTurnHeatPumpHighOff() { return DeviceCanTurnOff(&devices[D_HP_HIGH]); }
+
+/* non-zero if the pin is used by the built-in GPIO or by an extra device before device n */
+short
+GPIOPinTaken(int pin, short n) {
+    if ((pin == cfg.bat_powered_pin) || (pin == cfg.pump1_pin) || (pin == cfg.pump2_pin) ||
+        (pin == cfg.valve1_pin) || (pin == cfg.el_heater_pin) || (pin == cfg.commspin1_pin) ||
+        (pin == cfg.commspin2_pin) || (pin == cfg.commspin3_pin) || (pin == cfg.commspin4_pin)) return 1;
+    for (short i=BUILTINDEVICES;i<n;i++) {
+        if (devices[i].pin == pin) return 1;
+    }
+    return 0;
 }
 
-unsigned short CanTurnPump1Off() {
-    if (CPump1 && !CValve && !CHP_low && (SCPump1 > 5) && (SCValve > 5)) return 1;
-    else return 0;
+/* hook up the built-in devices to their configured pins; the extra ones get set up from
+   extra_device_N=name,pin,invert,power_W,min_on_s,min_off_s,sensor,on_at,off_at[,priority] - only at
+   start-up, as their GPIO pins get exported then */
+void
+SetupDevices() {
+    char msg[200], name[16], sensor[16];
+    struct device *d;
+    int pin, invert, prio;
+    unsigned long min_on, min_off;
+    float power, on_at, off_at;
+    short k, i;
+
+    devices[D_PUMP1].pin = cfg.pump1_pin;
+    devices[D_PUMP2].pin = cfg.pump2_pin;
+    devices[D_VALVE].pin = cfg.valve1_pin;
+    devices[D_HEATER].pin = cfg.el_heater_pin;
+    for (i=D_PUMP1;i<=D_HEATER;i++) devices[i].invert = cfg.invert_output;
+    devices[D_HEATER].prio = cfg.heater_priority;
+    devices[D_HP_LOW].prio = cfg.hp_low_priority;
+    devices[D_HP_HIGH].prio = cfg.hp_high_priority;
+    if (devices_count) return;
+
+    devices_count = BUILTINDEVICES;
+    for (k=0;k<MAXEXTRADEVICES;k++) {
+        if (!cfg.extra_device[k][0]) continue;
+        prio = 0;
+        if (sscanf( cfg.extra_device[k], "%15[^,],%d,%d,%f,%lu,%lu,%15[^,],%f,%f,%d", name, &pin, &invert,
+                    &power, &min_on, &min_off, sensor, &on_at, &off_at, &prio ) < 9) {
+            sprintf( msg, "WARNING: extra_device_%d should be name,pin,invert,power_W,min_on_s,min_off_s,"\
+            "sensor,on_at,off_at[,priority] - ignoring it.", k+1 );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        if ((pin < 4) || (pin > 27) || GPIOPinTaken( pin, devices_count )) {
+            sprintf( msg, "ALARM: Extra device '%s' GPIO pin %d is out of range or already in use - ignoring it.", name, pin );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        /* the sensor is given by its name or number */
+        for (i=MAXSENSORS;i>0;i--) {
+            if (SensorInUse(i) && (strcmp( sensor_names[i], sensor ) == 0)) break;
+        }
+        if (!i && (atoi(sensor) >= 1) && (atoi(sensor) <= MAXSENSORS) && SensorInUse(atoi(sensor))) i = atoi(sensor);
+        if (!i) {
+            sprintf( msg, "WARNING: Extra device '%s' sensor '%s' not found - ignoring the device.", name, sensor );
+            log_message(LOG_FILE, msg);
+            continue;
+        }
+        d = &devices[devices_count];
+        strcpy( d->name, name );
+        d->ctrl = EXTRACONTROLS + devices_count - BUILTINDEVICES;
+        d->bit = DEV_EXTRA(devices_count - BUILTINDEVICES);
+        d->force_bit = 0;
+        d->pin = pin;
+        d->invert = invert ? 1 : 0;
+        d->power = (power < 0) ? 0 : power;
+        d->min_on = (min_on + 9) / 10;
+        d->min_off = (min_off + 9) / 10;
+        d->may_turn_on = NULL;
+        d->may_turn_off = NULL;
+        d->prio = (prio < 0) ? 0 : ((prio > 9) ? 9 : prio);
+        d->requires = 0;
+        d->sensor = i;
+        d->on_at = on_at;
+        d->off_at = off_at;
+        sprintf( msg, "INFO: Extra device '%s': pin %d%s, %3.1f W, min on %lus, off %lus; %s on '%s' at %4.1f, off at %4.1f",
+                 d->name, d->pin, d->invert ? " inverted" : "", d->power, d->min_on*10, d->min_off*10,
+                 (on_at < off_at) ? "heating" : "cooling", sensor_names[i], on_at, off_at );
+        log_message(LOG_FILE, msg);
+        devices_count++;
+    }
 }
 
-unsigned short CanTurnPump2On() {
-    if (cfg.use_pump2 && (!CPump2) && (SCPump2 > 2)) return 1;
-    else return 0;
+/* thermostat rule of an extra device: with on_at below off_at it heats - goes ON at or below
+   on_at and stays so until off_at; otherwise it cools the other way round. A failed sensor
+   keeps it OFF */
+short
+DeviceThermostat(const struct device *d) {
+    float t = sensors[d->sensor];
+
+    if ((sensors_failed & (1<<d->sensor)) || (t == -200)) return 0;
+    if (d->on_at < d->off_at) return controls[d->ctrl] ? (t < d->off_at) : (t <= d->on_at);
+    return controls[d->ctrl] ? (t > d->off_at) : (t >= d->on_at);
 }
 
-unsigned short CanTurnPump2Off() {
-    if (CPump2 && (SCPump2 > 5)) return 1;
-    else return 0;
+/* big consumers share the site power budget: the heater, the heat pump stages and any
+   extra device of 1 kW or more */
+short
+DeviceIsBig(const struct device *d) {
+    return (d->bit & BIG_CONSUMERS) || (d->power >= 1000);
 }
 
-unsigned short CanTurnValveOn() {
-    if (!CValve && (SCValve > 5)) return 1;
-    else return 0;
+/* W a big consumer counts for in the site budget */
+int
+DeviceSiteW(const struct device *d) {
+    return d->power ? (int)d->power : BIG_CONSUMER_W;
 }
 
-unsigned short CanTurnValveOff() {
-    if (CValve && (SCValve > 17)) return 1;
-    else return 0;
+/* W taken by the big consumers of this node now */
+int
+SiteUse() {
+    int use = 0;
+    for (short i=0;i<devices_count;i++) {
+        if (DeviceIsBig(&devices[i]) && controls[devices[i].ctrl]) use += DeviceSiteW(&devices[i]);
+    }
+    return use;
 }
 
-unsigned short CanTurnHeaterOn() {
-    if (CHeater || (SCHeater < 29) || (SCHP_low<2) || (SCHP_high<2)) return 0;
-    /* Do the check with config to see if its OK to use electric heater,
-    for example: if its on "night tariff" - switch it on */
-    /* Determine current time: */
-    if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) {
-            /* NIGHT TARIFF TIME */
-            /* If heater use is allowed by config - turn it on */
-            if (cfg.use_electric_heater_night) return 1;
+/* POWER ALLOCATION: the big consumers asking for power (demand bits) get it by priority,
+   as long as it fits in PowerBudgetW(). Ones that are ON and cannot be turned OFF yet hold
+   their share whatever comes; the rest can be preempted - one left out is turned OFF once
+   it can be, freeing its share for a load of higher priority. A load that is OFF only
+   gets power if it can go ON right now, and one that needs another running (HP high on
+   top of HP low) only after that one is in. A load only waiting out its minimum OFF time
+   reserves its share: no load of lower priority starts in it, but running ones are left
+   alone. Return demand, less the big consumers left out */
+unsigned short
+AllocatePower(unsigned short demand, struct text *t) {
+    long budget = PowerBudgetW(), used = 0, reserved = 0;
+    unsigned short held = 0, granted = demand;
+    short order[MAXDEVICES], n = 0, i, j;
+    struct device *d;
+
+    for (i=0;i<devices_count;i++) {
+        d = &devices[i];
+        if (!DeviceIsBig(d)) continue;
+        granted &= ~d->bit;
+        if (controls[d->ctrl] && !DeviceCanTurnOff(d)) {
+            used += DeviceSiteW(d);
+            held |= d->bit;
+            continue;
+        }
+        /* by priority, keeping the table order on a tie */
+        for (j=n;(j>0) && (devices[order[j-1]].prio < d->prio);j--) order[j] = order[j-1];
+        order[j] = i;
+        n++;
     }
-    else {
-            /* DAY TIME */
-            /* If heater use is allowed by config - turn it on */
-            if (cfg.use_electric_heater_day) return 1;
+    for (i=0;i<n;i++) {
+        d = &devices[order[i]];
+        if (!(demand & d->bit)) continue;
+        if (d->requires && !(held & d->requires)) continue;
+        if (controls[d->ctrl]) {
+            if (used + DeviceSiteW(d) > budget) continue;
+        }
+        else {
+            if (used + reserved + DeviceSiteW(d) > budget) continue;
+            if (!DeviceCanTurnOn(d)) {
+                if ((ctrlstatecycles[d->ctrl] < d->min_off) && (!d->may_turn_on || d->may_turn_on()))
+                    reserved += DeviceSiteW(d);
+                continue;
+            }
+        }
+        used += DeviceSiteW(d);
+        held |= d->bit;
     }
-    return 0;
+    granted |= held & demand;
+    if (demand & ~granted) {
+        TextAdd( t, " PWR(" );
+        TextLong( t, used, 0 );
+        TextAdd( t, "+" );
+        TextLong( t, reserved, 0 );
+        TextAdd( t, "/" );
+        TextLong( t, budget, 0 );
+        TextAdd( t, ")" );
+    }
+    return granted;
 }
 
-/* to turn electrical heater OFF - it must have been ON for at least 20 minutes */
-unsigned short CanTurnHeaterOff() {
-    if ((CHeater) && (SCHeater > 20*6)) return 1;
-    else return 0;
+short
+SitePeerFresh(const struct site_peer *p) {
+    return ms_since(&p->heard) <= SITE_LEASE_S*1000L;
 }
 
-unsigned short CanTurnHeatPumpLowOn() {
-    if (!CHP_low && (SCHeater > 2) && ((COMMS==1) || (COMMS==3))) return 1;
-    else return 0;
+/* read all announcements waiting on the site socket into site_peers[] */
+void
+SiteRecv(int fd) {
+    static HWWM_TLS short dup_logged = 0;
+    char buf[128];
+    struct site_peer p;
+    unsigned long seq;
+    ssize_t n;
+    short i;
+
+    while ((n = recv( fd, buf, sizeof buf - 1, MSG_DONTWAIT )) > 0) {
+        buf[n] = 0;
+        if (sscanf( buf, "HWWMB1 %d %d %lu %d %d %d", &p.id, &p.prio, &seq, &p.use, &p.want, &p.grant ) != 6) continue;
+        if (p.id == cfg.site_node_id) {
+            /* our own, looped back - unless another node took our id */
+            if ((seq != site_seq) && !dup_logged) {
+                sprintf( buf, "ALARM: Site power budget: another node uses site_node_id %d!", p.id );
+                log_message(LOG_FILE, buf);
+                dup_logged = 1;
+            }
+            continue;
+        }
+        clock_gettime( CLOCK_MONOTONIC, &p.heard );
+        for (i=0;i<site_peers_count;i++) {
+            if (site_peers[i].id == p.id) break;
+        }
+        if (i == site_peers_count) {
+            if (site_peers_count >= MAXSITEPEERS) continue;
+            site_peers_count++;
+        }
+        site_peers[i] = p;
+    }
 }
 
-unsigned short CanTurnHeatPumpLowOff() {
-    if (CHP_low && !CHP_high && (SCHP_high>5) && (COMMS>=2))  return 1;
-    else return 0;
+/* join the site group; a node that cannot runs on its local limit. Start-up only */
+void
+SiteStart() {
+    char msg[200], group[MAXLEN], *colon;
+    struct ip_mreq mreq;
+    struct in_addr ifaddr;
+    int one = 1;
+    unsigned char ttl = 1, loop = 1;
+
+    if (cfg.site_budget_kw <= 0) return;
+    if (!cfg.site_node_id) {
+        log_message(LOG_FILE,"WARNING: Site power budget needs site_node_id set - using the local limit only.");
+        return;
+    }
+    strcpy( group, cfg.site_group );
+    colon = strchr( group, ':' );
+    if (colon) *colon = 0;
+    memset( &site_addr, 0, sizeof site_addr );
+    site_addr.sin_family = AF_INET;
+    site_addr.sin_port = htons( colon ? atoi(colon+1) : 4777 );
+    if (!inet_aton( group, &site_addr.sin_addr ) || !IN_MULTICAST(ntohl(site_addr.sin_addr.s_addr)) ||
+        !inet_aton( cfg.site_interface, &ifaddr )) {
+        log_message(LOG_FILE,"WARNING: Bad site_group or site_interface - using the local limit only.");
+        return;
+    }
+    site_sock = socket( AF_INET, SOCK_DGRAM, 0 );
+    if (site_sock < 0) goto fail;
+    /* several nodes on one host share the port - handy for trying it out on loopback */
+    setsockopt( site_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one );
+    {
+        struct sockaddr_in any = site_addr;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind( site_sock, (struct sockaddr *)&any, sizeof any )) goto fail;
+    }
+    mreq.imr_multiaddr = site_addr.sin_addr;
+    mreq.imr_interface = ifaddr;
+    if (setsockopt( site_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq )) goto fail;
+    setsockopt( site_sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof ifaddr );
+    setsockopt( site_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl );
+    setsockopt( site_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop );
+    fcntl( site_sock, F_SETFD, FD_CLOEXEC );
+    WatchFd( site_sock, SiteRecv );
+    clock_gettime( CLOCK_MONOTONIC, &site_joined );
+    return;
+
+fail:
+    sprintf( msg, "WARNING: Cannot join site group %s (%s) - using the local limit only.", cfg.site_group, strerror(errno) );
+    log_message(LOG_FILE, msg);
+    if (site_sock >= 0) close( site_sock );
+    site_sock = -1;
 }
 
-unsigned short CanTurnHeatPumpHighOn() {
-    if (!CHP_high && CHP_low && (SCHP_low>3) && (SCHeater > 2) && 
-        ((COMMS==1) || (COMMS==3))) return 1;
-    else return 0;
+/* share the budget while enough peers are heard */
+void
+SiteUpdateMode() {
+    char msg[160];
+    short fresh = 0, shared;
+
+    for (short i=0;i<site_peers_count;i++) fresh += SitePeerFresh(&site_peers[i]);
+    shared = (cfg.site_budget_kw > 0) && (fresh >= cfg.site_nodes-1);
+    if (shared == site_shared) return;
+    site_shared = shared;
+    if (shared) sprintf( msg, "INFO: Site power budget: %d peers heard - sharing %3.1f kW.", fresh, cfg.site_budget_kw );
+    else sprintf( msg, "WARNING: Site power budget: %d of %d peers heard - using the local budget of %3.1f kW.",
+                  fresh, cfg.site_nodes-1, PowerBudgetW()/1000.0 );
+    log_message(LOG_FILE, msg);
 }
 
-unsigned short CanTurnHeatPumpHighOff() {
-    if (CHP_high && (COMMS>=2))  return 1;
-    else return 0;
+/* W this node may turn ON of what it wants: the free power after all uses and grants
+   held, less the requests waiting ahead of this node */
+int
+SiteAllocate(int want, int use) {
+    long free = cfg.site_budget_kw*1000 - use;
+    short i;
+
+    if (!want) return 0;
+    for (i=0;i<site_peers_count;i++) {
+        if (SitePeerFresh(&site_peers[i])) free -= site_peers[i].use + site_peers[i].grant;
+    }
+    for (i=0;i<site_peers_count;i++) {
+        struct site_peer *p = &site_peers[i];
+        if (!SitePeerFresh(p) || !p->want || p->grant) continue;
+        if ((p->prio > cfg.site_priority) || ((p->prio == cfg.site_priority) && (p->id < cfg.site_node_id))) {
+            if (p->want <= free) free -= p->want;
+        }
+    }
+    return (want <= free) ? want : 0;
+}
+
+/* hold back big consumers the site budget has no room for: only the first one wanted
+   can go ON, and only with a grant held since last cycle; right after joining, nothing
+   new goes ON until the peers had the time to be heard */
+unsigned short
+SiteBudgetFilter(unsigned short SD, struct text *t) {
+    short i, allowed, joining;
+
+    if (site_sock < 0) return SD;
+    SiteUpdateMode();
+    site_want_dev = -1;
+    site_want = 0;
+    for (i=0;i<devices_count;i++) {
+        if (DeviceIsBig(&devices[i]) && (SD & devices[i].bit) && !controls[devices[i].ctrl]) {
+            site_want_dev = i;
+            site_want = DeviceSiteW(&devices[i]);
+            break;
+        }
+    }
+    joining = !site_shared && (ms_since(&site_joined) <= SITE_LEASE_S*1000L);
+    if ((!site_shared && !joining) || !site_want) return SD;
+    allowed = site_shared && (site_grant >= site_want) && SiteAllocate(site_want, SiteUse());
+    TextAdd( t, " SITE(" );
+    TextAdd( t, devices[site_want_dev].name );
+    TextAdd( t, ":" );
+    TextLong( t, site_want, 0 );
+    TextAdd( t, "/" );
+    TextLong( t, site_grant, 0 );
+    TextAdd( t, ")" );
+    for (i=0;i<devices_count;i++) {
+        if (!DeviceIsBig(&devices[i]) || controls[devices[i].ctrl]) continue;
+        if ((i == site_want_dev) && allowed) continue;
+        SD &= ~devices[i].bit;
+    }
+    return SD;
 }
 
-void TurnPump1Off()  { CPump1 = 0; SCPump1 = 0; }
-void TurnPump1On()  { CPump1 = 1; SCPump1 = 0; }
-void TurnPump2Off()  { CPump2  = 0; SCPump2 = 0; }
-void TurnPump2On()  { CPump2  = 1; SCPump2 = 0; }
-void TurnValveOff()    { CValve  = 0; SCValve = 0; }
-void TurnValveOn()    { CValve  = 1; SCValve = 0; }
-void TurnHeaterOff()  { CHeater = 0; SCHeater = 0; }
-void TurnHeaterOn()  { CHeater = 1; SCHeater = 0; }
-void TurnHeatPumpLowOff()  { CHP_low = 0; SCHP_low = 0; }
-void TurnHeatPumpLowOn()  { CHP_low = 1; SCHP_low = 0; }
-void TurnHeatPumpHighOff() { CHP_high = 0; SCHP_high = 0; }
-void TurnHeatPumpHighOn() { CHP_high = 1; SCHP_high = 0; }
+/* tell the peers what this node uses, wants and holds; called every cycle */
+void
+SiteAnnounce() {
+    char buf[128];
+    int use;
+
+    if (site_sock < 0) return;
+    SiteUpdateMode();
+    if ((site_want_dev >= 0) && controls[devices[site_want_dev].ctrl]) site_want = 0;
+    use = SiteUse();
+    site_grant = site_shared ? SiteAllocate(site_want, use) : 0;
+    site_seq++;
+    sprintf( buf, "HWWMB1 %d %d %lu %d %d %d", cfg.site_node_id, cfg.site_priority, site_seq, use, site_want, site_grant );
+    sendto( site_sock, buf, strlen(buf), 0, (struct sockaddr *)&site_addr, sizeof site_addr );
+    /* the want is worked out anew in the next ComputeWantedState() */
+    site_want = 0;
+    site_want_dev = -1;
+}
 
 /* Return non-zero value if Heat Pumps should HEAT */
 short
@@ -1577,8 +6665,8 @@ CriticalTempsFound() {
 short
 BoilerNeedsHeat() {
     short ret = 0;
-    /* if boiler heater is disabled for the current part of day - return 0 */
-    if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) )
+    /* if boiler heater is disabled for the current tariff - return 0 */
+    if ( TariffCheap() )
     {
         /* night time */
         if (!cfg.use_electric_heater_night) return 0;
@@ -1595,10 +6683,144 @@ BoilerNeedsHeat() {
     return ret;
 }
 
+/* estimate of a failed sensor's current value - see sensor_fallback[] */
+float
+SensorEstimate(short i) {
+    float v = sensors[i];
+    switch (sensor_fallback[i]) {
+        case FALLBACK_MODEL:
+        /* boiler bottom: let the model move it along with what heats or cools the tank */
+        if ((ModelConfidence(&boiler_model, 0) >= 20) && (ModelConfidence(&boiler_model, 1) >= 50)) {
+            v += (-boiler_model.theta[0] * (v - BOILER_ROOM_T) + boiler_model.theta[1] * CHeater +
+                  boiler_model.theta[2] * CValve + boiler_model.theta[3] * CPump2) / (6*60);
+        }
+        /* the bottom of the tank is never hotter than its top - and if it was never read,
+           assume it is as hot as the top: that errs on the side of not heating */
+        if ((v > TboilerHigh) || (v == -200)) v = TboilerHigh;
+        break;
+        case FALLBACK_TENV_AVG:
+        v = TenvAvrg;
+        break;
+        default:
+        break;
+    }
+    return v;
+}
+
+/* non-zero if rule r can run with the sensors we have */
+short
+RuleUsable(short r) {
+    return !(rules[r].needs & sensors_failed & ~rules[r].estimates_ok);
+}
+
+/* NIGHT BOOST PLANNER: uses the boiler thermal model to find the latest moment the heater
+   can be started and still get TboilerLow to nightEnergyTemp by the end of the night tariff.
+   Starting late keeps the tank cooler for longer, so less heat is lost standing.
+   When the heat pumps hold the big consumer slots, the heating is split across the night:
+   the heater takes the first part of every hour - as much of it as the remaining work needs.
+   Returns 1 when heater is wanted, 0 when not, and -1 when the model is not good enough yet -
+   the caller falls back to the fixed 04:00 boost then. */
+#define PLAN_CHUNK_MIN      60
+#define PLAN_MARGIN_MIN     10
+
+/* minutes of heater at rate h (C/h) with standing loss k (1/h) to get from t0 to t1 */
+float
+PlanHeatMinutes(float t0, float t1, double h, double k) {
+    double tinf;
+    if (t0 >= t1) return 0;
+    if (k <= 0.0001) return (float)(60 * (t1 - t0) / h);
+    /* heater and losses balance out at tinf - if target is above it, it is never reached */
+    tinf = BOILER_ROOM_T + h / k;
+    if (t1 >= tinf - 0.1) return 24*60;
+    return (float)(60 * log((tinf - t0) / (tinf - t1)) / k);
+}
+
+short
+NightBoostPlanner(struct text *t) {
+    double h = boiler_model.theta[1];
+    double k = boiler_model.theta[0];
+    float left, need, duty, wait, lo, hi, t0;
+    time_t now = cycle_time;
+    struct tm tm;
+    short contended, want = 0, now_min;
+    char msg[160];
+
+    localtime_r( &now, &tm );
+    now_min = tm.tm_min;
+
+    if (!cfg.night_boost_planner || (ModelConfidence(&boiler_model, 1) < 50) ||
+        (ModelConfidence(&boiler_model, 0) < 20) || (h < 1)) return -1;
+    if (k < 0) k = 0;
+    if ( !TariffCheap() ) { boost_was_on = 0; return 0; }
+    if (TboilerLow >= nightEnergyTemp) { boost_was_on = 0; return 0; }
+
+    /* minutes left until the cheap tariff ends */
+    left = TariffLeft();
+    need = PlanHeatMinutes(TboilerLow, nightEnergyTemp, h, k);
+
+    /* the heater has to take turns with the big consumers already running if it does not fit */
+    contended = (SiteUse() - (CHeater ? DeviceSiteW(&devices[D_HEATER]) : 0) +
+                 DeviceSiteW(&devices[D_HEATER]) > PowerBudgetW());
+    if (!contended) {
+        /* latest start: find the longest wait after which - with the tank cooling meanwhile - the
+           heater still makes it in time; wait + heat time grows with wait, so bisect it */
+        lo = 0;
+        hi = left;
+        for (short i=0;i<20;i++) {
+            wait = (lo + hi) / 2;
+            t0 = BOILER_ROOM_T + (TboilerLow - BOILER_ROOM_T) * exp(-k * wait / 60);
+            if (wait + PlanHeatMinutes(t0, nightEnergyTemp, h, k) * 1.1 + PLAN_MARGIN_MIN <= left) lo = wait;
+            else hi = wait;
+        }
+        if (lo < 1) want = 1;
+        /* once started it runs until the tank is there - the bisection ends up with some slack
+           again every few minutes, and would short-cycle the heater near the end of the night */
+        if (CHeater && boost_was_on) want = 1;
+    }
+    else {
+        /* share the night with the heat pumps: heater runs the first 'duty' part of every
+           hour, never less than its 20 minutes minimum on time */
+        duty = (need * 1.1 + PLAN_MARGIN_MIN) / ((left > 1) ? left : 1);
+        if (duty >= 1) want = 1;
+        else if (duty >= 20.0 / PLAN_CHUNK_MIN) {
+            if (now_min < duty * PLAN_CHUNK_MIN) want = 1;
+        }
+    }
+    if (want) {
+        TextAdd( t, " NBP(" );
+        TextFixed( t, need, 0, 0 );
+        TextAdd( t, "/" );
+        TextFixed( t, left, 0, 0 );
+        TextAdd( t, contended ? "s)" : ")" );
+    }
+    if (want && !boost_was_on) {
+        sprintf( msg, "INFO: Night boost planner starts heater: needs %.0f min to reach %.1f C, %.0f min of "\
+        "night tariff left%s.", need, nightEnergyTemp, left, contended ? ", sharing with heat pumps" : "" );
+        log_message(LOG_FILE, msg);
+    }
+    boost_was_on = want;
+    return want;
+}
+
+/* give back to the control logic the devices whose force over the control socket ran out */
+void
+ForcesExpire() {
+    char msg[100];
+
+    for (short i=0;i<devices_count;i++) {
+        if (!((forced_on | forced_off) & devices[i].bit) || (cycle_time < forced_until[i])) continue;
+        sprintf( msg, "INFO: Control: force of %s %s ran out.", devices[i].name, (forced_on & devices[i].bit) ? "ON" : "OFF" );
+        log_message(LOG_FILE, msg);
+        forced_on &= ~devices[i].bit;
+        forced_off &= ~devices[i].bit;
+    }
+}
+
 short
 ComputeWantedState() {
     unsigned short StateDesired = 0;
     unsigned short StateMinimum = 0;
+    unsigned short StateAll = 0;
     unsigned short wantP1on = 0;
     unsigned short wantP2on = 0;
     unsigned short wantVon = 0;
@@ -1609,45 +6831,55 @@ ComputeWantedState() {
     unsigned short needToKeepHeatPumpLON = 0;
     unsigned short needToTurnHeatPumpHON = 0;
     unsigned short needToKeepHeatPumpHON = 0;
-    static char data[280];
+    unsigned short demand = 0;
+    unsigned short granted = 0;
+    unsigned short protect = 0;     /* wanted by a protection - a force OFF does not hold */
+    unsigned short forcedOn = forced_on;
+    static HWWM_TLS char data[400];
+    struct text t;
     
     /* try to calculate what would be the lowest possible state right now */
     /* e.g. if Pump 1 can be turned OFF or is already OFF - toggle its bit */
-    if (CanTurnPump1Off() || !CPump1) StateMinimum |= 1;
-    if (CanTurnPump2Off() || !CPump2) StateMinimum |= 2;
-    if (CanTurnValveOff() || !CValve) StateMinimum |= 4;
-    if (CanTurnHeaterOff() || !CHeater) StateMinimum |= 8;
-    /* NB here! Bit 5 == 16 is used to make Heater ON forcefully - so no |= 16 */
-    if (CanTurnHeatPumpLowOff() || !CHP_low) StateMinimum |= 32;
-    if (CanTurnHeatPumpHighOff() || !CHP_high) StateMinimum |= 64;
+    /* NB here! DEV_HEATER_FORCED is used to make Heater ON forcefully - so it is never set */
+    for (short i=0;i<devices_count;i++) {
+        if (DeviceCanTurnOff(&devices[i]) || !controls[devices[i].ctrl]) StateMinimum |= devices[i].bit;
+        StateAll |= devices[i].bit;
+    }
     /* after we have all the bits, we need to invert them, and bitwise AND with the max
-       possible (1+2+4+8+32+64 == 111) - this will leave ON the bits for the devices which
-       cannot be turned OFF */
-    StateMinimum = (~StateMinimum)&111;
+       possible - this will leave ON the bits for the devices which cannot be turned OFF */
+    StateMinimum = (~StateMinimum)&StateAll;
+
+    TextAdd( TextStart( &t, data, sizeof data ), "compute: " );
+    /* when running degraded - note which rules got skipped for lack of sensors */
+    for (short r=0;r<R_TOTALRULES;r++) {
+        if (!RuleUsable(r)) { TextAdd( &t, " skip:" ); TextAdd( &t, rules[r].tag ); }
+    }
     
     /* EVACUATED TUBES COLLECTOR: EXTREMES PROTECTIONS */
     /* If collector is below 4 C and its getting cold - turn pump on to prevent freezing */
-	if ((Tkolektor < 4)&&(TenvAvrg < 2)) wantP2on = 1;
+	if (RuleUsable(R_COLL_FREEZE) && (Tkolektor < 4)&&(TenvAvrg < 2)) protect |= DEV_PUMP2;
+    /* ...and if collector temp is not known - do it anyway when it is cold enough to freeze */
+    if (!RuleUsable(R_COLL_FREEZE) && (TenvAvrg < 2)) protect |= DEV_PUMP2;
     /* Prevent ETC from boiling its work fluid away in case all heat targets have been reached
         and yet there is no use because for example the users are away on vacation */
-    if (Tkolektor > 65) {
-        wantVon = 1;
+    if (RuleUsable(R_COLL_BOIL) && (Tkolektor > 65)) {
+        protect |= DEV_VALVE;
         /* And if valve has been open for ~1.5 minutes - turn furnace pump on */
-        if (CValve && (SCValve > 8)) wantP1on = 1;
+        if (CValve && (SCValve > 8)) protect |= DEV_PUMP1;
         /* And if valve has been open for 2 minutes - turn solar pump on */
-        if (CValve && (SCValve > 11)) wantP2on = 1;
+        if (CValve && (SCValve > 11)) protect |= DEV_PUMP2;
     }
 
     /* FURNACE PUMP OPERATION */
 	/* Furnace is above 38 C - at these temps always run the pump */
-	if (Tkotel > 38) { wantP1on = 1; }
-	else {
+	if (Tkotel > 38) { protect |= DEV_PUMP1; }
+	else if (RuleUsable(R_FURNACE_PUMP)) {
 		/* below 38 C - check if it is cold to see if we need to run furnace pump:
             if so - run furnace pump at least once every 10 minutes */
 		if ((TenvAvrg < 3)&&(!CPump1)&&(SCPump1 > (10*6))) wantP1on = 1;
 	}
-    /* Furnace is above 20 C and rising slowly - turn pump on */
-    if ((Tkotel > 20)&&(Tkotel > (TkotelPrev+0.12))) wantP1on = 1;
+    /* Furnace is above 20 C and rising slowly (0.72 C/min == 0.12 C per cycle) - turn pump on */
+    if ((Tkotel > 20)&&(HistRate(1, 0) > 0.72)) wantP1on = 1;
     /* Furnace temp is rising QUICKLY - turn pump on to limit furnace thermal shock */
     if (Tkotel > (TkotelPrev+0.18)) wantP1on = 1;
     /* If Heat Pump has recently turned off, keep pump on for a bit longer */
@@ -1661,17 +6893,21 @@ ComputeWantedState() {
         /* ETCs have heat in excess - build up boiler temp so expensive sources stay idle */
         /* Require selected heat source to be near boiler hot end to avoid loosing heat
         to the enviroment because of the system working */
-        if ((Tkolektor > (TboilerLow+12))&&(Tkolektor > (TboilerHigh-2))) wantP2on = 1;
-        /* Keep solar pump on while solar fluid is more than 5 C hotter than boiler lower end */
-        if ((CPump2) && (Tkolektor > (TboilerLow+4))) wantP2on = 1;
+        if (RuleUsable(R_SOLAR_GAIN)) {
+            if ((Tkolektor > (TboilerLow+12))&&(Tkolektor > (TboilerHigh-2))) wantP2on = 1;
+            /* Keep solar pump on while solar fluid is more than 5 C hotter than boiler lower end */
+            if ((CPump2) && (Tkolektor > (TboilerLow+4))) wantP2on = 1;
+        }
         /* Furnace has heat in excess - open the valve so boiler can build up heat while it can */
-        if ((Tkotel > (TboilerHigh+2)) || (Tkotel > (TboilerLow+4)))  {
-            wantVon = 1;
-            /* And if valve has been open for 90 seconds - turn furnace pump on */
-            if (CValve && (SCValve >= 9)) wantP1on = 1;
+        if (RuleUsable(R_FURNACE_GAIN)) {
+            if ((Tkotel > (TboilerHigh+2)) || (Tkotel > (TboilerLow+4)))  {
+                wantVon = 1;
+                /* And if valve has been open for 90 seconds - turn furnace pump on */
+                if (CValve && (SCValve >= 9)) wantP1on = 1;
+            }
+            /* Keep valve open while there is still heat to exploit */
+            if ((CValve) && (Tkotel > (TboilerLow+3))) wantVon = 1;
         }
-        /* Keep valve open while there is still heat to exploit */
-        if ((CValve) && (Tkotel > (TboilerLow+3))) wantVon = 1;
     }
 
     /* EVACUATED TUBES COLLECTOR: HOUSE KEEPING */
@@ -1686,54 +6922,31 @@ ComputeWantedState() {
     /* Turn furnace pump on every 2 hours */
     if ( (!CPump1) && (SCPump1 > (6*60*2)) ) wantP1on = 1;
 
-    sprintf( data, "compute: " );
     /* ELECTRICAL HEATER: SMART FUNCTIONS */
-    /* At 4 o'clock use night energy tariff to heat up boiler until the lower sensor reads several degrees
-       on top of desired temp, clamped at cfg.abs_max, so that less day energy gets used */
-    if ( (cfg.night_boost) && (current_timer_hour == 4) ) {
-        if (TboilerLow < nightEnergyTemp) {
-            sprintf( data + strlen(data), " NB");
+    /* Use night energy tariff to heat up boiler until the lower sensor reads several degrees
+       on top of desired temp, clamped at cfg.abs_max, so that less day energy gets used;
+       the planner picks when to do it - until it has a good model, this is done at 4 o'clock */
+    if ( cfg.night_boost && RuleUsable(R_NIGHT_BOOST) ) {
+        short planned = NightBoostPlanner(&t);
+        if (planned > 0) wantHon = 1;
+        if ( (planned < 0) && (current_timer_hour == 4) && (TboilerLow < nightEnergyTemp) ) {
+            TextAdd( &t, " NB" );
             wantHon = 1;
         }
     }
 
-    if ( BoilerNeedsHeat() ) sprintf( data + strlen(data), " BNH");
+    if ( RuleUsable(R_HEATER) && BoilerNeedsHeat() ) TextAdd( &t, " BNH" );
 
     /* ELECTRICAL HEATER: BULK HEATING */
-    if ( BoilerNeedsHeat() || wantHon ) {
-        sprintf( data + strlen(data), " heater");
-        if (CanTurnHeaterOn()) sprintf( data + strlen(data), " CTHO");
-        /* before enabling heater blindly - consider max big consumers */
-        if (cfg.max_big_consumers>=3) {
-        sprintf( data + strlen(data), " htr-1-1");
-            /* when 3+ are allowed - we can turn heater ON if possible */
-            if (CanTurnHeaterOn()) {
-        sprintf( data + strlen(data), " htr-1-2");
-                wantHon = 1;
-            }
-        } else if (cfg.max_big_consumers==2) { /* 2 big consumers */
-        sprintf( data + strlen(data), " htr-2-1");
-            /* when 2 big consumers allowed - we need to make sure HPH is either OFF or can be switched OFF */
-            if (!CHP_high || CanTurnHeatPumpHighOff()) {
-        sprintf( data + strlen(data), " htr-2-2");
-                wantHon = 1;
-            }
-        } else {            /* 1 big consumer */
-        sprintf( data + strlen(data), " htr-3-1");
-			/* HP must be OFF or must be able to switch OFF */
-			if (!CHP_low || CanTurnHeatPumpLowOff() ) {
-        sprintf( data + strlen(data), " htr-3-2");
-				/* if heater can be turned ON or is already ON - request it */
-				if (CanTurnHeaterOn() || CHeater) {
-        sprintf( data + strlen(data), " htr-3-3");
-					wantHon = 1;
-				}
-			}
-        }
+    if ( (RuleUsable(R_HEATER) && BoilerNeedsHeat()) || wantHon ) {
+        TextAdd( &t, " heater" );
+        if (CanTurnHeaterOn()) TextAdd( &t, " CTHO" );
+        demand |= DEV_HEATER;
     }
 
     /* FURNACE WATER HEATING BY HEAT PUMP */
     if ( cfg.use_acs &&       /* Consider if ACs are allowed */
+         RuleUsable(R_HEAT_PUMP) && /* ... we have the sensors needed */
          HPshouldHeat() ) {   /* ... and temps are OK for heating */
         /* For Heat Pump LOW consider 2 cases, based on the time for which HPL has been OFF;
            basically the idea is to consider losses and ramp-up-to-temp time for the heat pumps */
@@ -1757,55 +6970,36 @@ ComputeWantedState() {
     }
     /* Check: if we need to heat furnace water */
     if (needToTurnHeatPumpLON || needToKeepHeatPumpLON) {
-        sprintf( data + strlen(data), " HP");
-        if (CanTurnHeatPumpLowOn()) sprintf( data + strlen(data), " CTHPLO");
-    /* HEAT PUMP LOW  */
-    /* Decide whether to request heat pump LOW ON or not */
-        if (cfg.max_big_consumers>=2) { /* if 2+ big consumers */
-        sprintf( data + strlen(data), " L-1-1");
-            /* check if HPL can be turned ON or has been ON */
-            if (CanTurnHeatPumpLowOn() || CHP_low) {
-        sprintf( data + strlen(data), " L-1-2");
-                if ( (CHP_low) || (SCHeater > 2) ) {  /* if HPL is already ON or heater has settled */
-        sprintf( data + strlen(data), " L-1-3");
-                    wantHPLon = 1;
-                }
-            }
-        } else { /* 1 big consumer allowed */
-        sprintf( data + strlen(data), " L-2-1");
-            /* check if heater is is OFF, been so for a while, and not needed */
-            if (!wantHon && !CHeater && (SCHeater > 2)) {
-        sprintf( data + strlen(data), " L-2-2");
-                /* also chech that HPL can be turned or has been ON */
-                if (CanTurnHeatPumpLowOn() || CHP_low) { 
-        sprintf( data + strlen(data), " L-2-3");
-                    wantHPLon = 1;
-                }
-            }
-        }
+        TextAdd( &t, " HP" );
+        if (CanTurnHeatPumpLowOn()) TextAdd( &t, " CTHPLO" );
+        demand |= DEV_HP_LOW;
+        /* HEAT PUMP HIGH goes on top of LOW */
         if (needToTurnHeatPumpHON || needToKeepHeatPumpHON) {
-            if (CanTurnHeatPumpHighOn()) sprintf( data + strlen(data), " CTHPHO");
-        /* HEAT PUMP HIGH  */
-        /* Decide whether to request heat pump LOW ON or not */
-            if (cfg.max_big_consumers>=3) { /* if 3+ big consumers allowed - just go ahead */
-        sprintf( data + strlen(data), " H-1-1");
-                wantHPHon = 1;
-            } else if (cfg.max_big_consumers==2) { /* else - if 2 big consumers */
-        sprintf( data + strlen(data), " H-2-1");
-                if (CHP_low && (CanTurnHeatPumpHighOn() || CHP_high)) {/* and low mode is on + high can be turned or has been on */
-        sprintf( data + strlen(data), " H-2-2");
-                    if (!wantHon && (!CHeater) && (SCHeater > 2)) { /* and heater is off and has been like this 30 seconds and not needed */
-        sprintf( data + strlen(data), " H-2-3");
-                        wantHPHon = 1;
-                    }
-                }
-            }
+            if (CanTurnHeatPumpHighOn()) TextAdd( &t, " CTHPHO" );
+            demand |= DEV_HP_HIGH;
         }
     }
-    
-    if ( wantHon ) sprintf( data + strlen(data), " wantH");
-    if ( wantHPLon ) sprintf( data + strlen(data), " wantHPL" );
-    if ( wantHPHon ) sprintf( data + strlen(data), " wantHPH" );
+
+    /* EXTRA DEVICES: plain thermostats */
+    for (short i=BUILTINDEVICES;i<devices_count;i++) {
+        if (DeviceThermostat(&devices[i])) demand |= devices[i].bit;
+    }
+
+    /* FORCED over the control socket: a big consumer forced ON still has to get the power,
+       and the heater stops at cfg.abs_max as when it heats on its own */
+    if ( (TboilerHigh >= (float)cfg.abs_max) || (TboilerLow >= (float)(cfg.abs_max - 2)) ) forcedOn &= ~DEV_HEATER;
+    demand = (demand | forcedOn) & ~forced_off;
+
+    /* BIG CONSUMERS: the power budget decides which of the loads asking for power run */
+    granted = AllocatePower(demand, &t);
+    power_denied = demand & ~granted;
+    wantHon = (granted & DEV_HEATER) ? 1 : 0;
+    wantHPLon = (granted & DEV_HP_LOW) ? 1 : 0;
+    wantHPHon = (granted & DEV_HP_HIGH) ? 1 : 0;
+
+    if ( wantHon ) TextAdd( &t, " wantH" );
+    if ( wantHPLon ) TextAdd( &t, " wantHPL" );
+    if ( wantHPHon ) TextAdd( &t, " wantHPH" );
     
     /* after the swtich above - request pump 1 only if needed */
     if (wantHPLon) wantP1on = 1;
@@ -1817,7 +7011,9 @@ ComputeWantedState() {
         if (wantHPLon && (SCHP_low>10)) xtra+=1.6;
         if (wantHPHon && (SCHP_high>10)) xtra+=1.6;
         if (xtra>1) {
-            sprintf( data + strlen(data), " X(%1.1f)", xtra );
+            TextAdd( &t, " X(" );
+            TextFixed( &t, xtra, 1, 1 );
+            TextAdd( &t, ")" );
             /* Furnace has heat in excess - open the valve so boiler can build up heat while it can */
             if (((Tkotel+xtra) > (TboilerHigh+2)) || ((Tkotel+xtra) > (TboilerLow+4)))  {
                 wantVon = 1;
@@ -1829,37 +7025,49 @@ ComputeWantedState() {
         }
     }
 
-    if ( wantP1on ) StateDesired |= 1;
-    if ( wantP2on ) StateDesired |= 2;
-    if ( wantVon )  StateDesired |= 4;
-    if ( wantHon )  StateDesired |= 8;
-    if ( wantHPLon )  StateDesired |= 32;
-    if ( wantHPHon )  StateDesired |= 64;
+    if ( wantP1on ) StateDesired |= DEV_PUMP1;
+    if ( wantP2on ) StateDesired |= DEV_PUMP2;
+    if ( wantVon )  StateDesired |= DEV_VALVE;
+    if ( wantHon )  StateDesired |= DEV_HEATER;
+    if ( wantHPLon )  StateDesired |= DEV_HP_LOW;
+    if ( wantHPHon )  StateDesired |= DEV_HP_HIGH;
+
+    /* and the extra devices */
+    StateDesired |= granted & ~(DEV_EXTRA(0)-1);
+
+    /* and what is forced - the protections and the minimum ON and OFF times below still hold */
+    StateDesired = ((StateDesired | (granted & forcedOn)) & ~forced_off) | protect;
+    if ( forced_on | forced_off ) {
+        TextAdd( &t, " F(" );
+        TextLong( &t, forced_on, 0 );
+        TextAdd( &t, "/" );
+        TextLong( &t, forced_off, 0 );
+        TextAdd( &t, ")" );
+    }
+
+    /* big consumers to go ON need room in the site power budget, if one is shared */
+    StateDesired = SiteBudgetFilter(StateDesired, &t);
 
-    sprintf( data + strlen(data), " uncorrSD=%d", StateDesired );
+    TextAdd( &t, " uncorrSD=" );
+    TextLong( &t, StateDesired, 0 );
     /* do final correction - do an OR with the minimum state possible 
         this will keep ON devices which cannot be turned OFF */
     StateDesired |= StateMinimum;
-    sprintf( data + strlen(data), "    min=%d", StateMinimum );
-    sprintf( data + strlen(data), "  finalSD=%d", StateDesired );
+    TextAdd( &t, "    min=" );
+    TextLong( &t, StateMinimum, 0 );
+    TextAdd( &t, "  finalSD=" );
+    TextLong( &t, StateDesired, 0 );
     
-    log_message(DATA_FILE, data);
+    DataNote( data );
 
     return StateDesired;
 }
 
 void
 ActivateDevicesState(const short _ST_) {
-    char current_state = 0;
-    char new_state = 0;
-
-    /* calculate current state */
-    if ( CPump1 ) current_state |= 1;
-    if ( CPump2 ) current_state |= 2;
-    if ( CValve ) current_state |= 4;
-    if ( CHeater ) current_state |= 8;
-    if ( CHP_low ) current_state |= 32;
-    if ( CHP_high ) current_state |= 64;
+    short i;
+    float used;
+
     /* make changes as needed */
     /* _ST_'s bits describe the peripherals desired state:
         bit 1  (1) - pump 1
@@ -1868,56 +7076,38 @@ ActivateDevicesState(const short _ST_) {
         bit 4  (8) - heater wanted
         bit 5 (16) - heater forced
         bit 6 (32) - want heat pump LOW on
-        bit 7 (64) - want heat pump HIGH on */
-    if (_ST_ &   1)  { if (CanTurnPump1On()) TurnPump1On(); } else { if (CanTurnPump1Off()) TurnPump1Off(); }
-    if (_ST_ &   2)  { if (CanTurnPump2On()) TurnPump2On(); } else { if (CanTurnPump2Off()) TurnPump2Off(); }
-    if (_ST_ &   4)  {  if (CanTurnValveOn()) TurnValveOn(); } else {  if (CanTurnValveOff()) TurnValveOff(); }
-    if (_ST_ &   8)  {  if (CanTurnHeaterOn()) TurnHeaterOn(); }
-    if (_ST_ &  16) { TurnHeaterOn(); }
-    if ( !(_ST_ & 24) ) { if (CanTurnHeaterOff()) TurnHeaterOff(); }
-    if (_ST_ &  32)  { if (CanTurnHeatPumpLowOn()) TurnHeatPumpLowOn(); } else { if (CanTurnHeatPumpLowOff()) TurnHeatPumpLowOff(); }
-    if (_ST_ &  64)  { if (CanTurnHeatPumpHighOn()) TurnHeatPumpHighOn(); } else { if (CanTurnHeatPumpHighOff()) TurnHeatPumpHighOff(); }
-    
-    SCPump1++;
-    SCPump2++;
-    SCValve++;
-    SCHeater++;
-    SCHP_low++;
-    SCHP_high++;
+        bit 7 (64) - want heat pump HIGH on
+        bit 8 (128) and up - extra devices */
+    StatsAdvance( cycle_time );
+    for (i=0;i<devices_count;i++) {
+        struct device *d = &devices[i];
+        unsigned char reason = wanted_reason;
+        if ((reason == HJ_CONTROL) && ((forced_on | forced_off) & d->bit)) reason = HJ_OVERRIDE;
+        if (_ST_ & d->force_bit) { DeviceTurn(d, 1, HJ_FORCED); }
+        else if (_ST_ & d->bit) { if (DeviceCanTurnOn(d)) DeviceTurn(d, 1, reason); }
+        else if (DeviceCanTurnOff(d)) {
+            DeviceTurn(d, 0, ((reason == HJ_CONTROL) && (power_denied & d->bit)) ? HJ_POWER : reason);
+        }
+    }
+
+    for (i=0;i<devices_count;i++) ctrlstatecycles[devices[i].ctrl]++;
+    stats_cycles[stats_slot % STATS_SLOTS]++;
+    for (i=0;i<devices_count;i++) {
+        if (!controls[devices[i].ctrl]) continue;
+        dev_stats[i].on_cycles[stats_slot % STATS_SLOTS]++;
+        dev_stats[i].on_s += 10;
+    }
     SCPowerByBattery++;
 
-    /* Calculate total and night tariff electrical power used here: */
-    if ( CHeater ) {
-        TotalPowerUsed += HEATERPPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += HEATERPPC; }
-    }
-    if ( CPump1 ) {
-        TotalPowerUsed += PUMP1PPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += PUMP1PPC; }
-    }
-    if ( CPump2 ) {
-        TotalPowerUsed += PUMP2PPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += PUMP2PPC; }
-    }
-    if ( CValve ) {
-        TotalPowerUsed += VALVEPPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += VALVEPPC; }
-    }
-    TotalPowerUsed += SELFPPC;
-    if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += SELFPPC; }
-
-    /* calculate desired new state */
-    if ( CPump1 ) new_state |= 1;
-    if ( CPump2 ) new_state |= 2;
-    if ( CValve ) new_state |= 4;
-    if ( CHeater ) new_state |= 8;
-    if ( CHP_low ) new_state |= 32;
-    if ( CHP_high ) new_state |= 64;
-    /* if current state and new state are different... */
-    if ( current_state != new_state ) {
-        /* then put state on GPIO pins - this prevents lots of toggling at every 10s decision */
-        ControlStateToGPIO();
+    /* Calculate total and cheap tariff electrical power used here, and what it cost: */
+    used = SELFPPC;
+    for (i=0;i<devices_count;i++) {
+        if ( controls[devices[i].ctrl] && devices[i].power ) used += devices[i].power/(6*60);
     }
+    TotalPowerUsed += used;
+    if ( TariffCheap() ) { NightlyPowerUsed += used; }
+    PowerCost += used * tariff->rates[TariffRate()] / 1000;
+
 }
 
 void
@@ -1943,15 +7133,83 @@ AdjustWantedStateForBatteryPower(unsigned short WS) {
     }
 }
 
+/* one control cycle on what was read in: decide what the devices should do and do it in
+   controls[]; the daemon and libhwwm both run it. Return the wanted state */
+unsigned short
+ControlStep() {
+    unsigned short DevicesWantedState = 0;
+
+    CalcTenvAverage();
+    HeatCurveUpdate();
+    ForcesExpire();
+    HistPush();
+    ModelUpdate();
+    /* do what "mode" from CFG files says - watch the LOG file to see used values */
+    switch (cfg.mode) {
+        default:
+        case 0: /* 0=ALL OFF */
+        DevicesWantedState = 0;
+        wanted_reason = HJ_MODE_OFF;
+        break;
+        case 1: /* 1=AUTO - tries to reach desired water temp efficiently */
+        if ( CriticalTempsFound() ) {
+            /* ActivateEmergencyHeatTransfer(); */
+            /* Set DevicesWantedState bits for both pumps and valve */
+            DevicesWantedState = 1 + 2 + 4;
+            wanted_reason = HJ_EMERGENCY;
+            if ( !AlarmRaised ) {
+                log_message(LOG_FILE,"ALARM: Activating emergency cooling!");
+                AlarmRaised = 1;
+            }
+        }
+        else {
+            if ( AlarmRaised ) {
+                log_message(LOG_FILE,"INFO: Critical condition resolved. Running normally.");
+                AlarmRaised = 0;
+            }
+            DevicesWantedState = ComputeWantedState();
+            wanted_reason = HJ_CONTROL;
+        }
+        break;
+    }
+    AdjustWantedStateForBatteryPower(DevicesWantedState);
+    ActivateDevicesState(DevicesWantedState);
+    ComputeSendBits();
+    return DevicesWantedState;
+}
+
+#ifndef HWWM_LIB
+/* the I/O and decisions of one cycle: from collecting the sensor reads to saving the state */
+void
+RunCycle() {
+    unsigned short DevicesWantedState, current_state;
+
+    ReadSensors();
+    ReadExternalPower();
+    ReadCommsPins();
+    current_state = DevicesState();
+    DevicesWantedState = ControlStep();
+    /* put state on GPIO pins only on a change - this prevents lots of toggling at every 10s decision */
+    if ( current_state != DevicesState() ) ControlStateToGPIO();
+    SiteAnnounce();
+    WriteCommsPins();
+    LogData(DevicesWantedState);
+    MqttUpdate();
+    /* a warming up controller has nothing worth restoring */
+    if ( !just_started ) SaveState();
+}
+#endif
+
+/* hwwm-bench.c takes the whole daemon but its main() */
+#if !defined(HWWM_LIB) && !defined(HWWM_BENCH)
 int
 main(int argc, char *argv[])
 {
     /* set iter to its max value - makes sure we get a clock reading upon start */
     unsigned short iter = 29;
     unsigned short iter_P = 0;
-    unsigned short AlarmRaised = 0;
-    unsigned short DevicesWantedState = 0;
     struct timeval tvalBefore, tvalAfter;
+    struct timespec cycle_start;
 
     SetDefaultCfg();
 
@@ -1985,33 +7243,89 @@ main(int argc, char *argv[])
     just_started = 4;
     TotalPowerUsed = 0;
     NightlyPowerUsed = 0;
+    PowerCost = 0;
 
     parse_config();
 
     ReadPersistentData();
 
-    /* Enable GPIO pins */
-    if ( ! EnableGPIOpins() ) {
-        log_message(LOG_FILE,"ALARM: Cannot enable GPIO! Aborting run.");
-        exit(11);
+    ReadModelData();
+
+    /* a recent saved state beats the defaults and the 10 minute files - resume from it;
+       one cycle of just_started is kept so sensor values snap to the first reads */
+    StateOpen();
+    if ( RestoreState() ) just_started = 2;
+    else if ( handed_over ) {
+        log_message(LOG_FILE,"WARNING: Took over from a running hwwm without its state - relays start from OFF.");
+    }
+    cycle_time = time(NULL);
+    JournalOpen( just_started == 2 );
+
+    /* pins of a hwwm taken over from are set up already - and setting the direction
+       again would drive the outputs low */
+    if ( handed_over ) {
+        log_message(LOG_FILE,"INFO: Took over from the previous hwwm binary. GPIO left as it was.");
+    }
+    else {
+        /* Enable GPIO pins */
+        if ( ! EnableGPIOpins() ) {
+            log_message(LOG_FILE,"ALARM: Cannot enable GPIO! Aborting run.");
+            exit(11);
+        }
+
+        /* Set GPIO directions */
+        if ( ! SetGPIODirection() ) {
+            log_message(LOG_FILE,"ALARM: Cannot set GPIO direction! Aborting run.");
+            exit(12);
+        }
+    }
+
+    /* Start sensor readers and the first round of reads */
+    if ( ! StartSensorReaders() ) {
+        log_message(LOG_FILE,"ALARM: Cannot start sensor reader threads! Aborting run.");
+        exit(13);
+    }
+    StartSensorsAcquisition();
+
+    /* Start the output sinks - from here on the data files and pushes are written off the control thread */
+    if ( ! SinksStart() ) {
+        log_message(LOG_FILE,"ALARM: Cannot start output sink threads! Aborting run.");
+        exit(16);
     }
 
-    /* Set GPIO directions */
-    if ( ! SetGPIODirection() ) {
-        log_message(LOG_FILE,"ALARM: Cannot set GPIO direction! Aborting run.");
-        exit(12);
+    /* Start the log keeper - rotating and compressing the logs, off the control thread too */
+    if ( ! LogsStart() ) {
+        log_message(LOG_FILE,"ALARM: Cannot start the log keeper thread! Aborting run.");
+        exit(17);
     }
 
     /* By default all control states are 0 == OFF;
     With putting output pins to OFF, we make sure that relay will obey
     inverting output setting of config file at startup, and thus avoid
-    an unnecessary very short toggling of output relays on startup */
+    an unnecessary very short toggling of output relays on startup;
+    relays handed over with the state stay where they were */
     ControlStateToGPIO();
-    
+
+    /* Start the watchdogs - keepalives only come from cycles done on time */
+    if ( ! WatchdogStart() ) {
+        log_message(LOG_FILE,"ALARM: Cannot start the configured watchdog! Aborting run.");
+        exit(15);
+    }
+    atexit(WatchdogStop);
+
+    /* Join the other hwwm nodes sharing the site power budget, if any */
+    SiteStart();
+
+    /* Take commands from the control socket between cycles */
+    CtlStart();
+
     GetCurrentTime();
 
     do {
+        if ( need_to_stop ) Stop();
         /* Do all the important stuff... */
+        clock_gettime( CLOCK_MONOTONIC, &cycle_start );
+        cycle_time = time(NULL);
         if ( gettimeofday( &tvalBefore, NULL ) ) {
             log_message(LOG_FILE,"WARNING: error getting tvalBefore...");
         }
@@ -2020,6 +7334,8 @@ main(int argc, char *argv[])
             need_to_read_cfg = 0;
             just_started = 1;
             parse_config();
+            /* back on the COMMs pins - the link is not needed any more */
+            if ( !HPLinkUsed() ) HPLinkClose();
             iter = 30;
         }
         /* get the current hour every 5 minutes for electric heater schedule */
@@ -2027,6 +7343,7 @@ main(int argc, char *argv[])
             iter = 0;
             GetCurrentTime();
             ReadHAsettings();
+            WriteDeviceStats();
             /* and write out persistent power use data every 10 minutes */
             iter_P++;
             if ( iter_P == 2) {
@@ -2035,53 +7352,28 @@ main(int argc, char *argv[])
             }
         }
         iter++;
-        ReadSensors();
-        ReadExternalPower();
-        ReadCommsPins();
-        CalcTenvAverage();
-        /* do what "mode" from CFG files says - watch the LOG file to see used values */
-        switch (cfg.mode) {
-            default:
-            case 0: /* 0=ALL OFF */
-            DevicesWantedState = 0;
-            break;
-            case 1: /* 1=AUTO - tries to reach desired water temp efficiently */
-            if ( CriticalTempsFound() ) {
-                /* ActivateEmergencyHeatTransfer(); */
-                /* Set DevicesWantedState bits for both pumps and valve */
-                DevicesWantedState = 1 + 2 + 4;
-                if ( !AlarmRaised ) {
-                    log_message(LOG_FILE,"ALARM: Activating emergency cooling!");
-                    AlarmRaised = 1;
-                }
-            }
-            else {
-                if ( AlarmRaised ) {
-                    log_message(LOG_FILE,"INFO: Critical condition resolved. Running normally.");
-                    AlarmRaised = 0;
-                }
-                DevicesWantedState = ComputeWantedState();
-            }
-            break;
+        RunCycle();
+        if ( need_to_hand_over ) {
+            need_to_hand_over = 0;
+            HandOver();
         }
-        AdjustWantedStateForBatteryPower(DevicesWantedState);
-        ActivateDevicesState(DevicesWantedState);
-        WriteCommsPins();
-        LogData(DevicesWantedState);
+        /* sensors get read during the sleep, ready for the next cycle */
+        StartSensorsAcquisition();
+        WatchdogKick( ms_since(&cycle_start) );
         ProgramRunCycles++;
         if ( gettimeofday( &tvalAfter, NULL ) ) {
             log_message(LOG_FILE,"WARNING: error getting tvalAfter...");
-            sleep( 7 );
+            CycleSleep( 7000000 );
         }
         else {
             /* use hardcoded sleep() if time is skewed (for eg. daylight saving, ntp adjustments, etc.) */
             if ((tvalAfter.tv_sec - tvalBefore.tv_sec) > 12) {
-                sleep( 7 );
+                CycleSleep( 7000000 );
             }
             else {
                 /* otherwise we have valid time data - so calculate exact sleep time
                 so period between active operations is bang on 10 seconds */
-                usleep(10000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
+                CycleSleep(10000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
                 + tvalAfter.tv_usec) - tvalBefore.tv_usec));
             }
         }
@@ -2097,5 +7389,152 @@ main(int argc, char *argv[])
 
     return(225);
 }
+#endif
+
+#ifdef HWWM_LIB
+
+#include "libhwwm.h"
+
+_Static_assert( (HWWM_HEATER == DEV_HEATER) && (HWWM_HP_HIGH == DEV_HP_HIGH) && (HWWM_EXTRA(1) == DEV_EXTRA(0)) &&
+                (HWWM_SENSORS == MAXSENSORS), "libhwwm.h is out of step with hwwm.c" );
+
+/* LIBHWWM: a context holds everything of a controller that lives from one cycle to the
+   next; a step loads it into the globals of the calling thread, runs the cycle and
+   stores it back */
+struct hwwm_ctx
+{
+    struct saved_state s;
+    struct cfg_struct cfg;
+    struct device devices[MAXDEVICES];
+    short   devices_count;
+    short   probes_count[MAXSENSORS+1];
+    struct tariff_calendar tariff;
+    struct heat_curve curve;
+    unsigned short current_timer_hour;
+    unsigned short current_month;
+    unsigned short HPmode;
+    float   furnace_water_target;
+    float   nightEnergyTemp;
+    unsigned long ProgramRunCycles;
+    short   just_started;
+    unsigned short AlarmRaised;
+    unsigned short acs_allowed_original;
+    unsigned short boiler_allowed_original;
+    short   stopped;
+};
+
+/* the globals as a thread starts with them - what a new controller starts from; taken
+   once, by the first thread to make a controller, before it runs any */
+struct hwwm_ctx *lib_pristine = NULL;
+pthread_once_t lib_pristine_once = PTHREAD_ONCE_INIT;
+
+void
+CtxStore(struct hwwm_ctx *c) {
+    StateStore( &c->s );
+    c->cfg = cfg;
+    memcpy( c->devices, devices, sizeof c->devices );
+    c->devices_count = devices_count;
+    memcpy( c->probes_count, probes_count, sizeof c->probes_count );
+    c->current_timer_hour = current_timer_hour;
+    c->current_month = current_month;
+    c->HPmode = HPmode;
+    c->furnace_water_target = furnace_water_target;
+    c->nightEnergyTemp = nightEnergyTemp;
+    c->ProgramRunCycles = ProgramRunCycles;
+    c->just_started = just_started;
+    c->AlarmRaised = AlarmRaised;
+    c->acs_allowed_original = acs_allowed_original;
+    c->boiler_allowed_original = boiler_allowed_original;
+}
+
+void
+CtxLoad(struct hwwm_ctx *c) {
+    hist = c->s.hist;
+    tariff = &c->tariff;
+    curve = &c->curve;
+    StateLoad( &c->s );
+    cfg = c->cfg;
+    memcpy( devices, c->devices, sizeof devices );
+    devices_count = c->devices_count;
+    memcpy( probes_count, c->probes_count, sizeof probes_count );
+    current_timer_hour = c->current_timer_hour;
+    current_month = c->current_month;
+    HPmode = c->HPmode;
+    furnace_water_target = c->furnace_water_target;
+    nightEnergyTemp = c->nightEnergyTemp;
+    ProgramRunCycles = c->ProgramRunCycles;
+    just_started = c->just_started;
+    AlarmRaised = c->AlarmRaised;
+    acs_allowed_original = c->acs_allowed_original;
+    boiler_allowed_original = c->boiler_allowed_original;
+}
+
+void
+LibPristine() {
+    /* no history yet - it stays all zeros */
+    lib_pristine = calloc( 1, sizeof *lib_pristine );
+    if (lib_pristine) CtxStore( lib_pristine );
+}
+
+struct hwwm_ctx *
+hwwm_new(const char *cfg_file) {
+    struct hwwm_ctx *c;
+
+    pthread_once( &lib_pristine_once, LibPristine );
+    if (lib_pristine == NULL) return NULL;
+    c = malloc( sizeof *c );
+    if (c == NULL) return NULL;
+    *c = *lib_pristine;
+    CtxLoad( c );
+    SetDefaultCfg();
+    /* no file - the defaults */
+    config_file = cfg_file ? cfg_file : "";
+    just_started = 4;
+    parse_config();
+    CtxStore( c );
+    return c;
+}
+
+void
+hwwm_free(struct hwwm_ctx *c) {
+    free( c );
+}
+
+int
+hwwm_step(struct hwwm_ctx *c, const struct hwwm_inputs *in, time_t now, struct hwwm_outputs *out) {
+    float vals[MAXSENSORS+1];
+    short i;
+
+    memset( out, 0, sizeof *out );
+    if (c->stopped) {
+        out->stopped = 1;
+        return -1;
+    }
+    CtxLoad( c );
+    cycle_time = now;
+    if ( just_started ) just_started--;
+    /* the clock is looked at every 5 minutes, as in the daemon */
+    if ( (ProgramRunCycles % 30) == 0 ) GetCurrentTime();
+    for (i=1;i<=MAXSENSORS;i++) vals[i] = in->t[i];
+    if ( ! SensorsUpdate(vals) ) {
+        for (i=0;i<devices_count;i++) controls[devices[i].ctrl] = 0;
+        c->stopped = 1;
+    }
+    else {
+        CPowerByBatteryPrev = CPowerByBattery;
+        CPowerByBattery = in->on_battery ? 1 : 0;
+        COMMS = in->comms & 3;
+        out->wanted = ControlStep();
+        out->send_bits = sendBits;
+    }
+    ProgramRunCycles++;
+    out->state = DevicesState();
+    out->furnace_water_target = furnace_water_target;
+    out->stopped = c->stopped;
+    CtxStore( c );
+    return c->stopped ? -1 : 0;
+}
+
+#endif /* HWWM_LIB */
 
 /* EOF */
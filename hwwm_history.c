@@ -0,0 +1,416 @@
+/*
+* hwwm_history.c
+*
+* Time-indexed range queries over hwwm data log files - see hwwm_history.h
+* Plamen Petrov
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "hwwm_history.h"
+
+#define HH_GZ_CHUNK     16384
+
+/* lines of a plain log, or of a gzip one inflated from its start or from a flush point */
+struct hh_reader
+{
+    FILE    *fp;
+    int     gz;
+    int     raw;
+    z_stream z;
+    unsigned char in[HH_GZ_CHUNK];
+    char    out[HH_GZ_CHUNK];
+    size_t  out_pos;
+    size_t  out_len;
+    int     done;
+};
+
+static const char *hh_col_names[HH_TOTALCOLS] = { "Tkotel", "Tkolektor", "TboilerLow",
+                                                  "TboilerHigh", "Tenv", "fwt" };
+
+int
+hh_column_by_name(const char *name)
+{
+    for (int i=0;i<HH_TOTALCOLS;i++) {
+        if (strcasecmp(name, hh_col_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *
+hh_column_name(int col)
+{
+    if ((col < 0) || (col >= HH_TOTALCOLS)) return "?";
+    return hh_col_names[col];
+}
+
+/* parse "YYYY-MM-DD HH:MM:SS" into local time; mktime() is only called once per
+   hour of log - the rest is plain arithmetic on minutes and seconds */
+static time_t
+hh_parse_time(const char *s)
+{
+    static char last_hour[14];
+    static time_t last_hour_t = -1;
+    struct tm tm;
+    int mm, ss;
+
+    if ((s[4] != '-') || (s[7] != '-') || (s[10] != ' ') || (s[13] != ':') || (s[16] != ':')) return -1;
+    mm = (s[14]-'0')*10 + (s[15]-'0');
+    ss = (s[17]-'0')*10 + (s[18]-'0');
+    if ((mm < 0) || (mm > 59) || (ss < 0) || (ss > 60)) return -1;
+    if ((last_hour_t == -1) || memcmp(last_hour, s, 13)) {
+        memset(&tm, 0, sizeof tm);
+        tm.tm_year = atoi(s) - 1900;
+        tm.tm_mon = atoi(s+5) - 1;
+        tm.tm_mday = atoi(s+8);
+        tm.tm_hour = atoi(s+11);
+        tm.tm_isdst = -1;
+        last_hour_t = mktime(&tm);
+        if (last_hour_t == -1) return -1;
+        memcpy(last_hour, s, 13);
+    }
+    return last_hour_t + mm*60 + ss;
+}
+
+/* data lines look like:
+   2020-11-02 14:20:31 14,  36.125,12.500,38.000,41.250,10.271  40,63,0,32.000  WANTED: ...
+   anything else (compute:, GetCurrentTime, ***) is skipped */
+int
+hh_parse_line(const char *line, struct hh_sample *s)
+{
+    char *e;
+    const char *p;
+    short i;
+
+    if (strlen(line) < 22) return -1;
+    if ((s->t = hh_parse_time(line)) == -1) return -1;
+    p = line + 20;
+    strtol(p, &e, 10);
+    if ((e == p) || (*e != ',')) return -1;
+    for (i=0;i<HH_COL_FWT;i++) {
+        p = e + 1;
+        s->v[i] = strtof(p, &e);
+        if (e == p) return -1;
+        if ((i < HH_COL_FWT-1) && (*e != ',')) return -1;
+    }
+    /* skip wanted_T, abs_max and night_boost to get to furnace water target */
+    for (i=0;i<3;i++) {
+        p = e;
+        strtol(p, &e, 10);
+        if ((e == p) || (*e != ',')) return -1;
+        e++;
+    }
+    p = e;
+    s->v[HH_COL_FWT] = strtof(p, &e);
+    if (e == p) return -1;
+    return 0;
+}
+
+/* open path at offset; a gzip file is inflated with its header from offset 0, and as a raw
+   deflate stream from a flush point further on; return 0 on success */
+static int
+hh_reader_open(struct hh_reader *r, const char *path, int gz, off_t offset)
+{
+    memset(r, 0, sizeof *r);
+    r->gz = gz;
+    r->raw = gz && offset;
+    r->fp = fopen(path, "r");
+    if (r->fp == NULL) return -1;
+    if (fseeko(r->fp, offset, SEEK_SET) ||
+        (gz && (inflateInit2(&r->z, r->raw ? -MAX_WBITS : MAX_WBITS+16) != Z_OK))) {
+        fclose(r->fp);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+hh_reader_close(struct hh_reader *r)
+{
+    if (r->gz) inflateEnd(&r->z);
+    fclose(r->fp);
+}
+
+/* inflate the next piece of the file into out[]; return 0 at its end or on error */
+static int
+hh_reader_fill(struct hh_reader *r)
+{
+    int ret;
+
+    r->out_pos = r->out_len = 0;
+    while (!r->done && !r->out_len) {
+        if (!r->z.avail_in) {
+            r->z.avail_in = fread(r->in, 1, sizeof r->in, r->fp);
+            r->z.next_in = r->in;
+            if (!r->z.avail_in) break;
+        }
+        r->z.next_out = (unsigned char *)r->out;
+        r->z.avail_out = sizeof r->out;
+        ret = inflate(&r->z, Z_NO_FLUSH);
+        r->out_len = sizeof r->out - r->z.avail_out;
+        if (ret == Z_STREAM_END) {
+            /* a gzip file may be several members one after the other; a raw stream from a
+               flush point ends with its member, and hwwm segments are one member */
+            if (r->raw || (inflateReset(&r->z) != Z_OK)) r->done = 1;
+        }
+        else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) r->done = 1;
+    }
+    return r->out_len > 0;
+}
+
+/* getline() for a reader */
+static ssize_t
+hh_reader_line(struct hh_reader *r, char **line, size_t *cap)
+{
+    size_t len = 0, n;
+    char *nl, *p;
+
+    if (!r->gz) return getline(line, cap, r->fp);
+    while (1) {
+        if ((r->out_pos == r->out_len) && !hh_reader_fill(r)) break;
+        nl = memchr(r->out + r->out_pos, '\n', r->out_len - r->out_pos);
+        n = nl ? (size_t)(nl - (r->out + r->out_pos)) + 1 : r->out_len - r->out_pos;
+        if (len + n + 1 > *cap) {
+            p = realloc(*line, len + n + 1 + 256);
+            if (p == NULL) return -1;
+            *line = p;
+            *cap = len + n + 1 + 256;
+        }
+        memcpy(*line + len, r->out + r->out_pos, n);
+        len += n;
+        r->out_pos += n;
+        if (nl) break;
+    }
+    if (!len) return -1;
+    (*line)[len] = 0;
+    return len;
+}
+
+static void
+hh_add_entry(struct hh_file *hf, time_t t, off_t offset)
+{
+    /* grow in chunks - one entry per HH_INDEX_STRIDE of log is not a lot */
+    if ((hf->idx_count % 1024) == 0) {
+        struct hh_entry *n = realloc(hf->idx, (hf->idx_count + 1024) * sizeof(struct hh_entry));
+        if (n == NULL) return;
+        hf->idx = n;
+    }
+    hf->idx[hf->idx_count].t = t;
+    hf->idx[hf->idx_count].offset = offset;
+    hf->idx_count++;
+}
+
+static void
+hh_load_index(struct hh_file *hf, ino_t ino, off_t size)
+{
+    char path[300];
+    struct hh_idx_header h;
+    long long pair[2];
+    FILE *fp;
+
+    snprintf(path, sizeof path, "%s.idx", hf->path);
+    fp = fopen(path, "r");
+    if (fp == NULL) return;
+    if ((fread(&h, sizeof h, 1, fp) != 1) || memcmp(h.magic, HH_IDX_MAGIC, 8) ||
+        (h.ino != (long long)ino) || (h.indexed_size > (long long)size)) {
+        /* stale index - the log was replaced or truncated; start over */
+        fclose(fp);
+        return;
+    }
+    for (long long i=0;i<h.count;i++) {
+        if (fread(pair, sizeof pair, 1, fp) != 1) {
+            /* broken index - start over */
+            hf->idx_count = 0;
+            fclose(fp);
+            return;
+        }
+        hh_add_entry(hf, (time_t)pair[0], (off_t)pair[1]);
+    }
+    fclose(fp);
+    hf->indexed_size = h.indexed_size;
+    hf->first_t = h.first_t;
+    hf->last_t = h.last_t;
+}
+
+static void
+hh_save_index(struct hh_file *hf, ino_t ino)
+{
+    char path[300], tmp[310];
+    struct hh_idx_header h;
+    long long pair[2];
+    FILE *fp;
+
+    snprintf(path, sizeof path, "%s.idx", hf->path);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    /* a read-only log dir is fine - the index just lives in memory this time */
+    if (fp == NULL) return;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, HH_IDX_MAGIC, 8);
+    h.ino = ino;
+    h.indexed_size = hf->indexed_size;
+    h.first_t = hf->first_t;
+    h.last_t = hf->last_t;
+    h.count = hf->idx_count;
+    fwrite(&h, sizeof h, 1, fp);
+    for (unsigned long i=0;i<hf->idx_count;i++) {
+        pair[0] = hf->idx[i].t;
+        pair[1] = hf->idx[i].offset;
+        fwrite(pair, sizeof pair, 1, fp);
+    }
+    if (fclose(fp) == 0) rename(tmp, path);
+    else unlink(tmp);
+}
+
+/* is path a gzip file? */
+static int
+hh_is_gz(const char *path)
+{
+    unsigned char m[2];
+    FILE *fp = fopen(path, "r");
+    int gz;
+
+    if (fp == NULL) return 0;
+    gz = (fread(m, 1, 2, fp) == 2) && (m[0] == 0x1f) && (m[1] == 0x8b);
+    fclose(fp);
+    return gz;
+}
+
+int
+hh_open(struct hh_file *hf, const char *path)
+{
+    struct stat st;
+    struct hh_sample s;
+    struct hh_reader r;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    off_t pos, next_mark;
+
+    memset(hf, 0, sizeof *hf);
+    snprintf(hf->path, sizeof hf->path, "%s", path);
+    if (stat(path, &st)) return -1;
+    hf->gz = hh_is_gz(path);
+    hh_load_index(hf, st.st_ino, st.st_size);
+    if (hf->indexed_size == st.st_size) return 0;
+
+    /* index the part of the log written since last time; a gzip file without the index
+       of hwwm gets one entry for all of it */
+    if (hf->gz) {
+        hf->idx_count = 0;
+        hf->indexed_size = 0;
+    }
+    pos = hf->indexed_size;
+    if (hh_reader_open(&r, path, hf->gz, pos)) return -1;
+    next_mark = hf->idx_count ? (hf->idx[hf->idx_count-1].offset / HH_INDEX_STRIDE + 1) * HH_INDEX_STRIDE : 0;
+    while ((len = hh_reader_line(&r, &line, &cap)) > 0) {
+        /* a partial line is still being written - leave it for the next run */
+        if (line[len-1] != '\n') break;
+        if (hh_parse_line(line, &s) == 0) {
+            /* keep index times non-decreasing so the binary search holds even
+               across a DST step back */
+            if (hf->idx_count || hf->first_t) {
+                if (s.t < hf->last_t) s.t = hf->last_t;
+            }
+            else hf->first_t = s.t;
+            hf->last_t = s.t;
+            if ((pos >= next_mark) && !(hf->gz && hf->idx_count)) {
+                /* the one entry of a gzip file is its start */
+                hh_add_entry(hf, s.t, hf->gz ? 0 : pos);
+                next_mark = (pos / HH_INDEX_STRIDE + 1) * HH_INDEX_STRIDE;
+            }
+        }
+        pos += len;
+    }
+    free(line);
+    hh_reader_close(&r);
+    hf->indexed_size = hf->gz ? st.st_size : pos;
+    hh_save_index(hf, st.st_ino);
+    return 0;
+}
+
+void
+hh_close(struct hh_file *hf)
+{
+    free(hf->idx);
+    hf->idx = NULL;
+    hf->idx_count = 0;
+}
+
+void
+hh_buckets_init(struct hh_bucket *out, int npoints, time_t from, time_t to)
+{
+    for (int i=0;i<npoints;i++) {
+        out[i].start = from + (time_t)(((double)(to - from) * i) / npoints);
+        out[i].count = 0;
+        out[i].min = 0;
+        out[i].max = 0;
+        /* avg holds the running sum until hh_buckets_finish() */
+        out[i].avg = 0;
+    }
+}
+
+void
+hh_buckets_finish(struct hh_bucket *out, int npoints)
+{
+    for (int i=0;i<npoints;i++) {
+        if (out[i].count) out[i].avg /= out[i].count;
+    }
+}
+
+long
+hh_query(struct hh_file *hf, int col, time_t from, time_t to, int npoints, struct hh_bucket *out)
+{
+    struct hh_sample s;
+    struct hh_reader r;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    off_t pos = 0;
+    long used = 0;
+    unsigned long lo, hi;
+    int b;
+
+    if ((col < 0) || (col >= HH_TOTALCOLS) || (npoints < 1) || (to <= from)) return -1;
+    if ((hf->idx_count == 0) || (hf->last_t < from) || (hf->first_t >= to)) return 0;
+
+    /* binary search for the last index entry at or before 'from' */
+    lo = 0;
+    hi = hf->idx_count;
+    while (lo < hi) {
+        unsigned long mid = (lo + hi) / 2;
+        if (hf->idx[mid].t <= from) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo) pos = hf->idx[lo-1].offset;
+
+    if (hh_reader_open(&r, hf->path, hf->gz, pos)) return -1;
+    while (((len = hh_reader_line(&r, &line, &cap)) > 0) && (hf->gz || (pos < hf->indexed_size))) {
+        pos += len;
+        if (hh_parse_line(line, &s)) continue;
+        if (s.t < from) continue;
+        if (s.t >= to) break;
+        b = (int)(((double)(s.t - from) * npoints) / (double)(to - from));
+        if (b >= npoints) b = npoints - 1;
+        if (!out[b].count || (s.v[col] < out[b].min)) out[b].min = s.v[col];
+        if (!out[b].count || (s.v[col] > out[b].max)) out[b].max = s.v[col];
+        out[b].avg += s.v[col];
+        out[b].count++;
+        used++;
+    }
+    free(line);
+    hh_reader_close(&r);
+    return used;
+}
+
+/* EOF */
@@ -0,0 +1,116 @@
+/*
+* hwwm_history.h
+*
+* Time-indexed range queries over hwwm data log files (hwwm_data.log).
+* Plamen Petrov
+*
+* Every history file gets a sparse time index kept in a side file next to it
+* (<file>.idx). The index holds one (time, offset) entry for the first data line
+* after every HH_INDEX_STRIDE bytes of the log, so a query does a binary search
+* in the index and then reads only the lines inside the requested time range:
+* O(log n + k). The index is extended incrementally when the log grows and is
+* rebuilt when the log gets replaced or truncated.
+*
+* Segments hwwm rotated and gzipped (<log>-YYYYmmdd-HHMMSS.gz) are read too: hwwm
+* does a full flush of the deflate stream at every index entry and writes the
+* index with the segment, offsets being those of the flush points in the .gz -
+* a query inflates from the entry before its range on. Other gzip files are
+* indexed with one entry and read from their start.
+*/
+
+#ifndef HWWM_HISTORY_H
+#define HWWM_HISTORY_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* bytes of log between two consecutive index entries */
+#define HH_INDEX_STRIDE     32768
+
+/* columns of a data log line, in the order LogData() writes them */
+#define HH_COL_TKOTEL       0
+#define HH_COL_TKOLEKTOR    1
+#define HH_COL_TBOILERLOW   2
+#define HH_COL_TBOILERHIGH  3
+#define HH_COL_TENV         4
+#define HH_COL_FWT          5
+#define HH_TOTALCOLS        6
+
+#define HH_IDX_MAGIC    "HWWMIX01"
+
+/* on-disk index header; entries follow as pairs of long long (time, offset) */
+struct hh_idx_header
+{
+    char        magic[8];
+    long long   ino;
+    long long   indexed_size;
+    long long   first_t;
+    long long   last_t;
+    long long   count;
+};
+
+/* one index entry: time of a data line and the file offset it starts at */
+struct hh_entry
+{
+    time_t  t;
+    off_t   offset;
+};
+
+/* an opened history file together with its index */
+struct hh_file
+{
+    char    path[256];
+    struct hh_entry *idx;
+    unsigned long idx_count;
+    off_t   indexed_size;
+    time_t  first_t;
+    time_t  last_t;
+    int     gz;
+};
+
+/* one downsampled point of a query result */
+struct hh_bucket
+{
+    time_t  start;
+    unsigned long count;
+    float   min;
+    float   max;
+    float   avg;
+};
+
+/* parsed data log line */
+struct hh_sample
+{
+    time_t  t;
+    float   v[HH_TOTALCOLS];
+};
+
+/* return column number for its name ("Tkotel", "Tkolektor", ...) or -1 */
+int hh_column_by_name(const char *name);
+
+/* name of a column number */
+const char *hh_column_name(int col);
+
+/* parse one data log line; return 0 on success, -1 if it is not a data line */
+int hh_parse_line(const char *line, struct hh_sample *s);
+
+/* open history file, load its index and bring it up to date; return 0 on success */
+int hh_open(struct hh_file *hf, const char *path);
+
+/* release memory held by an opened history file */
+void hh_close(struct hh_file *hf);
+
+/* fill npoints buckets spanning [from, to) with min/max/avg of column col;
+   buckets of several files can be accumulated by calling this once per file
+   on the same out[] array after clearing it with hh_buckets_init();
+   return number of samples used or -1 on error */
+long hh_query(struct hh_file *hf, int col, time_t from, time_t to,
+              int npoints, struct hh_bucket *out);
+
+/* prepare npoints empty buckets spanning [from, to) */
+void hh_buckets_init(struct hh_bucket *out, int npoints, time_t from, time_t to);
+
+/* turn accumulated sums into averages once all files have been queried */
+void hh_buckets_finish(struct hh_bucket *out, int npoints);
+
+#endif
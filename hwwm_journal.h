@@ -0,0 +1,56 @@
+/*
+* hwwm_journal.h
+*
+* Layout of the hwwm device transition journal (/var/log/hwwm_journal).
+* Plamen Petrov
+*
+* The journal is a header naming the devices, followed by one fixed size record
+* for every device switched ON or OFF. Records only get appended; once the file
+* reaches HJ_MAX_SIZE - or the device table hwwm runs with is not the one in the
+* header - it is moved to <file>.1 and a new one is started.
+*/
+
+#ifndef HWWM_JOURNAL_H
+#define HWWM_JOURNAL_H
+
+#include <stdint.h>
+
+#define HJ_MAGIC        "HWWMJ001"
+#define HJ_MAX_SIZE     (4*1024*1024)
+#define HJ_MAXDEVICES   16
+#define HJ_NAMELEN      16
+
+/* dev of a record not about a device - hwwm (re)started */
+#define HJ_NODEV        255
+
+/* reason codes */
+#define HJ_START        0   /* hwwm started; to: 1 if it resumed from a saved state */
+#define HJ_CONTROL      1   /* the control logic wanted it */
+#define HJ_FORCED       2   /* forced ON */
+#define HJ_EMERGENCY    3   /* emergency cooling */
+#define HJ_MODE_OFF     4   /* mode=0 in the config */
+#define HJ_POWER        5   /* preempted by the power budget */
+#define HJ_OVERRIDE     6   /* forced ON or OFF over the control socket */
+#define HJ_REASONS      7
+
+#define HJ_REASON_NAMES { "start", "control", "forced", "emergency", "mode-off", "power", "override" }
+
+struct hj_header
+{
+    char        magic[8];
+    uint32_t    rec_size;
+    uint32_t    devices;
+    char        names[HJ_MAXDEVICES][HJ_NAMELEN];
+};
+
+struct hj_rec
+{
+    uint32_t    t;          /* seconds since epoch */
+    uint32_t    ran;        /* seconds spent in the old state */
+    uint8_t     dev;        /* number in the header names */
+    uint8_t     from;       /* old state: 0 OFF, 1 ON */
+    uint8_t     to;         /* new state */
+    uint8_t     reason;
+};
+
+#endif
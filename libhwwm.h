@@ -0,0 +1,73 @@
+/*
+* libhwwm.h
+*
+* The hwwm controller as a library: the same decision code the daemon runs, with
+* the state of each controller kept in a context of its own.
+* Plamen Petrov
+*
+* libhwwm.a is hwwm.c built with -DHWWM_LIB (see build.sh). A step takes the sensor
+* reads and the inputs of one 10 second cycle together with its wall clock time, and
+* tells which devices are ON after it - exactly what hwwm would do on the same reads.
+* Contexts do not share anything, and all the hwwm globals are thread local in the
+* library, so any number of controllers can be stepped in parallel threads - a
+* context can even move between threads, as long as only one steps it at a time.
+* A library controller does no I/O: it writes no logs, journal or data files.
+* Local time (TZ) and the tariff calendar of the config decide the cheap tariff hours,
+* as in the daemon.
+*
+*   struct hwwm_ctx *c = hwwm_new("sim.cfg");
+*   struct hwwm_inputs in = { { 0, 60, 20, 45, 40, 10 } };
+*   struct hwwm_outputs out;
+*   for (time_t t=start;t<end;t+=10) { hwwm_step(c, &in, t, &out); ...update in from out... }
+*   hwwm_free(c);
+*/
+
+#ifndef LIBHWWM_H
+#define LIBHWWM_H
+
+#include <time.h>
+
+/* sensors are numbered as in the config: 1 furnace, 2 solar collector, 3 boiler high,
+   4 boiler low, 5 environment, 6 to 9 the extra sensors */
+#define HWWM_SENSORS        9
+/* temp of a sensor that could not be read this cycle */
+#define HWWM_NO_READ        -200
+
+/* device bits of the state */
+#define HWWM_PUMP1          1
+#define HWWM_PUMP2          2
+#define HWWM_VALVE          4
+#define HWWM_HEATER         8
+#define HWWM_HP_LOW         32
+#define HWWM_HP_HIGH        64
+/* extra device N (1..4) of the config */
+#define HWWM_EXTRA(n)       (128<<((n)-1))
+
+struct hwwm_ctx;
+
+struct hwwm_inputs
+{
+    float   t[HWWM_SENSORS+1];      /* t[0] is not used */
+    short   on_battery;             /* the battery powered input */
+    unsigned short comms;           /* what hpm signals, 0..3 */
+};
+
+struct hwwm_outputs
+{
+    unsigned short state;           /* device bits ON after the step */
+    unsigned short wanted;          /* device bits the controller asked for */
+    unsigned short send_bits;       /* to signal hpm, 0..3 */
+    float   furnace_water_target;
+    short   stopped;                /* a safety-critical sensor failed - all OFF for good */
+};
+
+/* new controller with the settings of a hwwm config file (NULL: the defaults) and
+   nothing running; NULL if out of memory */
+struct hwwm_ctx *hwwm_new(const char *config_file);
+
+void hwwm_free(struct hwwm_ctx *ctx);
+
+/* run one control cycle at wall clock time now; return 0, or -1 once stopped */
+int hwwm_step(struct hwwm_ctx *ctx, const struct hwwm_inputs *in, time_t now, struct hwwm_outputs *out);
+
+#endif
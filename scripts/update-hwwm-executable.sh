@@ -4,17 +4,17 @@ daemon=hwwm
 daemon_pid=/run/$daemon.pid
 log_file=/var/log/$daemon.log
 
-echo "Trying to kill running daemon $daemon..."
-if [ ! -e $daemon_pid ]
+# a running daemon gets the new binary moved in place (never cp over a running binary)
+# and is told to re-execute it with SIGUSR2 - relays keep their state through the upgrade
+running=0
+if [ -e $daemon_pid ] && kill -0 `cat $daemon_pid` 2>/dev/null
 then
-    killall -e $daemon
-else
-    kill `cat $daemon_pid`
-    rm -f $daemon_pid
+    running=1
 fi
-sleep 1
 echo "Replacing /usr/sbin/$daemon with the one from /home/pi/$daemon..."
-cp /home/pi/$daemon/$daemon /usr/sbin
+cp /home/pi/$daemon/$daemon /usr/sbin/$daemon.new
+mv -f /usr/sbin/$daemon.new /usr/sbin/$daemon
+cp /home/pi/$daemon/$daemon-query /usr/sbin
 echo "Replacing $daemon-reload and $daemon-restart in /usr/sbin with ones from /home/pi/$daemon/scripts/..."
 cp /home/pi/$daemon/scripts/$daemon-reload /usr/sbin
 cp /home/pi/$daemon/scripts/$daemon-restart /usr/sbin
@@ -24,8 +24,16 @@ chmod +x /usr/sbin/$daemon-reload
 chmod +x /usr/sbin/$daemon-restart
 chmod +x /usr/sbin/$daemon-stop
 chmod +x /usr/sbin/hwwm_backup-cfg
-sleep 3
-echo "Starting $daemon again..."
-/usr/sbin/$daemon
+# hwwm rotates and compresses its own logs - the cron job moving the data log loses lines
+rm -f /etc/cron.hourly/move-hwwm-log /etc/logrotate.d/hwwm
+if [ $running -eq 1 ]
+then
+    echo "Telling running $daemon to hand over to the new binary..."
+    kill -USR2 `cat $daemon_pid`
+    sleep 12
+else
+    echo "Starting $daemon..."
+    /usr/sbin/$daemon
+fi
 echo "Here is the log:"
 tail -n 30 $log_file